@@ -1,48 +1,180 @@
 #pragma once
 
 #include <stdlib.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 
 #include "diagnostic.h"
+#include "probes.h"
+
+/**
+ * This header implements an append-only byte queue which is written
+ * during the first pass and read back sequentially during the second.
+ * Bytes are stored in fixed-size segments, so appending never copies
+ * the data written so far. If a memory limit is set, the oldest segments
+ * are spilled to an unlinked temporary file and read back in order.
+ */
+
+#define BYTEQUEUE_SEGMENT_SIZE ((size_t)1024 * 1024)
 
 struct bytequeue {
-	size_t pos, len, cap;
-	uint8_t *array;
+	uint8_t *wptr, *wend; // free space in the last segment
+	const uint8_t *rptr, *rend; // unread bytes in the current segment
+	size_t rseg; // index of the next segment to read
+	uint8_t **segments; // NULL entries have been spilled
+	size_t nsegments, segments_cap;
+	size_t resident, max_resident; // max_resident == 0 means no limit
+	size_t spilled; // the first 'spilled' segments live in 'spill'
+	FILE *spill;
+	uint8_t *readback; // buffer for reading spilled segments
 };
 
 struct bytequeue make_bytequeue(void) {
-	const size_t initsize = 8096;
-	struct bytequeue q = {
-		.pos = 0,
-		.len = 0,
-		.cap = initsize,
-		.array = malloc(initsize)
-	};
+	struct bytequeue q = {0};
 	return q;
 }
 
-static void bytequeue_put(struct bytequeue *q, int c) {
-	if(q->len >= q->cap) {
-		q->cap = q->cap * 4; // can never be 0
-		q->array = realloc(q->array, q->cap);
-		if(!q->array) {
+/* Limits the memory used by queued data to roughly 'max_bytes' */
+void bytequeue_limit_memory(struct bytequeue *q, size_t max_bytes) {
+	q->max_resident = max_bytes / BYTEQUEUE_SEGMENT_SIZE;
+	if(q->max_resident == 0)
+		q->max_resident = 1;
+}
+
+/* Writes the oldest resident segment to the spill file and returns its buffer */
+static uint8_t *bytequeue_spill_segment(struct bytequeue *q) {
+	if(!q->spill && !(q->spill = tmpfile())) {
+		report_error("Couldn't create temporary file for spilling data (error %d)", errno);
+		exit(errno ? errno : 1);
+	}
+	uint8_t *data = q->segments[q->spilled];
+	if(fwrite(data, 1, BYTEQUEUE_SEGMENT_SIZE, q->spill) != BYTEQUEUE_SEGMENT_SIZE) {
+		report_error("Couldn't write to temporary file (error %d)", errno);
+		exit(errno ? errno : 1);
+	}
+	q->segments[q->spilled++] = NULL;
+	return data;
+}
+
+/* Appends a new segment, called when the last segment is full */
+static void bytequeue_grow(struct bytequeue *q) {
+	if(q->nsegments >= q->segments_cap) {
+		size_t cap = (q->segments_cap == 0) ? 16 : q->segments_cap * 2;
+		uint8_t **segments = realloc(q->segments, cap * sizeof(segments[0]));
+		if(!segments) {
 			report_error("Out of memory - couldn't resize buffer");
-			return;
+			exit(ENOMEM);
 		}
+		q->segments = segments;
+		q->segments_cap = cap;
+	}
+	uint8_t *data = NULL;
+	if(!q->max_resident || q->resident < q->max_resident)
+		data = malloc(BYTEQUEUE_SEGMENT_SIZE);
+	if(data) {
+		q->resident++;
+	} else if(q->resident) {
+		// over the limit (or out of memory), recycle the coldest segment
+		data = bytequeue_spill_segment(q);
+	} else {
+		report_error("Out of memory - couldn't allocate buffer");
+		exit(ENOMEM);
+	}
+	q->segments[q->nsegments++] = data;
+	q->wptr = data;
+	q->wend = data + BYTEQUEUE_SEGMENT_SIZE;
+	PROBE2(queue_grow, q->nsegments, q->spilled);
+}
+
+static void bytequeue_put(struct bytequeue *q, int c) {
+	if(q->wptr == q->wend)
+		bytequeue_grow(q);
+	*q->wptr++ = c;
+}
+
+static void bytequeue_write(struct bytequeue *q, const uint8_t *data, size_t len) {
+	while(len) {
+		if(q->wptr == q->wend)
+			bytequeue_grow(q);
+		size_t n = (size_t)(q->wend - q->wptr) < len ? (size_t)(q->wend - q->wptr) : len;
+		memcpy(q->wptr, data, n);
+		q->wptr += n;
+		data += n;
+		len -= n;
 	}
-	q->array[q->len++] = c;
+}
+
+/* Returns the number of bytes written to the queue */
+uint64_t bytequeue_size(const struct bytequeue *q) {
+	return (uint64_t) q->nsegments * BYTEQUEUE_SEGMENT_SIZE - (q->wend - q->wptr);
 }
 
 void bytequeue_rewind(struct bytequeue *q) {
+	q->rseg = 0;
+	q->rptr = q->rend = NULL;
+	if(q->spill) {
+		fflush(q->spill);
+		rewind(q->spill);
+	}
+}
+
+/* Moves the read position to the next segment, returns false at the end */
+static bool bytequeue_next_segment(struct bytequeue *q) {
+	if(q->rseg >= q->nsegments)
+		return false;
+	size_t i = q->rseg++;
+	bool last = i == q->nsegments - 1;
+	if(q->segments[i]) {
+		q->rptr = q->segments[i];
+		q->rend = last ? q->wptr : q->rptr + BYTEQUEUE_SEGMENT_SIZE;
+	} else {
+		// spilled segments are always full and stored in order
+		if(!q->readback && !(q->readback = malloc(BYTEQUEUE_SEGMENT_SIZE))) {
+			report_error("Out of memory - couldn't allocate buffer");
+			exit(ENOMEM);
+		}
+		if(fread(q->readback, 1, BYTEQUEUE_SEGMENT_SIZE, q->spill) != BYTEQUEUE_SEGMENT_SIZE) {
+			report_error("Couldn't read from temporary file (error %d)", errno);
+			exit(errno ? errno : 1);
+		}
+		q->rptr = q->readback;
+		q->rend = q->rptr + BYTEQUEUE_SEGMENT_SIZE;
+	}
+	return true;
 }
 
 static int bytequeue_get(struct bytequeue *q) {
-	if(q->pos >= q->len)
-		return EOF;
-	return q->array[q->pos++];
+	while(q->rptr == q->rend)
+		if(!bytequeue_next_segment(q))
+			return EOF;
+	return *q->rptr++;
+}
+
+/* Empties the queue, keeping the first segment so that small inputs
+	are queued again without allocating */
+void bytequeue_clear(struct bytequeue *q) {
+	size_t keep = (q->nsegments && q->segments[0]) ? 1 : 0;
+	for(size_t i = keep; i < q->nsegments; i++)
+		free(q->segments[i]);
+	if(q->spill)
+		fclose(q->spill);
+	q->spill = NULL;
+	q->spilled = 0;
+	q->nsegments = q->resident = keep;
+	q->wptr = keep ? q->segments[0] : NULL;
+	q->wend = keep ? q->wptr + BYTEQUEUE_SEGMENT_SIZE : NULL;
+	q->rseg = 0;
+	q->rptr = q->rend = NULL;
 }
 
 void free_bytequeue(struct bytequeue q) {
-	OPTIONAL_FREE(q.array);
+	for(size_t i = 0; i < q.nsegments; i++)
+		OPTIONAL_FREE(q.segments[i]);
+	OPTIONAL_FREE(q.segments);
+	OPTIONAL_FREE(q.readback);
+	if(q.spill)
+		fclose(q.spill);
 }
@@ -1,18 +1,28 @@
 #pragma once
 
 #include <math.h>
-#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 
+#include "charclass.h"
 #include "diagnostic.h"
 #include "label.h"
 #include "largenum.h"
+#include "profile.h"
+#include "probes.h"
 
 calc_float_t calc(const char *expr);
 
+/* An expression compiled to reverse polish notation,
+	names are resolved each time it is evaluated */
+struct expression {
+	unsigned len;
+	struct yard_value *code;
+};
+
 #include "text.h"
+#include "float128.h"
 
 bool mathfail = false;
 
@@ -21,19 +31,24 @@ bool mathfail = false;
 #define OPERAND_STACK_SIZE 64
 #define NAME_STACK_SIZE 64
 
-/* Either an operator or a numeric value */
+/* Either an operator, a numeric value or an unresolved name */
 struct yard_value {
 	union {
 		calc_float_t num;
 		int op;
+		const char *name;
 	} content;
-	char isnum;
+	enum {YARD_OP, YARD_NUM, YARD_NAME} kind;
+	bool wide; // integer literal above CALC_INT_MAX, 'num' is rounded
+	const char *text; // source text of number literals, only valid during parsing
 };
 
 struct yard {
 	unsigned slen; // stack length
 	unsigned qlen; // queue length
 	short stack[YARD_STACK_SIZE];
+	unsigned char commas[YARD_STACK_SIZE]; // argument separators seen after each '('
+
 	struct yard_value queue[YARD_QUEUE_SIZE];
 };
 
@@ -83,6 +98,12 @@ int prec(int op) {
 /* Returns true if the operator is left-associative */
 #define leftassoc(op) ((bool)(op == '^'))
 
+/* True if the float converts to calc_int_t without saturating. CALC_INT_MAX
+	rounds up in a float, but CALC_INT_MIN is a power of two, so its negation is exact */
+bool fits_integer(calc_float_t d) {
+	return d >= (calc_float_t)CALC_INT_MIN && d < -(calc_float_t)CALC_INT_MIN;
+}
+
 /* Attempts to convert the float to an integer,
 	handling the case when it has no such representation */
 calc_int_t to_integer(calc_float_t d) {
@@ -90,10 +111,8 @@ calc_int_t to_integer(calc_float_t d) {
 		report_error("%Lf cannot be converted to an integer", (long double)d);
 		return 0;
 	}
-	if(d > CALC_INT_MAX)
-		return CALC_INT_MAX;
-	if(d < CALC_INT_MIN)
-		return CALC_INT_MIN;
+	if(!fits_integer(d))
+		return d < 0 ? CALC_INT_MIN : CALC_INT_MAX;
 	return (calc_int_t)d;
 }
 
@@ -129,6 +148,110 @@ calc_float_t op_eval(int op, calc_float_t a, calc_float_t b) {
 	}
 }
 
+/* Builtin functions, called like "align(x, 4)". Their codes are below
+	any operator character, so they share the operator stack */
+enum builtin {
+	FN_ALIGN = 1, FN_MIN, FN_MAX, FN_LOG2, FN_CLZ, FN_POPCOUNT,
+	FN_BSWAP16, FN_BSWAP32, FN_BSWAP64, FN_SELECT, BUILTIN_COUNT
+};
+
+const struct {
+	char name[12];
+	unsigned char arity;
+} builtins[BUILTIN_COUNT] = {
+	[FN_ALIGN] = {"align", 2},
+	[FN_MIN] = {"min", 2},
+	[FN_MAX] = {"max", 2},
+	[FN_LOG2] = {"log2", 1},
+	[FN_CLZ] = {"clz", 1},
+	[FN_POPCOUNT] = {"popcount", 1},
+	[FN_BSWAP16] = {"bswap16", 1},
+	[FN_BSWAP32] = {"bswap32", 1},
+	[FN_BSWAP64] = {"bswap64", 1},
+	[FN_SELECT] = {"select", 3},
+};
+
+#define IS_BUILTIN(op) ((op) > 0 && (op) < BUILTIN_COUNT)
+
+/* Returns the code of the builtin function or 0 */
+int find_builtin(const char *name) {
+	for(int i = 1; i < BUILTIN_COUNT; i++)
+		if(!strcmp(builtins[i].name, name))
+			return i;
+	return 0;
+}
+
+/* Bit operations on 64-bit words, clz and log2 are undefined for 0 */
+#ifdef __GNUC__
+#	define clz64(x) __builtin_clzll(x)
+#	define popcount64(x) __builtin_popcountll(x)
+#	define bswap64(x) __builtin_bswap64(x)
+#else
+static int clz64(uint64_t x) {
+	int n = 0;
+	for(; !(x >> 63); x <<= 1)
+		n++;
+	return n;
+}
+static int popcount64(uint64_t x) {
+	int n = 0;
+	for(; x; x &= x - 1)
+		n++;
+	return n;
+}
+static uint64_t bswap64(uint64_t x) {
+	uint64_t r = 0;
+	for(int i = 0; i < 8; i++, x >>= 8)
+		r = (r << 8) | (x & 0xFF);
+	return r;
+}
+#endif
+
+/* Rounds x up to a multiple of a, returns false if a isn't positive */
+static bool align_up(calc_int_t x, calc_int_t a, calc_int_t *out) {
+	if(a <= 0) {
+		report_error("Alignment must be positive");
+		return false;
+	}
+	calc_int_t r = x % a;
+	*out = r > 0 ? x - r + a : x - r;
+	return true;
+}
+
+/* Applies the builtin function to its arguments */
+calc_float_t builtin_eval(int fn, const calc_float_t *args) {
+	#define WORD ((uint64_t)to_integer(args[0]))
+	switch(fn) {
+		case FN_ALIGN: {
+			calc_int_t r;
+			if(!align_up(to_integer(args[0]), to_integer(args[1]), &r))
+				break;
+			return r;
+		}
+		case FN_MIN: return args[0] < args[1] ? args[0] : args[1];
+		case FN_MAX: return args[0] > args[1] ? args[0] : args[1];
+		case FN_LOG2: {
+			calc_int_t x = to_integer(args[0]);
+			if(x <= 0) {
+				report_error("log2 of a number which isn't positive");
+				break;
+			}
+			// the upper half is empty unless calc_int_t is wider than 64 bits
+			uint64_t high = (calc_uint_t)x >> 32 >> 32;
+			return high ? 127 - clz64(high) : 63 - clz64((uint64_t)x);
+		}
+		case FN_CLZ: return WORD ? clz64(WORD) : 64;
+		case FN_POPCOUNT: return popcount64(WORD);
+		case FN_BSWAP16: return bswap64(WORD) >> 48;
+		case FN_BSWAP32: return bswap64(WORD) >> 32;
+		case FN_BSWAP64: return bswap64(WORD);
+		case FN_SELECT: return args[0] != 0 ? args[1] : args[2];
+	}
+	#undef WORD
+	mathfail = true;
+	return NAN;
+}
+
 /* appends the value to end of queue */
 void yard_put(struct yard *yard, struct yard_value v) {
 	if(yard->qlen >= YARD_QUEUE_SIZE) {
@@ -146,6 +269,7 @@ void yard_push(struct yard *yard, int op) {
 		report_error("Shunting yard stack overflow");
 		return;
 	}
+	yard->commas[yard->slen] = 0;
 	yard->stack[yard->slen++] = op;
 }
 
@@ -169,11 +293,52 @@ int yard_peek(struct yard *yard) {
 
 void yard_add_num(struct yard *yard, calc_float_t x) {
 	struct yard_value value = {
-		.isnum = 1,
+		.kind = YARD_NUM,
+		.content = {.num = x},
+	};
+	yard_put(yard, value);
+}
+void yard_add_literal(struct yard *yard, calc_float_t x, const char *text, bool wide) {
+	struct yard_value value = {
+		.kind = YARD_NUM,
 		.content = {.num = x},
+		.wide = wide,
+		.text = text,
+	};
+	yard_put(yard, value);
+}
+/* Largest magnitude which every calc_float_t holds exactly */
+#define EXACT_FLOAT_LIMIT 9007199254740992.0 // 2^53
+
+/* Appends a call of the builtin function, or its result
+	if all arguments are small constants */
+void yard_add_call(struct yard *yard, int fn) {
+	unsigned n = builtins[fn].arity;
+	bool constant = yard->qlen >= n;
+	calc_float_t args[3];
+	for(unsigned i = 0; constant && i < n; i++) {
+		struct yard_value v = yard->queue[yard->qlen - n + i];
+		args[i] = v.content.num;
+		// larger literals are parsed again by the wide evaluator
+		constant = v.kind == YARD_NUM && fabsl((long double)args[i]) < EXACT_FLOAT_LIMIT;
+	}
+	if(constant) {
+		calc_float_t result = builtin_eval(fn, args);
+		if(mathfail)
+			return;
+		if(fabsl((long double)result) < EXACT_FLOAT_LIMIT) {
+			yard->qlen -= n;
+			yard_add_num(yard, result);
+			return;
+		}
+	}
+	struct yard_value value = {
+		.kind = YARD_OP,
+		.content = {.op = fn},
 	};
 	yard_put(yard, value);
 }
+
 /* https://en.wikipedia.org/wiki/Shunting-yard_algorithm */
 
 void yard_add_op(struct yard *yard, int op) {
@@ -193,7 +358,7 @@ void yard_add_op(struct yard *yard, int op) {
 	) {
 		// pop operators from the operator stack onto the output queue
 		struct yard_value value = {
-			.isnum = 0,
+			.kind = YARD_OP,
 			.content = {.op = yard_pop(yard)},
 		};
 		yard_put(yard, value);
@@ -219,38 +384,30 @@ void operand_push(struct operand_stack *stack, calc_float_t x) {
 
 calc_float_t operand_pop(struct operand_stack *stack) {
 	if(!stack->len) {
+		mathfail = true;
 		report_error("Operand stack underflow");
 		return NAN;
 	}
 	return stack->stack[--stack->len];
 }
 
-calc_float_t yard_compute(struct yard *yard) {
-	/* pop remaining operators into output queue */
+/* pops remaining operators into output queue */
+void yard_finish(struct yard *yard) {
 	while(yard->slen) {
 		struct yard_value value = {
-			.isnum = 0,
+			.kind = YARD_OP,
 			.content = {.op = yard_pop(yard)},
 		};
 		yard_put(yard, value);
 		if(mathfail)
-			return NAN;
-	}
-	struct operand_stack stack = {0};
-	for(unsigned i = 0; i < yard->qlen; i++) {
-		struct yard_value v = yard->queue[i];
-		if(v.isnum) {
-			operand_push(&stack, v.content.num);
-		} else {
-			calc_float_t b = operand_pop(&stack);
-			calc_float_t a = operand_pop(&stack);
-			calc_float_t result = op_eval(v.content.op, a, b);
-			operand_push(&stack, result);
-		}
-		if(mathfail)
-			return NAN;
+			return;
 	}
-	return operand_pop(&stack);
+}
+
+void yard_free_names(const struct yard_value *queue, unsigned len) {
+	for(unsigned i = 0; i < len; i++)
+		if(queue[i].kind == YARD_NAME)
+			free((char*) queue[i].content.name);
 }
 
 const char *namestack[NAME_STACK_SIZE];
@@ -280,92 +437,253 @@ int namestack_contains(const char *name) {
 	return 0;
 }
 
-calc_float_t calc(const char *expr) {
+/* While set, resolves names before labels; returns false for names it doesn't know */
+bool (*resolve_name_hook)(const char *name, calc_float_t *out) = NULL;
+
+/* Resolves a name to its value, evaluating lazy labels recursively */
+calc_float_t resolve_name(const char *name) {
+	calc_float_t value;
+	if(resolve_name_hook && resolve_name_hook(name, &value))
+		return value;
+	struct label label;
+	if(!lookup_label(name, &label)) {
+		mathfail = true;
+		report_error("Unknown identifier: \"%s\"", name);
+		return NAN;
+	}
+	if(!label.expr)
+		return label.constant;
+	if(namestack_contains(name)) {
+		mathfail = true;
+		report_error("Recursive label: \"%s\"", name);
+		return NAN;
+	}
+	namestack_push(name);
+	if(profile_mode)
+		profile_enter();
+	calc_float_t result = calc(label.expr);
+	if(profile_mode)
+		profile_leave(namestack, namestack_len);
+	namestack_pop();
+	return result;
+}
+
+/* Wide integer literals are exact in 'wide_calc' and are rejected
+	elsewhere, unless this is set because the result is a float anyway */
+bool allow_wide_literals = false;
+
+/* Evaluates an expression in reverse polish notation */
+calc_float_t rpn_eval(const struct yard_value *queue, unsigned len) {
+	struct operand_stack stack = {0};
+	for(unsigned i = 0; i < len; i++) {
+		struct yard_value v = queue[i];
+		if(v.kind == YARD_NUM) {
+			if(v.wide && !allow_wide_literals) {
+				mathfail = true;
+				report_error("Integer literal doesn't fit in " CALC_INT_TYPENAME);
+			}
+			operand_push(&stack, v.content.num);
+		} else if(v.kind == YARD_NAME) {
+			operand_push(&stack, resolve_name(v.content.name));
+		} else if(IS_BUILTIN(v.content.op)) {
+			calc_float_t args[3];
+			for(unsigned j = builtins[v.content.op].arity; j-- > 0;)
+				args[j] = operand_pop(&stack);
+			operand_push(&stack, builtin_eval(v.content.op, args));
+		} else {
+			calc_float_t b = operand_pop(&stack);
+			calc_float_t a = operand_pop(&stack);
+			calc_float_t result = op_eval(v.content.op, a, b);
+			operand_push(&stack, result);
+		}
+		if(mathfail)
+			return NAN;
+	}
+	return operand_pop(&stack);
+}
+
+/* Returns the base of a numeric literal (0x, 0b, 0 or decimal)
+	and stores the length of its prefix */
+unsigned literal_base(const char *text, size_t *prefix_len) {
+	*prefix_len = 0;
+	if(text[0] != '0')
+		return 10;
+	if(CHAR_IS(text[1], CC_DIGIT)) {
+		// like in C, but 019 and 010.5 are still decimal
+		size_t n = 1 + strspn(text + 1, "01234567");
+		if(CHAR_IS(text[n], CC_DIGIT) || text[n] == '.' || (text[n] | 0x20) == 'e')
+			return 10;
+		*prefix_len = 1;
+		return 8;
+	}
+	unsigned base = 10;
+	if(text[1] == 'x' || text[1] == 'X')
+		base = 16;
+	else if(text[1] == 'b' || text[1] == 'B')
+		base = 2;
+	if(base == 10)
+		return 10;
+	// a prefix without digits is just a zero
+	int digit = hex2int(text[2]);
+	if(digit < 0 || digit >= (int)base)
+		return 10;
+	*prefix_len = 2;
+	return base;
+}
+
+/* Parses a numeric literal, returns the number of characters consumed.
+	Integers are read exactly, fractions and exponents are rounded once,
+	by strtold unless calc_float_t is wider than long double.
+	'wide' is set for integers above CALC_INT_MAX, which are rounded */
+size_t scan_number(const char *text, calc_float_t *out, bool *wide) {
+	size_t i;
+	unsigned base = literal_base(text, &i);
+	size_t start = i;
+	calc_uint_t value = 0;
+	bool overflow = false;
+	for(int digit; (digit = hex2int(text[i])) >= 0 && digit < (int)base; i++) {
+		if(value > (~(calc_uint_t)0 - digit) / base)
+			overflow = true;
+		value = value * base + digit;
+	}
+	char next = text[i] | 0x20; // lowercase
+	bool fraction = text[i] == '.' || (base == 10 && next == 'e') || (base == 16 && next == 'p');
+	*wide = !fraction && (overflow || value > (calc_uint_t)CALC_INT_MAX);
+	if((fraction || overflow) && (base == 10 || base == 16)) {
+#ifdef HAVE_SCAN_FLOAT128
+		return start + scan_float128(text + start, base, out);
+#endif
+		char *end;
+		*out = strtold(text, &end);
+		return end - text;
+	}
+	if(overflow) {
+		// wider than calc_int_t, the exact value is only seen by the wide evaluator
+		calc_float_t f = 0;
+		for(size_t j = start; j < i; j++)
+			f = f * base + hex2int(text[j]);
+		*out = f;
+		return i;
+	}
+	*out = value;
+	return i;
+}
+
+/* Converts the expression to reverse polish notation in the yard queue,
+	returns false on failure */
+bool yard_parse(struct yard *yard, const char *expr) {
 	mathfail = false;
-	struct yard yard = {0};
 	expr += scan_whitespace(expr);
 	bool expect_unary = true;
+	const char *empty_parens = NULL;
 	// while there are tokens to be read
 	while(expr[0]) {
 		// if the token is a number
-		if(isdigit(expr[0])) {
-			char *numend;
-			calc_float_t num = strtold(expr, &numend);
-			expr = numend;
+		if(CHAR_IS(expr[0], CC_DIGIT)) {
+			calc_float_t num;
+			bool wide;
+			size_t numlen = scan_number(expr, &num, &wide);
 			// push it to the output queue
-			yard_add_num(&yard, num);
+			yard_add_literal(yard, num, expr, wide);
+			expr += numlen;
 			expect_unary = false;
-		} else if(expr[0] == '.' || expr[0] == '_' || isalpha(expr[0])) {
-			// if the token is a variable, calculate recursively
-			const char *name;
+		} else if(CHAR_IS(expr[0], CC_NAME)) {
+			// if the token is a variable, it will be resolved during evaluation
+			const char *name = NULL;
 			expr += scan_name(expr, &name);
-			struct label label;
-			calc_float_t result;
-			if(!lookup_label(name, &label)) {
-				mathfail = true;
-				report_error("Unknown identifier: \"%s\"", name);
-				result = NAN;
-			} else if(label.expr) {
-				if(namestack_contains(name)) {
-					mathfail = true;
-					report_error("Recursive label: \"%s\"", name);
-					free((char*) name);
-					return NAN;
-				}
-				namestack_push(name);
-				result = calc(label.expr);
-				namestack_pop();
-			} else {
-				result = label.constant;
+			int fn = find_builtin(name);
+			if(fn && expr[scan_whitespace(expr)] == '(') {
+				// the call is emitted when its ')' is reached
+				free((char*) name);
+				yard_push(yard, fn);
+				expr += scan_whitespace(expr);
+				continue;
 			}
-			free((char*) name);
-			// push it to the output queue
-			yard_add_num(&yard, result);
+			struct yard_value value = {
+				.kind = YARD_NAME,
+				.content = {.name = name},
+			};
+			yard_put(yard, value);
+			if(mathfail)
+				free((char*) name);
 			expect_unary = false;
 		} else if(expr[0] == ')') {
 			// while top operator is not a left parenthesis
-			while(yard_peek(&yard) != '(') {
+			while(yard_peek(yard) != '(') {
 				// ...pop operator from stack to output queue
 				struct yard_value value = {
-					.isnum = 0,
-					.content = {.op = yard_pop(&yard)},
+					.kind = YARD_OP,
+					.content = {.op = yard_pop(yard)},
 				};
-				yard_put(&yard, value);
+				yard_put(yard, value);
 				if(mathfail)
-					return NAN;
+					return false;
 			}
 			// if top operand is a left parenthesis
-			if(yard_peek(&yard) == '(') {
-				yard_pop(&yard); // discard it
+			unsigned nargs = expr == empty_parens ? 0 : yard->commas[yard->slen - 1] + 1;
+			if(yard_peek(yard) == '(') {
+				yard_pop(yard); // discard it
+			}
+			int fn = yard_peek(yard);
+			if(IS_BUILTIN(fn)) {
+				yard_pop(yard);
+				if(nargs != builtins[fn].arity) {
+					report_error("%s() takes %d argument(s)", builtins[fn].name, builtins[fn].arity);
+					return false;
+				}
+				yard_add_call(yard, fn);
+			} else if(nargs > 1) {
+				report_error("Unexpected ',' outside of a function call");
+				return false;
 			}
 			expr++;
 			expect_unary = false;
 			// end of right parenthesis handling
+		} else if(expr[0] == ',') {
+			// finish the previous argument
+			while(yard->slen && yard_peek(yard) != '(') {
+				struct yard_value value = {
+					.kind = YARD_OP,
+					.content = {.op = yard_pop(yard)},
+				};
+				yard_put(yard, value);
+				if(mathfail)
+					return false;
+			}
+			if(!yard->slen) {
+				report_error("Unexpected ',' outside of a function call");
+				return false;
+			}
+			yard->commas[yard->slen - 1]++;
+			expr++;
+			expect_unary = true;
 		} else if(expr[0] == '(') {
 			// if the token is a left parenthesis,
 			//push it onto the operator stack.
-			yard_add_op(&yard, '(');
+			yard_add_op(yard, '(');
 			expr++;
+			// a ')' here closes an empty argument list
+			empty_parens = expr + scan_whitespace(expr);
 			expect_unary = true;
-		} else if(ispunct(expr[0])) {
+		} else if(CHAR_IS(expr[0], CC_PUNCT)) {
 			// if the token is an operator,
 			// push it onto the operator stack.
 
 			if(expect_unary) {
 				switch(expr[0]) {
-					case '~': yard_add_num(&yard, -1); break;
-					case '-': yard_add_num(&yard, 0); break;
+					case '~': yard_add_num(yard, -1); break;
+					case '-': yard_add_num(yard, 0); break;
 				}
 			}
 
 			int op = expr[0];
-			if(ispunct(expr[1]) && prec(OP_CODE(expr[0], expr[1]))) {
+			if(CHAR_IS(expr[1], CC_PUNCT) && prec(OP_CODE(expr[0], expr[1]))) {
 				// we have a two-char operator
 				op = OP_CODE(expr[0], expr[1]);
 				expr++;
 			}
 			expr++;
-			yard_add_op(&yard, op);
+			yard_add_op(yard, op);
 			expect_unary = op != '^'; // too lazy to implement negative exponents... use parentheses instead
 		} else {
 			report_error("Unknown character (char)%d = '%c'", (int)expr[0], (char)expr[0]);
@@ -373,7 +691,44 @@ calc_float_t calc(const char *expr) {
 		}
 		expr += scan_whitespace(expr);
 		if(mathfail)
-			return NAN;
+			return false;
 	}
-	return yard_compute(&yard);
+	yard_finish(yard);
+	return !mathfail;
+}
+
+calc_float_t calc(const char *expr) {
+	if(profile_mode)
+		profile_count_call();
+	PROBE1(calc_start, expr);
+	struct yard yard = {0};
+	calc_float_t result = yard_parse(&yard, expr)
+		? rpn_eval(yard.queue, yard.qlen)
+		: NAN;
+	yard_free_names(yard.queue, yard.qlen);
+	PROBE2(calc_end, expr, &result);
+	return result;
+}
+
+/* Parses the expression once so that it can be evaluated many times */
+bool compile_expr(const char *expr, struct expression *out) {
+	struct yard yard = {0};
+	if(!yard_parse(&yard, expr)) {
+		yard_free_names(yard.queue, yard.qlen);
+		return false;
+	}
+	out->len = yard.qlen;
+	out->code = malloc(yard.qlen * sizeof(yard.queue[0]));
+	memcpy(out->code, yard.queue, yard.qlen * sizeof(yard.queue[0]));
+	return true;
+}
+
+calc_float_t eval_expr(struct expression e) {
+	mathfail = false;
+	return rpn_eval(e.code, e.len);
+}
+
+void free_expr(struct expression e) {
+	yard_free_names(e.code, e.len);
+	free(e.code);
 }
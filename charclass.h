@@ -0,0 +1,51 @@
+#pragma once
+
+/**
+ * Locale independent character classes. The scanners look characters up
+ * in this table instead of calling <ctype.h>, so "is this a name character"
+ * is a single load and doesn't depend on setlocale().
+ */
+
+enum char_class {
+	CC_SPACE = 1,
+	CC_DIGIT = 2,
+	CC_HEX = 4, // hexadecimal digit
+	CC_ALPHA = 8,
+	CC_NAME = 16, // may appear in a label name
+	CC_PUNCT = 32
+};
+
+#define S CC_SPACE
+#define D (CC_DIGIT | CC_HEX | CC_NAME)
+#define X (CC_ALPHA | CC_HEX | CC_NAME)
+#define A (CC_ALPHA | CC_NAME)
+#define N (CC_PUNCT | CC_NAME)
+#define P CC_PUNCT
+const unsigned char char_class[256] = {
+	[' '] = S, ['\t'] = S, ['\n'] = S, ['\v'] = S, ['\f'] = S, ['\r'] = S,
+	['0'] = D, ['1'] = D, ['2'] = D, ['3'] = D, ['4'] = D, ['5'] = D, ['6'] = D, ['7'] = D,
+	['8'] = D, ['9'] = D,
+	['a'] = X, ['b'] = X, ['c'] = X, ['d'] = X, ['e'] = X, ['f'] = X, ['A'] = X, ['B'] = X,
+	['C'] = X, ['D'] = X, ['E'] = X, ['F'] = X,
+	['g'] = A, ['h'] = A, ['i'] = A, ['j'] = A, ['k'] = A, ['l'] = A, ['m'] = A, ['n'] = A,
+	['o'] = A, ['p'] = A, ['q'] = A, ['r'] = A, ['s'] = A, ['t'] = A, ['u'] = A, ['v'] = A,
+	['w'] = A, ['x'] = A, ['y'] = A, ['z'] = A,
+	['G'] = A, ['H'] = A, ['I'] = A, ['J'] = A, ['K'] = A, ['L'] = A, ['M'] = A, ['N'] = A,
+	['O'] = A, ['P'] = A, ['Q'] = A, ['R'] = A, ['S'] = A, ['T'] = A, ['U'] = A, ['V'] = A,
+	['W'] = A, ['X'] = A, ['Y'] = A, ['Z'] = A,
+	['.'] = N, ['_'] = N,
+	['!'] = P, ['"'] = P, ['#'] = P, ['$'] = P, ['%'] = P, ['&'] = P, ['\''] = P, ['('] = P,
+	[')'] = P, ['*'] = P, ['+'] = P, [','] = P, ['-'] = P, ['/'] = P, [':'] = P, [';'] = P,
+	['<'] = P, ['='] = P, ['>'] = P, ['?'] = P, ['@'] = N, ['['] = P, ['\\'] = P, [']'] = P,
+	['^'] = P, ['`'] = P, ['{'] = P, ['|'] = P, ['}'] = P, ['~'] = P,};
+#undef S
+#undef D
+#undef X
+#undef A
+#undef N
+#undef P
+
+#define CHAR_IS(c, classes) (char_class[(unsigned char)(c)] & (classes))
+
+/* Value of a character which is CC_HEX */
+#define HEX_VALUE(c) (CHAR_IS(c, CC_DIGIT) ? (c) - '0' : ((c) | 0x20) - 'a' + 10)
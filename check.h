@@ -0,0 +1,201 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#ifdef _POSIX_C_SOURCE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "diagnostic.h"
+
+/**
+ * This header implements '--check' and '--diff', which compare the
+ * generated output with an existing file instead of writing it.
+ * Output arrives in chunks; each chunk is compared with memcmp against
+ * the mapped file and only differing chunks are examined byte by byte.
+ */
+
+#define CHECK_BLOCK_SIZE 64
+
+struct checker {
+	bool list_ranges; // true for --diff, false for --check
+	const char *file_name;
+	const uint8_t *reference;
+	uint64_t reference_size;
+	bool mapped;
+	// output position where each input line in the current chunk starts,
+	// the file and line follow line markers
+	struct line_start {
+		uint64_t pos, line;
+		const char *file_name;
+	} *lines;
+	size_t nlines, lines_cap;
+	struct line_start chunk_start; // input line at the start of the current chunk
+	// --diff state
+	bool in_range;
+	uint64_t range_start;
+	uint64_t nranges;
+};
+
+/* Opens the reference file, returns false on failure */
+bool open_checker(struct checker *c, const char *file_name, bool list_ranges) {
+	struct checker result = {
+		.list_ranges = list_ranges,
+		.file_name = file_name,
+		.chunk_start = {.line = 1, .file_name = current_file_name},
+	};
+	*c = result;
+#ifdef _POSIX_C_SOURCE
+	int fd = open(file_name, O_RDONLY);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "Couldn't open file \"%s\" (error %d)\n", file_name, (int) errno);
+		if(fd >= 0)
+			close(fd);
+		return false;
+	}
+	c->reference_size = st.st_size;
+	if(st.st_size > 0) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(map != MAP_FAILED) {
+			c->reference = map;
+			c->mapped = true;
+#ifdef POSIX_MADV_SEQUENTIAL
+			posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+#endif
+		}
+	}
+	close(fd);
+	if(c->mapped || st.st_size == 0)
+		return true;
+#endif
+	// no mmap available, read the whole file instead
+	FILE *file = fopen(file_name, "rb");
+	if(!file) {
+		fprintf(stderr, "Couldn't open file \"%s\" (error %d)\n", file_name, (int) errno);
+		return false;
+	}
+	size_t cap = 64 * 1024, len = 0;
+	uint8_t *data = malloc(cap);
+	for(size_t n; (n = fread(data + len, 1, cap - len, file)) > 0;) {
+		len += n;
+		if(len == cap)
+			data = realloc(data, cap *= 2);
+	}
+	fclose(file);
+	c->reference = data;
+	c->reference_size = len;
+	return true;
+}
+
+/* Records that line 'line' of 'source' starts at output position 'pos' */
+void checker_mark_line(struct checker *c, uint64_t pos, const char *source, uint64_t line) {
+	if(c->nlines >= c->lines_cap) {
+		c->lines_cap = (c->lines_cap == 0) ? 64 : c->lines_cap * 2;
+		c->lines = realloc(c->lines, c->lines_cap * sizeof(c->lines[0]));
+	}
+	struct line_start l = {.pos = pos, .line = line, .file_name = source};
+	c->lines[c->nlines++] = l;
+}
+
+/* Finds the input line which produced the output byte at 'pos' */
+static struct line_start checker_line_at(struct checker *c, uint64_t pos) {
+	struct line_start line = c->chunk_start;
+	for(size_t i = 0; i < c->nlines && c->lines[i].pos <= pos; i++)
+		line = c->lines[i];
+	return line;
+}
+
+static void checker_mismatch(struct checker *c, uint64_t pos) {
+	struct line_start line = checker_line_at(c, pos);
+	fprintf(stderr, "Output differs from \"%s\" at offset %"PRIu64" (0x%"PRIx64"), input %s:%"PRIu64"\n",
+		c->file_name, pos, pos, line.file_name, line.line);
+	exit(1);
+}
+
+static void checker_begin_range(struct checker *c, uint64_t pos) {
+	if(!c->in_range) {
+		c->in_range = true;
+		c->range_start = pos;
+	}
+}
+
+static void checker_end_range(struct checker *c, uint64_t pos) {
+	if(c->in_range) {
+		c->in_range = false;
+		c->nranges++;
+		printf("0x%08"PRIx64" 0x%08"PRIx64"\n", c->range_start, pos - c->range_start);
+	}
+}
+
+/* Compares a chunk of output which starts at output position 'pos' */
+void checker_compare(struct checker *c, const uint8_t *data, size_t len, uint64_t pos) {
+	uint64_t available = pos < c->reference_size ? c->reference_size - pos : 0;
+	size_t common = len < available ? len : (size_t) available;
+	// only points into the reference if part of it overlaps the chunk
+	const uint8_t *ref = common ? c->reference + pos : NULL;
+
+	if(common && !memcmp(data, ref, common)) {
+		// fast path, the whole chunk is equal
+		checker_end_range(c, pos);
+	} else {
+		for(size_t block = 0; block < common; block += CHECK_BLOCK_SIZE) {
+			size_t n = common - block < CHECK_BLOCK_SIZE ? common - block : CHECK_BLOCK_SIZE;
+			if(!memcmp(data + block, ref + block, n)) {
+				checker_end_range(c, pos + block);
+				continue;
+			}
+			for(size_t i = block; i < block + n; i++) {
+				if(data[i] == ref[i]) {
+					checker_end_range(c, pos + i);
+				} else if(!c->list_ranges) {
+					checker_mismatch(c, pos + i);
+				} else {
+					checker_begin_range(c, pos + i);
+				}
+			}
+		}
+	}
+	if(common < len) {
+		// output is longer than the reference
+		if(!c->list_ranges)
+			checker_mismatch(c, pos + common);
+		checker_begin_range(c, pos + common);
+	}
+
+	if(c->nlines)
+		c->chunk_start = c->lines[c->nlines - 1];
+	c->nlines = 0;
+}
+
+/* Finishes the comparison, returns the exit status */
+int close_checker(struct checker *c, uint64_t output_size) {
+	checker_end_range(c, output_size);
+	if(output_size < c->reference_size) {
+		if(!c->list_ranges) {
+			fprintf(stderr, "Output ends at offset %"PRIu64", but \"%s\" has %"PRIu64" bytes\n",
+				output_size, c->file_name, c->reference_size);
+		} else {
+			fprintf(stderr, "\"%s\" has %"PRIu64" more bytes than the output\n",
+				c->file_name, c->reference_size - output_size);
+		}
+	}
+	int status = (c->nranges || output_size != c->reference_size) ? 1 : 0;
+#ifdef _POSIX_C_SOURCE
+	if(c->mapped)
+		munmap((void*) c->reference, c->reference_size);
+	else
+#endif
+	free((void*) c->reference);
+	free(c->lines);
+	return status;
+}
@@ -5,25 +5,50 @@
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "label.h"
 #include "calc.h"
 #include "diagnostic.h"
+#include "text.h"
+
 /* True if debugger has been enabled */
 bool debug_mode = false;
 /* True if the debugger should be entered on next line */
 volatile bool break_on_next = false;
-// in practice there are only a few breakpoints, so linear searching is okay
-/* Array of breakpoints */
-uint64_t *breaklist = NULL;
+
+struct breakpoint {
+	uint64_t line;
+	bool conditional;
+	struct expression condition;
+};
+
+/* Array of breakpoints, sorted by line number */
+struct breakpoint *breaklist = NULL;
 unsigned breaklist_len = 0;
 unsigned breaklist_cap = 0;
+/* Line of the next breakpoint; lines before it are not checked at all */
+uint64_t next_breakpoint_line = UINT64_MAX;
+
+// in practice there are only a few watchpoints, so linear searching is okay
+/* Array of watched label names */
+const char **watchlist = NULL;
+unsigned watchlist_len = 0;
+unsigned watchlist_cap = 0;
+
+/* True while the debugger prompt is active */
+bool in_debugger = false;
+
+/* The current byte offset, defined in interpreter.h */
+extern uint64_t offset;
 
 // returns false if the debugger should exit here
 typedef bool debugger_function(void);
 
 // some commands implemented at the end, for readability
 bool debugger_add_break(void);
+bool debugger_delete_break(void);
+bool debugger_add_watch(void);
 bool debugger_resume(void) { return false; }
 bool debugger_step(void) { break_on_next = true; return false; }
 bool debugger_vars(void);
@@ -36,6 +61,10 @@ const struct {
 } debugger_commands[] = {
 	{"break",  &debugger_add_break},
 	{"b",    &debugger_add_break},
+	{"delete", &debugger_delete_break},
+	{"d",      &debugger_delete_break},
+	{"watch",  &debugger_add_watch},
+	{"w",      &debugger_add_watch},
 	{"resume", &debugger_resume},
 	{"r",    &debugger_resume},
 	{"step",   &debugger_step},
@@ -75,6 +104,8 @@ void enter_debugger_async(int unused) {
 	break_on_next = true;
 }
 void enter_debugger() {
+	in_debugger = true;
+
 	if(signal(SIGINT, SIG_DFL) == SIG_ERR)
 		fprintf(stderr, "Internal error: could not setup signal handler for SIGINT, errno = %d\n", errno);
 
@@ -86,6 +117,92 @@ void enter_debugger() {
 		fprintf(stderr, "Internal error: could not setup signal handler for SIGINT, errno = %d\n", errno);
 	if(isatty(fileno(stderr)))
 		fprintf(stderr, "\033[0m"); // reset terminal color
+	in_debugger = false;
+}
+
+/* Returns the index of the first breakpoint at or after given line */
+unsigned find_breakpoint(uint64_t linenum) {
+	unsigned low = 0, high = breaklist_len;
+	while(low < high) {
+		unsigned mid = low + (high - low) / 2;
+		if(breaklist[mid].line < linenum)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+/* Moves the breakpoint cursor to the first breakpoint at or after given line,
+	must be called whenever the line number jumps backwards */
+void seek_breakpoints(uint64_t linenum) {
+	unsigned i = find_breakpoint(linenum);
+	next_breakpoint_line = i < breaklist_len ? breaklist[i].line : UINT64_MAX;
+}
+
+/* Lets debugger expressions refer to the current position as 'offset' */
+static bool debugger_resolve_name(const char *name, calc_float_t *out) {
+	if(strcmp(name, "offset"))
+		return false;
+	*out = offset;
+	return true;
+}
+
+/* Called when the current line has reached the breakpoint cursor,
+	returns true if the debugger should be entered */
+bool breakpoint_hit(uint64_t linenum) {
+	unsigned i = find_breakpoint(linenum);
+	seek_breakpoints(linenum + 1);
+	if(i >= breaklist_len || breaklist[i].line != linenum)
+		return false;
+	if(!breaklist[i].conditional)
+		return true;
+	resolve_name_hook = debugger_resolve_name;
+	calc_float_t result = eval_expr(breaklist[i].condition);
+	resolve_name_hook = NULL;
+	return !mathfail && result != 0;
+}
+
+/* Prints the value of a constant label and a newline */
+static void print_constant(calc_int_t c) {
+	if((long long)c == c)
+		fprintf(stderr, "%lld\n", (long long)c);
+	else
+		fprintf(stderr, "%.0Lf\n", (long double)c);
+}
+
+/* Enters the debugger after a watched label has been assigned */
+void watch_label(const char *name) {
+	if(in_debugger)
+		return;
+	for(unsigned i = 0; i < watchlist_len; i++) {
+		if(!strcmp(watchlist[i], name)) {
+			struct label label = {0};
+			lookup_label(name, &label);
+			if(label.expr) {
+				fprintf(stderr, "Label \"%s\" changed to \"%s\"\n", name, label.expr);
+			} else {
+				fprintf(stderr, "Label \"%s\" changed to ", name);
+				print_constant(label.constant);
+			}
+			enter_debugger();
+			return;
+		}
+	}
+}
+
+/* Reads the rest of the command line without the trailing newline */
+static char *debugger_read_line(void) {
+	char *line = NULL;
+	size_t cap = 0;
+	if(getline(&line, &cap, stdin) == -1) {
+		free(line);
+		return NULL;
+	}
+	size_t len = strlen(line);
+	trim_end(line, &len);
+	line[len] = '\0';
+	return line;
 }
 
 // implementations of debugger commands
@@ -94,48 +211,114 @@ bool debugger_vars(void) {
 	for(unsigned i = 0; i < 64; i++) {
 		struct label *label = &labelmap[i];
 		while(label && label->name) {
-			if(label->expr)
+			if(label->expr) {
 				fprintf(stderr, "\t%2u: %16s = \"%s\"\n",
 					i, label->name, label->expr);
-			else
-				fprintf(stderr, "\t%2u: %16s = %u\n",
-					i, label->name, label->constant);
+			} else {
+				fprintf(stderr, "\t%2u: %16s = ", i, label->name);
+				print_constant(label->constant);
+			}
 			label = label->next;
 		}
 	}
 	return true;
 }
 
-bool exists_breakpoint(uint64_t linenum) {
-	for(unsigned i = 0; i < breaklist_len; i++)
-		if(breaklist[i] == linenum)
+bool debugger_add_break(void) {
+	uint64_t linenum;
+	if(fscanf(stdin, "%"SCNu64, &linenum) != 1)
+		return true;
+	char *rest = debugger_read_line();
+	const char *cond = rest ? rest + scan_whitespace(rest) : "";
+	struct breakpoint bp = {.line = linenum};
+	if(cond[0]) {
+		if(strncmp(cond, "if", 2) || !CHAR_IS(cond[2], CC_SPACE)) {
+			fprintf(stderr, "  Expected \"if\" after line number\n");
+			free(rest);
 			return true;
-	return false;
+		}
+		if(!compile_expr(cond + 2, &bp.condition)) {
+			free(rest);
+			return true;
+		}
+		bp.conditional = true;
+	}
+	free(rest);
+
+	unsigned i = find_breakpoint(linenum);
+	if(i < breaklist_len && breaklist[i].line == linenum) {
+		// replace the condition of an existing breakpoint
+		if(breaklist[i].conditional)
+			free_expr(breaklist[i].condition);
+		breaklist[i] = bp;
+	} else {
+		if(breaklist_len >= breaklist_cap) {
+			breaklist_cap = (breaklist_cap == 0) ? 16 : breaklist_cap * 3;
+			breaklist = realloc(breaklist, breaklist_cap*sizeof(breaklist[0]));
+		}
+		memmove(&breaklist[i + 1], &breaklist[i], (breaklist_len - i) * sizeof(breaklist[0]));
+		breaklist[i] = bp;
+		breaklist_len++;
+	}
+	seek_breakpoints(line_number + 1);
+	fprintf(stderr, "Added %sbreakpoint before line %"PRIu64"\n",
+		bp.conditional ? "conditional " : "", linenum);
+	return true;
 }
 
-bool debugger_add_break(void) {
+bool debugger_delete_break(void) {
 	uint64_t linenum;
-	if(fscanf(stdin, "%"SCNu64, &linenum) == EOF)
+	if(fscanf(stdin, "%"SCNu64, &linenum) != 1)
 		return true;
-	if(exists_breakpoint(linenum))
+	unsigned i = find_breakpoint(linenum);
+	if(i >= breaklist_len || breaklist[i].line != linenum) {
+		fprintf(stderr, "  No breakpoint before line %"PRIu64"\n", linenum);
 		return true;
-	if(breaklist_len >= breaklist_cap) {
-		breaklist_cap = (breaklist_cap == 0) ? 16 : breaklist_cap * 3;
-		breaklist = realloc(breaklist, breaklist_cap*sizeof(breaklist[0]));
 	}
-	breaklist[breaklist_len++] = linenum;
-	fprintf(stderr, "Added breakpoint before line %"PRIu64"\n", linenum);
+	if(breaklist[i].conditional)
+		free_expr(breaklist[i].condition);
+	memmove(&breaklist[i], &breaklist[i + 1], (breaklist_len - i - 1) * sizeof(breaklist[0]));
+	breaklist_len--;
+	seek_breakpoints(line_number + 1);
+	fprintf(stderr, "Deleted breakpoint before line %"PRIu64"\n", linenum);
+	return true;
+}
+
+bool debugger_add_watch(void) {
+	char name[64];
+	/* always scanf 1 less character than buffer size */
+	if(fscanf(stdin, "%63s", name) != 1)
+		return true;
+	for(unsigned i = 0; i < watchlist_len; i++)
+		if(!strcmp(watchlist[i], name))
+			return true;
+	if(watchlist_len >= watchlist_cap) {
+		watchlist_cap = (watchlist_cap == 0) ? 16 : watchlist_cap * 3;
+		watchlist = realloc(watchlist, watchlist_cap*sizeof(watchlist[0]));
+	}
+	watchlist[watchlist_len++] = strdup(name);
+	label_assign_hook = watch_label;
+	fprintf(stderr, "Watching label \"%s\"\n", name);
 	return true;
 }
 
 void cleanup_breakpoints(void) {
+	for(unsigned i = 0; i < breaklist_len; i++)
+		if(breaklist[i].conditional)
+			free_expr(breaklist[i].condition);
 	free(breaklist);
+	for(unsigned i = 0; i < watchlist_len; i++)
+		free((char*) watchlist[i]);
+	free(watchlist);
 }
 
 bool debugger_help(void) {
 	fprintf(stderr,
 	"  Available commands:\n"
-	"    b, break NUMBER - set a breakpoint before given line number\n"
+	"    b, break NUMBER [if EXPR] - set a breakpoint before given line number,\n"
+	"        optionally only stopping when EXPR is non-zero\n"
+	"    d, delete NUMBER - delete the breakpoint before given line number\n"
+	"    w, watch NAME - stop whenever the label NAME is assigned\n"
 	"    r, resume - resume execution\n"
 	"    v, vars - list current variables\n"
 	"    l, list - list current variables\n"
@@ -147,10 +330,13 @@ bool debugger_help(void) {
 }
 
 bool debugger_eval(void) {
-	char expr[64];
-	/* always scanf 1 less character than buffer size */
-	fscanf(stdin, "%63[^\n]", expr);
+	char *expr = debugger_read_line();
+	if(!expr)
+		return true;
+	resolve_name_hook = debugger_resolve_name;
 	calc_float_t result = calc(expr);
+	resolve_name_hook = NULL;
+	free(expr);
 	if((long long)result == result)
 		fprintf(stderr, "= %lld\n", (long long)result);
 	else
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diagnostic.h"
+#include "charclass.h"
+#include "text.h"
+#include "formatter.h"
+
+/**
+ * This header encodes prefixed string literals like u16le"text" or
+ * mutf8/2"text". The source is read as UTF-8 and backslash escapes are
+ * replaced, then the characters are written as UTF-8, Java's modified
+ * UTF-8, UTF-16 or UTF-32, optionally after the number of code units.
+ * Runs of ASCII without escapes are converted eight bytes at a time.
+ */
+
+enum string_encoding {ENCODING_UTF8, ENCODING_MUTF8, ENCODING_UTF16, ENCODING_UTF32};
+
+struct string_format {
+	enum string_encoding encoding;
+	unsigned endian; // ENDIAN_DEFAULT follows hexproc.endian
+	unsigned length_bytes; // size of the length prefix, 0 if there is none
+};
+
+const struct {
+	char name[8];
+	enum string_encoding encoding;
+	unsigned endian;
+} string_prefixes[] = {
+	{"u8", ENCODING_UTF8, ENDIAN_DEFAULT},
+	{"mutf8", ENCODING_MUTF8, ENDIAN_DEFAULT},
+	{"u16le", ENCODING_UTF16, ENDIAN_LITTLE},
+	{"u16be", ENCODING_UTF16, ENDIAN_BIG},
+	{"u16", ENCODING_UTF16, ENDIAN_DEFAULT},
+	{"u32le", ENCODING_UTF32, ENDIAN_LITTLE},
+	{"u32be", ENCODING_UTF32, ENDIAN_BIG},
+	{"u32", ENCODING_UTF32, ENDIAN_DEFAULT},
+};
+
+/* Scans the prefix of an encoded string literal up to the opening quote,
+	returns its length or 0 if 'text' doesn't start one */
+size_t scan_string_prefix(const char *text, struct string_format *out) {
+	for(size_t i = 0; i < sizeof string_prefixes / sizeof string_prefixes[0]; i++) {
+		size_t len = strlen(string_prefixes[i].name);
+		if(strncmp(text, string_prefixes[i].name, len))
+			continue;
+		out->encoding = string_prefixes[i].encoding;
+		out->endian = string_prefixes[i].endian;
+		out->length_bytes = 0;
+		if(text[len] == '/' && CHAR_IS(text[len + 1], CC_DIGIT) && !CHAR_IS(text[len + 2], CC_NAME)) {
+			out->length_bytes = text[len + 1] - '0';
+			if(!strchr("1248", text[len + 1])) {
+				report_error("Length of a string literal can't have %u bytes", out->length_bytes);
+				out->length_bytes = 0;
+			}
+			len += 2;
+		}
+		// whitespace is allowed for macros which add the prefix to a quoted argument
+		len += scan_whitespace(text + len);
+		if(text[len] == '"')
+			return len;
+	}
+	return 0;
+}
+
+/* Returns the length of the escaped string at 'text' without its closing
+	quote, or 0 if the quote is missing */
+size_t scan_escaped_string(const char *text) {
+	for(size_t i = 1; text[i]; i++) {
+		if(text[i] == '"')
+			return i;
+		if(text[i] == '\\' && text[i + 1])
+			i++;
+	}
+	return 0;
+}
+
+static const char *const escape_chars = "\\\"'0abfnrtv";
+static const char escape_values[] = "\\\"'\0\a\b\f\n\r\t\v";
+
+/* Reads 'digits' hexadecimal digits, returns -1 if there are fewer */
+static long scan_escape_digits(const char *text, size_t len, unsigned digits) {
+	if(len < digits)
+		return -1;
+	long value = 0;
+	for(unsigned i = 0; i < digits; i++) {
+		char c = text[i];
+		if(!CHAR_IS(c, CC_HEX))
+			return -1;
+		value = value * 16 + HEX_VALUE(c);
+	}
+	return value;
+}
+
+/* Decodes the character at 'text', an escape or a UTF-8 sequence.
+	Returns the number of bytes read, or 0 after reporting an error */
+static size_t decode_char(const char *text, size_t len, uint32_t *out) {
+	const uint8_t *s = (const uint8_t*) text;
+	if(s[0] == '\\') {
+		if(len < 2) {
+			report_error("Unfinished escape sequence in string literal");
+			return 0;
+		}
+		const char *simple = strchr(escape_chars, text[1]);
+		if(simple && text[1]) {
+			*out = (uint8_t) escape_values[simple - escape_chars];
+			return 2;
+		}
+		unsigned digits = text[1] == 'x' ? 2 : text[1] == 'u' ? 4 : text[1] == 'U' ? 8 : 0;
+		long value = digits ? scan_escape_digits(text + 2, len - 2, digits) : -1;
+		if(value < 0) {
+			report_error("Invalid escape sequence \"\\%c\" in string literal", text[1]);
+			return 0;
+		}
+		if((value >= 0xd800 && value <= 0xdfff) || value > 0x10ffff) {
+			report_error("Invalid character U+%04lX in string literal", value);
+			return 0;
+		}
+		*out = value;
+		return 2 + digits;
+	}
+	if(s[0] < 0x80) {
+		*out = s[0];
+		return 1;
+	}
+	// the shortest form of each length, surrogates are not characters
+	size_t n = (s[0] & 0xe0) == 0xc0 ? 2 : (s[0] & 0xf0) == 0xe0 ? 3 : (s[0] & 0xf8) == 0xf0 ? 4 : 0;
+	static const uint32_t min_value[] = {0, 0, 0x80, 0x800, 0x10000};
+	uint32_t c = n ? s[0] & (0x7f >> n) : 0;
+	for(size_t i = 1; i < n; i++) {
+		if(i >= len || (s[i] & 0xc0) != 0x80) {
+			n = 0;
+			break;
+		}
+		c = (c << 6) | (s[i] & 0x3f);
+	}
+	if(!n || c < min_value[n] || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) {
+		report_error("Invalid UTF-8 in string literal");
+		return 0;
+	}
+	*out = c;
+	return n;
+}
+
+/* True if the eight bytes are ASCII without backslashes, so they can be
+	copied or widened without decoding. A byte equal to '\\' becomes zero
+	when xored with it, which sets its high bit after subtracting one */
+#define BACKSLASHES 0x5c5c5c5c5c5c5c5cull
+#define ASCII_WORD(w) ((((w) | ((((w) ^ BACKSLASHES) - 0x0101010101010101ull) \
+	& ~((w) ^ BACKSLASHES))) & 0x8080808080808080ull) == 0)
+
+/* Writes one code unit or character, returns the number of code units */
+static size_t encode_char(uint32_t c, enum string_encoding encoding, bool big, uint8_t **out) {
+	uint8_t *o = *out;
+	size_t units = 1;
+	switch(encoding) {
+		case ENCODING_UTF8:
+		case ENCODING_MUTF8:
+			if(c < 0x80 && (c || encoding == ENCODING_UTF8)) {
+				*o++ = c;
+			} else if(c < 0x800) {
+				*o++ = 0xc0 | c >> 6;
+				*o++ = 0x80 | (c & 0x3f);
+				units = 2;
+			} else if(c < 0x10000) {
+				*o++ = 0xe0 | c >> 12;
+				*o++ = 0x80 | (c >> 6 & 0x3f);
+				*o++ = 0x80 | (c & 0x3f);
+				units = 3;
+			} else if(encoding == ENCODING_UTF8) {
+				*o++ = 0xf0 | c >> 18;
+				*o++ = 0x80 | (c >> 12 & 0x3f);
+				*o++ = 0x80 | (c >> 6 & 0x3f);
+				*o++ = 0x80 | (c & 0x3f);
+				units = 4;
+			} else {
+				// modified UTF-8 encodes both halves of the UTF-16 surrogate pair
+				c -= 0x10000;
+				uint8_t *start = o;
+				encode_char(0xd800 | c >> 10, encoding, big, &o);
+				encode_char(0xdc00 | (c & 0x3ff), encoding, big, &o);
+				units = o - start;
+			}
+			break;
+		case ENCODING_UTF16:
+			if(c >= 0x10000) {
+				c -= 0x10000;
+				encode_char(0xd800 | c >> 10, encoding, big, &o);
+				c = 0xdc00 | (c & 0x3ff);
+				units = 2;
+			}
+			(big ? store16_be : store16_le)(o, c);
+			o += 2;
+			break;
+		case ENCODING_UTF32:
+			(big ? store32_be : store32_le)(o, c);
+			o += 4;
+			break;
+	}
+	*out = o;
+	return units;
+}
+
+/* Worst case number of output bytes for 'len' bytes of source */
+#define ENCODED_MAX_SIZE(len) ((len) * 4 + 8)
+
+/* Encodes the contents of a string literal into 'out', which must hold
+	ENCODED_MAX_SIZE(len) bytes. Returns the number of bytes written,
+	errors are reported and leave out what couldn't be encoded */
+size_t encode_string(const char *text, size_t len, struct string_format format, bool big, uint8_t *out) {
+	uint8_t *start = out;
+	out += format.length_bytes;
+	size_t units = 0, pos = 0;
+	unsigned width = format.encoding == ENCODING_UTF16 ? 2 : format.encoding == ENCODING_UTF32 ? 4 : 1;
+	while(pos < len) {
+		uint64_t w;
+		if(len - pos >= 8 && (memcpy(&w, text + pos, 8), ASCII_WORD(w))) {
+			if(width == 1) {
+				memcpy(out, &w, 8);
+			} else {
+				// widen the bytes in place of the code units
+				memset(out, 0, 8 * width);
+				for(unsigned i = 0; i < 8; i++)
+					out[i * width + (big ? width - 1 : 0)] = text[pos + i];
+			}
+			out += 8 * width;
+			units += 8;
+			pos += 8;
+			continue;
+		}
+		uint32_t c;
+		size_t n = decode_char(text + pos, len - pos, &c);
+		if(!n)
+			break;
+		pos += n;
+		units += encode_char(c, format.encoding, big, &out);
+	}
+	if(format.length_bytes) {
+		uint64_t limit = format.length_bytes == 8 ? UINT64_MAX : (1ull << (8 * format.length_bytes)) - 1;
+		if(units > limit)
+			report_error("String literal is too long for a %u byte length", format.length_bytes);
+		for(unsigned i = 0; i < format.length_bytes; i++)
+			start[big ? format.length_bytes - 1 - i : i] = (uint8_t)(units >> (8 * i));
+	}
+	return out - start;
+}
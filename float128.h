@@ -0,0 +1,243 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "charclass.h"
+#include "largenum.h"
+#include "text.h"
+
+/**
+ * This header reads decimal and hexadecimal float literals into __float128
+ * with correct rounding, which strtold can't do because it stops at the
+ * precision of long double. An estimate from the leading digits is moved
+ * one float at a time until it is the nearest one, comparing the exact
+ * value of the literal with the halfway points between neighbouring
+ * floats as big integers.
+ */
+
+#if defined(HAVE_HP_FLOAT128) && defined(HAVE_HP_INT128)
+#define HAVE_SCAN_FLOAT128
+
+#define F128_FRACTION_BITS 112
+#define F128_MIN_EXPONENT (1 - 16383 - F128_FRACTION_BITS) // of the lowest bit of subnormals
+#define F128_INFINITY ((safe_uint128)0x7fff << F128_FRACTION_BITS)
+
+/* Unsigned big integer, least significant limb first and no leading zeros */
+struct bignum {
+	uint32_t *limb;
+	size_t len, cap;
+};
+
+static void bignum_reserve(struct bignum *n, size_t len) {
+	if(len > n->cap) {
+		n->cap = 2 * len;
+		n->limb = realloc(n->limb, n->cap * sizeof(n->limb[0]));
+	}
+}
+
+static void bignum_trim(struct bignum *n) {
+	while(n->len && !n->limb[n->len - 1])
+		n->len--;
+}
+
+/* n = n * factor + add */
+static void bignum_mul_add(struct bignum *n, uint32_t factor, uint32_t add) {
+	uint64_t carry = add;
+	for(size_t i = 0; i < n->len; i++) {
+		carry += (uint64_t)n->limb[i] * factor;
+		n->limb[i] = (uint32_t)carry;
+		carry >>= 32;
+	}
+	if(carry) {
+		bignum_reserve(n, n->len + 1);
+		n->limb[n->len++] = (uint32_t)carry;
+	}
+}
+
+static void bignum_mul_pow10(struct bignum *n, long e) {
+	for(; e >= 9; e -= 9)
+		bignum_mul_add(n, 1000000000, 0);
+	uint32_t factor = 1;
+	while(e-- > 0)
+		factor *= 10;
+	bignum_mul_add(n, factor, 0);
+}
+
+/* out = a * factor, for factors of up to 128 bits */
+static void bignum_mul_wide(struct bignum *out, const struct bignum *a, safe_uint128 factor) {
+	size_t len = a->len + 5;
+	bignum_reserve(out, len);
+	memset(out->limb, 0, len * sizeof(out->limb[0]));
+	for(unsigned j = 0; j < 4; j++) {
+		uint32_t f = (uint32_t)(factor >> (32 * j));
+		uint64_t carry = 0;
+		for(size_t i = 0; i < a->len; i++) {
+			carry += (uint64_t)a->limb[i] * f + out->limb[i + j];
+			out->limb[i + j] = (uint32_t)carry;
+			carry >>= 32;
+		}
+		for(size_t k = a->len + j; carry; k++) {
+			carry += out->limb[k];
+			out->limb[k] = (uint32_t)carry;
+			carry >>= 32;
+		}
+	}
+	out->len = len;
+	bignum_trim(out);
+}
+
+/* out = a << bits */
+static void bignum_shift(struct bignum *out, const struct bignum *a, unsigned long bits) {
+	size_t words = bits / 32;
+	unsigned rest = bits % 32;
+	bignum_reserve(out, a->len + words + 1);
+	memset(out->limb, 0, words * sizeof(out->limb[0]));
+	uint32_t carry = 0;
+	for(size_t i = 0; i < a->len; i++) {
+		out->limb[words + i] = a->limb[i] << rest | carry;
+		carry = rest ? a->limb[i] >> (32 - rest) : 0;
+	}
+	out->limb[words + a->len] = carry;
+	out->len = words + a->len + 1;
+	bignum_trim(out);
+}
+
+static int bignum_compare(const struct bignum *a, const struct bignum *b) {
+	if(a->len != b->len)
+		return a->len < b->len ? -1 : 1;
+	for(size_t i = a->len; i-- > 0;)
+		if(a->limb[i] != b->limb[i])
+			return a->limb[i] < b->limb[i] ? -1 : 1;
+	return 0;
+}
+
+/* The literal as value * 2^exponent / divisor, and scratch space */
+struct exact_literal {
+	struct bignum value, divisor, scaled, halfway;
+	long exponent;
+};
+
+/* Compares the literal with the point halfway between the positive float
+	with the bits 'u' and the next one up, which is (2m + 1) * 2^(k - 1)
+	for a float of m * 2^k */
+static int compare_halfway(struct exact_literal *x, safe_uint128 u) {
+	unsigned biased = (unsigned)(u >> F128_FRACTION_BITS);
+	safe_uint128 m = u & (((safe_uint128)1 << F128_FRACTION_BITS) - 1);
+	long k = F128_MIN_EXPONENT;
+	if(biased) {
+		m |= (safe_uint128)1 << F128_FRACTION_BITS;
+		k += biased - 1;
+	}
+	bignum_mul_wide(&x->halfway, &x->divisor, 2 * m + 1);
+	if(x->exponent >= k - 1) {
+		bignum_shift(&x->scaled, &x->value, x->exponent - (k - 1));
+		return bignum_compare(&x->scaled, &x->halfway);
+	}
+	bignum_shift(&x->scaled, &x->halfway, (k - 1) - x->exponent);
+	return bignum_compare(&x->value, &x->scaled);
+}
+
+/* Reads a float literal in base 10 or 16 (after its prefix), like strtold.
+	Returns the number of characters consumed */
+size_t scan_float128(const char *text, unsigned base, hp_float128_t *out) {
+	struct exact_literal x = {{0}};
+	// digits of the fraction and the exponent scale by this power of 'base'
+	long scale = base == 16 ? 4 : 1;
+	long exponent = 0, digits = 0, dropped = 0;
+	// the leading digits are exact in a float, for the estimate
+	unsigned max_lead = base == 16 ? 28 : 34;
+	safe_uint128 lead = 0;
+	bool point = false;
+	size_t i = 0;
+	for(;; i++) {
+		if(text[i] == '.' && !point) {
+			point = true;
+			continue;
+		}
+		int digit = hex2int(text[i]);
+		if(digit < 0 || digit >= (int)base)
+			break;
+		bignum_mul_add(&x.value, base, digit);
+		exponent -= point ? scale : 0;
+		if(digits || digit) {
+			if(digits++ < max_lead)
+				lead = lead * base + digit;
+			else
+				dropped++;
+		}
+	}
+	if((text[i] | 0x20) == (base == 16 ? 'p' : 'e')) {
+		size_t j = i + 1;
+		bool negative = text[j] == '-';
+		j += text[j] == '-' || text[j] == '+';
+		if(CHAR_IS(text[j], CC_DIGIT)) {
+			// large enough for any float, without overflowing
+			long e = 0;
+			for(; CHAR_IS(text[j], CC_DIGIT); j++)
+				if(e < 100000000)
+					e = e * 10 + (text[j] - '0');
+			exponent += negative ? -e : e;
+			i = j;
+		}
+	}
+
+	// digits * scale bits or decimal digits are enough to tell when it's out of range
+	long magnitude = digits * scale + exponent;
+	if(!digits || magnitude < (base == 16 ? -16495 : -4966)) {
+		*out = 0;
+	} else if(magnitude - scale > (base == 16 ? 16384 : 4933)) {
+		*out = (hp_float128_t)INFINITY;
+	} else {
+		hp_float128_t estimate = (hp_float128_t)lead;
+		hp_float128_t chunk = (hp_float128_t)((safe_uint128)1 << 64);
+		long chunk_exponent = 64, power = exponent + dropped * scale;
+		if(base == 10) {
+			// 10^48 is exact, 5^48 needs 112 bits
+			hp_float128_t root = (hp_float128_t)((safe_uint128)1000000000000 * 1000000000000);
+			chunk = root * root;
+			chunk_exponent = 48;
+		}
+		for(; power >= chunk_exponent; power -= chunk_exponent)
+			estimate *= chunk;
+		for(; power <= -chunk_exponent; power += chunk_exponent)
+			estimate /= chunk;
+		hp_float128_t rest = 1;
+		for(long n = power < 0 ? -power : power; n > 0; n--)
+			rest *= base == 16 ? 2 : 10;
+		estimate = power < 0 ? estimate / rest : estimate * rest;
+
+		bignum_mul_add(&x.divisor, 1, 1);
+		if(base == 16)
+			x.exponent = exponent;
+		else if(exponent >= 0)
+			bignum_mul_pow10(&x.value, exponent);
+		else
+			bignum_mul_pow10(&x.divisor, -exponent);
+		safe_uint128 u;
+		memcpy(&u, &estimate, sizeof u);
+		while(1) {
+			int c = u < F128_INFINITY ? compare_halfway(&x, u) : -1;
+			if(c > 0 || (c == 0 && (u & 1))) {
+				u++;
+				continue;
+			}
+			c = u > 0 ? compare_halfway(&x, u - 1) : 1;
+			if(c < 0 || (c == 0 && !((u - 1) & 1))) {
+				u--;
+				continue;
+			}
+			break;
+		}
+		memcpy(out, &u, sizeof u);
+	}
+	free(x.value.limb);
+	free(x.divisor.limb);
+	free(x.scaled.limb);
+	free(x.halfway.limb);
+	return i;
+}
+#endif
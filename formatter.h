@@ -11,18 +11,72 @@
 #include "diagnostic.h"
 #include "calc.h"
 #include "text.h"
+#include "profile.h"
+#include "wideint.h"
 
 struct formatter {
 	enum {
-		HP_UNAVAILABLE, HP_INT, HP_FLOAT, HP_DOUBLE
+		HP_UNAVAILABLE, HP_INT, HP_FLOAT, HP_DOUBLE, HP_BITS, HP_FLOAT80, HP_FLOAT128
 	} datatype : 4;
 	unsigned nbytes : 8;
 	enum {
 		ENDIAN_DEFAULT, ENDIAN_BIG, ENDIAN_LITTLE
 	} endian : 4;
+	unsigned encoder : 4; // see select_encoder
+	uint32_t count; // number of elements of an array formatter, 0 for a single value
 	const char *expr;
+	// HP_BITS only: zero-terminated field widths, least significant first;
+	// 'expr' then holds one NUL-separated expression per field
+	const unsigned char *fields;
 };
 
+/* Integer formatters wider than this are evaluated with 'wide_calc' */
+#define FORMATTER_NARROW_BYTES 8
+#define FORMATTER_MAX_BYTES WIDE_BYTES
+#define FORMATTER_MAX_COUNT (1 << 24)
+
+/* Number of output bytes of a formatter */
+#define FORMATTER_SIZE(f) ((uint64_t)(f).nbytes * ((f).count ? (f).count : 1))
+
+/* Specialized encoders for the common formatters, the rest use 'format_value' */
+enum encoder {
+	ENCODE_GENERIC,
+	ENCODE_INT8,
+	ENCODE_INT16_LE, ENCODE_INT16_BE,
+	ENCODE_INT32_LE, ENCODE_INT32_BE,
+	ENCODE_INT64_LE, ENCODE_INT64_BE,
+	ENCODE_FLOAT_LE, ENCODE_FLOAT_BE,
+	ENCODE_DOUBLE_LE, ENCODE_DOUBLE_BE
+};
+
+/* Picks the encoder of a formatter once its type, size and endianness are known */
+unsigned select_encoder(struct formatter fmt) {
+	if(fmt.endian != ENDIAN_BIG && fmt.endian != ENDIAN_LITTLE)
+		return ENCODE_GENERIC; // reports the error
+	unsigned big = fmt.endian == ENDIAN_BIG;
+	switch(fmt.datatype) {
+		case HP_INT:
+			switch(fmt.nbytes) {
+				case 1: return ENCODE_INT8;
+				case 2: return ENCODE_INT16_LE + big;
+				case 4: return ENCODE_INT32_LE + big;
+				case 8: return ENCODE_INT64_LE + big;
+			}
+			break;
+		case HP_FLOAT:
+			if(fmt.nbytes == sizeof(float))
+				return ENCODE_FLOAT_LE + big;
+			break;
+		case HP_DOUBLE:
+			if(fmt.nbytes == sizeof(double))
+				return ENCODE_DOUBLE_LE + big;
+			break;
+		default:
+			break;
+	}
+	return ENCODE_GENERIC;
+}
+
 struct formatter *formatqueue = NULL;
 size_t formatqueue_cap = 0;
 size_t formatqueue_len = 0;
@@ -34,6 +88,8 @@ void add_formatter(struct formatter fmt) {
 		formatqueue = realloc(formatqueue, formatqueue_cap * sizeof(formatqueue[0]));
 	}
 	formatqueue[formatqueue_len++] = fmt;
+	if(profile_mode)
+		profile_add_origin(current_file_name, line_number);
 }
 
 bool take_next_formatter(struct formatter *out) {
@@ -42,9 +98,20 @@ bool take_next_formatter(struct formatter *out) {
 		: (*out = formatqueue[formatqueue_pos++], true);
 }
 
+/* Empties the queue, keeping its memory for the next input */
+void reset_formatters(void) {
+	for(size_t i = 0; i < formatqueue_len; i++) {
+		free((char*) formatqueue[i].expr);
+		free((char*) formatqueue[i].fields);
+	}
+	formatqueue_len = formatqueue_pos = 0;
+}
+
 void cleanup_formatters(void) {
-	for(unsigned i = 0; i < formatqueue_len; i++)
+	for(unsigned i = 0; i < formatqueue_len; i++) {
 		OPTIONAL_FREE(formatqueue[i].expr);
+		OPTIONAL_FREE(formatqueue[i].fields);
+	}
 	OPTIONAL_FREE(formatqueue);
 }
 
@@ -66,12 +133,20 @@ const struct {
 	{"long", {HP_INT, 8}},
 	{"int64", {HP_INT, 8}},
 
+	{"int128", {HP_INT, 16}},
+	{"int256", {HP_INT, 32}},
+	{"int512", {HP_INT, 64}},
+
 	{"ieee754_single", {HP_FLOAT, 4}},
 	{"float", {HP_FLOAT, 4}},
 	{"ieee754_double", {HP_DOUBLE, 8}},
 	{"double", {HP_DOUBLE, 8}},
-#ifdef HAVE_HP_FLOAT80
-
+#if defined(HAVE_HP_FLOAT80) && defined(HAVE_HP_INT128)
+	{"float80", {HP_FLOAT80, 10}},
+#endif
+#if defined(HAVE_HP_FLOAT128) && defined(HAVE_HP_INT128)
+	{"ieee754_quadruple", {HP_FLOAT128, 16}},
+	{"float128", {HP_FLOAT128, 16}},
 #endif
 	{{0}, {0}}
 };
@@ -83,6 +158,34 @@ bool resolve_datatype(const char *name, struct formatter *out) {
 	return false;
 }
 
+/* Splits a bit field expression list in place by replacing top-level
+	commas with NUL characters. Returns the number of expressions */
+static unsigned split_field_exprs(char *expr) {
+	unsigned count = 1;
+	unsigned depth = 0;
+	for(; expr[0]; expr++) {
+		if(expr[0] == '(')
+			depth++;
+		else if(expr[0] == ')' && depth)
+			depth--;
+		else if(expr[0] == ',' && !depth)
+			expr[0] = '\0', count++;
+	}
+	return count;
+}
+
+/* Parses the number of elements of an array formatter */
+static bool scan_element_count(const char *text, uint32_t *count) {
+	char *end;
+	long n = strtol(text, &end, 0);
+	if(!CHAR_IS(text[0], CC_DIGIT) || end[0] || n < 1 || n > FORMATTER_MAX_COUNT) {
+		report_error("Expected a number of elements from 1 to %d after \"x\"", (int)FORMATTER_MAX_COUNT);
+		return false;
+	}
+	*count = n;
+	return true;
+}
+
 static bool create_formatter(const char *fmt, const char *expr, struct formatter *output) {
 	if(!fmt || !expr) {
 		report_error("Missing formatter or expression");
@@ -91,6 +194,11 @@ static bool create_formatter(const char *fmt, const char *expr, struct formatter
 	struct formatter blueprint = {0};
 	int custom_size = -1;
 	unsigned endian = 0; // see formatter.h
+	bool bitfields = false;
+	unsigned char fields[8 * sizeof(calc_int_t) + 1];
+	unsigned nfields = 0, totalbits = 0;
+	uint32_t count = 0;
+	bool expect_count = false;
 	while(fmt[0]) {
 		fmt += scan_whitespace(fmt);
 		const char *attr = NULL;
@@ -99,21 +207,50 @@ static bool create_formatter(const char *fmt, const char *expr, struct formatter
 			report_error("Expected formatter attribute");
 			return false;
 		}
-		if(isdigit(attr[0])) {
+		if(expect_count || (attr[0] == 'x' && CHAR_IS(attr[1], CC_DIGIT))) {
+			// we're parsing the number of elements, "x 16" or "x16"
+			if(!scan_element_count(attr + !expect_count, &count)) {
+				free((char*)attr);
+				return false;
+			}
+			expect_count = false;
+		} else if(CHAR_IS(attr[0], CC_DIGIT) && bitfields) {
+			// we're parsing the width of a bit field
+			char *numend;
+			long width = strtol(attr, &numend, 0);
+			if(strlen(attr) != numend-attr)
+				report_error("Ignoring trailing characters in bit field width");
+			if(width < 1) {
+				report_error("Bit fields must be at least 1 bit wide");
+				free((char*)attr);
+				return false;
+			}
+			if(totalbits + width > 8 * sizeof(calc_int_t)) {
+				report_error("Bit fields can't be wider than %d bits in total", (int)(8 * sizeof(calc_int_t)));
+				free((char*)attr);
+				return false;
+			}
+			fields[nfields++] = width;
+			totalbits += width;
+		} else if(CHAR_IS(attr[0], CC_DIGIT)) {
 			// we're parsing a numeric byte width
 			char *numend;
 			custom_size = strtol(attr, &numend, 0);
 			if(strlen(attr) != numend-attr)
 				report_error("Ignoring trailing characters in formatter size");
-			if(custom_size > sizeof(calc_int_t)) {
-				report_error("Number of bytes (%d) can't be more than %d", (int) custom_size, (int)sizeof(calc_int_t));
-				custom_size = sizeof(calc_int_t);
+			if(custom_size > FORMATTER_MAX_BYTES) {
+				report_error("Number of bytes (%d) can't be more than %d", (int) custom_size, (int)FORMATTER_MAX_BYTES);
+				custom_size = FORMATTER_MAX_BYTES;
 			}
-		} else if(isalpha(attr[0])) {
+		} else if(CHAR_IS(attr[0], CC_ALPHA)) {
 			if(strcmp("LE", attr)==0)
 				endian = ENDIAN_LITTLE;
 			else if(strcmp("BE", attr)==0)
 				endian = ENDIAN_BIG;
+			else if(strcmp("bits", attr)==0)
+				bitfields = true;
+			else if(strcmp("x", attr)==0)
+				expect_count = true;
 			else if(!resolve_datatype(attr, &blueprint)) {
 				report_error("Unknown data type: \"%s\"", attr);
 				free((char*)attr);
@@ -124,10 +261,15 @@ static bool create_formatter(const char *fmt, const char *expr, struct formatter
 		fmt += scan_whitespace(fmt);
 		fmt += scan_char(fmt, ',');
 	}
+	if(expect_count) {
+		report_error("Expected a number of elements after \"x\"");
+		return false;
+	}
 	struct formatter result = {
 		.expr = expr,
 		.datatype = HP_INT,
 		.nbytes = 1,
+		.count = count,
 	};
 
 	if(blueprint.nbytes /* if blueprint has been set */) {
@@ -144,13 +286,103 @@ static bool create_formatter(const char *fmt, const char *expr, struct formatter
 
 	if(custom_size >= 0)
 		result.nbytes = custom_size;
+	if(result.datatype != HP_INT && result.nbytes > sizeof(calc_int_t)) {
+		report_error("Number of bytes (%d) can't be more than %d for this type", (int)result.nbytes, (int)sizeof(calc_int_t));
+		result.nbytes = sizeof(calc_int_t);
+	}
+
+	if(bitfields) {
+		if(!nfields) {
+			report_error("Expected bit field widths after \"bits\"");
+			return false;
+		}
+		if(count) {
+			report_error("Bit field formatters can't be arrays");
+			return false;
+		}
+		if(blueprint.nbytes || custom_size >= 0)
+			report_error("Ignoring type and size of bit field formatter");
+		unsigned nexprs = split_field_exprs((char*)expr);
+		if(nexprs != nfields) {
+			report_error("Got %u expressions for %u bit fields", nexprs, nfields);
+			return false;
+		}
+		fields[nfields] = 0;
+		result.datatype = HP_BITS;
+		result.nbytes = (totalbits + 7) / 8;
+		result.fields = (unsigned char*)strdup((char*)fields);
+	}
+	result.encoder = select_encoder(result);
 	*output = result;
 	return true;
 }
 
+/* Stores in a given byte order, as a native store plus a byte swap if the
+	host order differs (the check is folded by the compiler) */
+static inline bool host_big_endian(void) {
+	const uint16_t one = 1;
+	uint8_t first;
+	memcpy(&first, &one, 1);
+	return first == 0;
+}
+
+#ifdef __GNUC__
+#	define bswap16(x) __builtin_bswap16(x)
+#	define bswap32(x) __builtin_bswap32(x)
+#else
+#	define bswap16(x) ((uint16_t)(bswap64(x) >> 48))
+#	define bswap32(x) ((uint32_t)(bswap64(x) >> 32))
+#endif
+
+#define DEFINE_STORES(bits) \
+	static inline void store##bits##_le(uint8_t *out, uint##bits##_t x) { \
+		if(host_big_endian()) \
+			x = bswap##bits(x); \
+		memcpy(out, &x, sizeof x); \
+	} \
+	static inline void store##bits##_be(uint8_t *out, uint##bits##_t x) { \
+		if(!host_big_endian()) \
+			x = bswap##bits(x); \
+		memcpy(out, &x, sizeof x); \
+	}
+DEFINE_STORES(16)
+DEFINE_STORES(32)
+DEFINE_STORES(64)
+#undef DEFINE_STORES
+
+void encode_integer(calc_int_t v, struct formatter fmt, uint8_t *out /* must have space for at least 'fmt.nbytes' bytes */) {
+	// input (big endian) 0x11_22_33_44_55
+	// formatter: "[3,int,LE]"
+	// result: 33 22 11
+	if(fmt.endian == 0)
+		report_error("Internal error: endian not specified in formatter");
+	bool big = fmt.endian == ENDIAN_BIG;
+	switch(fmt.nbytes) {
+		case 1: out[0] = (uint8_t) v; return;
+		case 2: big ? store16_be(out, v) : store16_le(out, v); return;
+		case 4: big ? store32_be(out, v) : store32_le(out, v); return;
+		case 8: big ? store64_be(out, v) : store64_le(out, v); return;
+#ifdef HAVE_HP_INT128
+		case 16: {
+			uint64_t low = (uint64_t) v, high = (uint64_t)((calc_uint_t) v >> 64);
+			if(big)
+				store64_be(out, high), store64_be(out + 8, low);
+			else
+				store64_le(out, low), store64_le(out + 8, high);
+			return;
+		}
+#endif
+	}
+	for(unsigned i = 0; i < fmt.nbytes; i++) {
+		uint8_t byte = (v >> (i * 8)) & 0xFF;
+		out[big ? fmt.nbytes - 1 - i : i] = byte;
+	}
+}
+
 void format_value(calc_float_t value, struct formatter fmt, uint8_t *out /* must have space for at least 'fmt.nbytes' bytes */) {
-	calc_int_t v;
+	calc_int_t v = 0;
 	switch(fmt.datatype) {
+		case HP_BITS: // bit fields are packed by 'pack_bitfields'
 		case HP_INT: {
 			v = to_integer(value);
 			break;
@@ -165,25 +397,211 @@ void format_value(calc_float_t value, struct formatter fmt, uint8_t *out /* must
 			memcpy(&v, &d, sizeof(double));
 			break;
 		}
+#if defined(HAVE_HP_FLOAT80) && defined(HAVE_HP_INT128)
+		case HP_FLOAT80: {
+			// only the first 10 bytes are significant, the rest is padding
+			hp_float80_t f = (hp_float80_t) value;
+			memcpy(&v, &f, 10);
+			break;
+		}
+#endif
+#if defined(HAVE_HP_FLOAT128) && defined(HAVE_HP_INT128)
+		case HP_FLOAT128: {
+			hp_float128_t f = (hp_float128_t) value;
+			memcpy(&v, &f, sizeof(hp_float128_t));
+			break;
+		}
+#endif
+		default: {
+			report_error("Internal error: unsupported data type");
+			break;
+		}
 	}
-	// input (big endian) 0x11_22_33_44_55
-	// formatter: "[3,int,LE]"
-	// result: 33 22 11
-	uint8_t bytes[fmt.nbytes];
-	if(fmt.endian == 0)
-		report_error("Internal error: endian not specified in formatter");
-	if(fmt.endian == ENDIAN_BIG) {
-		unsigned shift = fmt.nbytes * 8;
-		for(unsigned i = 0; i < fmt.nbytes; i++) {
-			shift -= 8;
-			bytes[i] = (v >> shift) & 0xFF;
+	encode_integer(v, fmt, out);
+}
+
+typedef void (*encoder_fn)(calc_float_t value, const struct formatter *fmt, uint8_t *out);
+
+static void encode_generic(calc_float_t value, const struct formatter *fmt, uint8_t *out) {
+	format_value(value, *fmt, out);
+}
+
+static void encode_int8(calc_float_t value, const struct formatter *fmt, uint8_t *out) {
+	(void) fmt;
+	out[0] = (uint8_t) to_integer(value);
+}
+
+#define DEFINE_ENCODERS(name, type, bits, convert) \
+	static void encode_##name##_le(calc_float_t value, const struct formatter *fmt, uint8_t *out) { \
+		(void) fmt; \
+		type x = convert(value); \
+		uint##bits##_t word; \
+		memcpy(&word, &x, sizeof word); \
+		store##bits##_le(out, word); \
+	} \
+	static void encode_##name##_be(calc_float_t value, const struct formatter *fmt, uint8_t *out) { \
+		(void) fmt; \
+		type x = convert(value); \
+		uint##bits##_t word; \
+		memcpy(&word, &x, sizeof word); \
+		store##bits##_be(out, word); \
+	}
+#define TO_UINT16(value) ((uint16_t) to_integer(value))
+#define TO_UINT32(value) ((uint32_t) to_integer(value))
+#define TO_UINT64(value) ((uint64_t) to_integer(value))
+DEFINE_ENCODERS(int16, uint16_t, 16, TO_UINT16)
+DEFINE_ENCODERS(int32, uint32_t, 32, TO_UINT32)
+DEFINE_ENCODERS(int64, uint64_t, 64, TO_UINT64)
+DEFINE_ENCODERS(float, float, 32, (float))
+DEFINE_ENCODERS(double, double, 64, (double))
+#undef TO_UINT16
+#undef TO_UINT32
+#undef TO_UINT64
+#undef DEFINE_ENCODERS
+
+const encoder_fn encoders[] = {
+	[ENCODE_GENERIC] = encode_generic,
+	[ENCODE_INT8] = encode_int8,
+	[ENCODE_INT16_LE] = encode_int16_le, [ENCODE_INT16_BE] = encode_int16_be,
+	[ENCODE_INT32_LE] = encode_int32_le, [ENCODE_INT32_BE] = encode_int32_be,
+	[ENCODE_INT64_LE] = encode_int64_le, [ENCODE_INT64_BE] = encode_int64_be,
+	[ENCODE_FLOAT_LE] = encode_float_le, [ENCODE_FLOAT_BE] = encode_float_be,
+	[ENCODE_DOUBLE_LE] = encode_double_le, [ENCODE_DOUBLE_BE] = encode_double_be,
+};
+
+/* Encodes 'count' values with the same formatter into consecutive
+	'fmt.nbytes' byte slots of 'out' */
+void encode_values(struct formatter fmt, const calc_float_t *values, size_t count, uint8_t *out) {
+	encoder_fn encode = encoders[fmt.encoder];
+	for(size_t i = 0; i < count; i++, out += fmt.nbytes)
+		encode(values[i], &fmt, out);
+}
+
+/* Evaluates the field expressions of a bit field formatter and packs
+	them into a single word with integer operations, least significant
+	field first. Each field accepts both signed and unsigned values */
+calc_int_t pack_bitfields(struct formatter fmt) {
+	calc_uint_t word = 0;
+	unsigned shift = 0;
+	const char *expr = fmt.expr;
+	for(unsigned i = 0; fmt.fields[i]; i++) {
+		unsigned width = fmt.fields[i];
+		calc_int_t v = to_integer(calc(expr));
+		if(width < 8 * sizeof(calc_int_t)) {
+			calc_uint_t mask = ((calc_uint_t)1 << width) - 1;
+			if(v > (calc_int_t)mask || v < -(calc_int_t)(mask >> 1) - 1)
+				report_error("Value of bit field %u doesn't fit in %u bits", i + 1, width);
+			word |= ((calc_uint_t)v & mask) << shift;
+		} else {
+			word = v;
 		}
-	} else {
-		unsigned shift = 0;
-		for(unsigned i = 0; i < fmt.nbytes; i++) {
-			bytes[i] = (v >> shift) & 0xFF;
-			shift += 8;
+		shift += width;
+		expr += strlen(expr) + 1;
+	}
+	return (calc_int_t)word;
+}
+
+/* Writes the lowest 'fmt.nbytes' bytes of a wide integer */
+void encode_wide_integer(struct wideint w, struct formatter fmt, uint8_t *out) {
+	for(unsigned i = 0; i < fmt.nbytes; i++) {
+		uint8_t byte = w.limb[i / 8] >> (i % 8 * 8);
+		out[fmt.endian == ENDIAN_BIG ? fmt.nbytes - 1 - i : i] = byte;
+	}
+}
+
+/* Receives the encoded bytes of a formatter, arrays in several blocks */
+typedef void (*emit_fn)(const uint8_t *bytes, uint64_t len, void *context);
+
+#define ARRAY_INDEX_NAME "i"
+#define ARRAY_BLOCK 256
+
+/* Evaluates every element of an array formatter with the index bound to 'i'.
+	The expression is parsed once and its references to 'i' are replaced
+	by the index. The label 'i' is only defined while evaluating if the
+	expression refers to other labels, which may in turn refer to 'i'.
+	Each block of elements is passed to 'emit' once it is encoded, so
+	large tables don't have to fit in memory */
+static void evaluate_array(struct formatter fmt, emit_fn emit, void *context) {
+	struct formatter element = fmt;
+	element.count = 0;
+	bool wide = fmt.datatype == HP_INT && fmt.nbytes > FORMATTER_NARROW_BYTES;
+	struct expression e = {0};
+	bool compiled = !wide && compile_expr(fmt.expr, &e);
+	struct yard_value *code = compiled ? malloc(e.len * sizeof(code[0]) + 1) : NULL;
+	unsigned patches[YARD_QUEUE_SIZE], npatches = 0;
+	bool bind = wide;
+	for(unsigned j = 0; compiled && j < e.len; j++) {
+		code[j] = e.code[j];
+		if(e.code[j].kind != YARD_NAME)
+			continue;
+		if(!strcmp(e.code[j].content.name, ARRAY_INDEX_NAME))
+			patches[npatches++] = j;
+		else
+			bind = true;
+	}
+	// keep a label which happens to be called 'i'
+	struct label saved = {0};
+	bool had_label = bind && lookup_label(ARRAY_INDEX_NAME, &saved);
+	const char *saved_expr = had_label && saved.expr ? strdup(saved.expr) : NULL;
+
+	bool failed = !wide && !compiled;
+	calc_float_t values[ARRAY_BLOCK];
+	uint8_t block[ARRAY_BLOCK * FORMATTER_MAX_BYTES];
+	for(uint32_t first = 0; first < fmt.count; first += ARRAY_BLOCK) {
+		uint32_t n = fmt.count - first < ARRAY_BLOCK ? fmt.count - first : ARRAY_BLOCK;
+		uint32_t k = 0;
+		for(; k < n && !failed; k++) {
+			uint32_t index = first + k;
+			if(bind)
+				set_constant_label(strdup(ARRAY_INDEX_NAME), index);
+			if(wide) {
+				struct wideint w = {{0}};
+				failed = !wide_calc(fmt.expr, &w);
+				encode_wide_integer(w, element, block + k * fmt.nbytes);
+			} else {
+				for(unsigned p = 0; p < npatches; p++)
+					code[patches[p]] = (struct yard_value) {.content.num = index, .kind = YARD_NUM};
+				mathfail = false;
+				values[k] = rpn_eval(code, e.len);
+				failed = mathfail;
+				if(failed)
+					values[k] = 0;
+			}
 		}
+		if(!wide)
+			encode_values(element, values, k, block);
+		// after an error the remaining elements are zero, so it is only reported once
+		memset(block + k * fmt.nbytes, 0, (n - k) * fmt.nbytes);
+		emit(block, (uint64_t)n * fmt.nbytes, context);
+	}
+
+	if(had_label)
+		set_label(strdup(ARRAY_INDEX_NAME), saved.constant, saved_expr, saved.offset);
+	else if(bind)
+		remove_label(ARRAY_INDEX_NAME);
+	if(compiled)
+		free_expr(e);
+	free(code);
+}
+
+/* Evaluates the formatter and passes the resulting 'FORMATTER_SIZE(fmt)'
+	bytes to 'emit' */
+void evaluate_formatter(struct formatter fmt, emit_fn emit, void *context) {
+	// floats round wide literals like any other value
+	allow_wide_literals = fmt.datatype != HP_INT && fmt.datatype != HP_BITS;
+	uint8_t out[FORMATTER_MAX_BYTES];
+	if(fmt.count) {
+		evaluate_array(fmt, emit, context);
+	} else if(fmt.datatype == HP_BITS) {
+		encode_integer(pack_bitfields(fmt), fmt, out);
+	} else if(fmt.datatype == HP_INT && fmt.nbytes > FORMATTER_NARROW_BYTES) {
+		struct wideint w = {{0}};
+		wide_calc(fmt.expr, &w);
+		encode_wide_integer(w, fmt, out);
+	} else {
+		encoders[fmt.encoder](calc(fmt.expr), &fmt, out);
 	}
-	memcpy(out, bytes, fmt.nbytes);
+	if(!fmt.count)
+		emit(out, fmt.nbytes, context);
+	allow_wide_literals = false;
 }
@@ -1,8 +1,21 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 unsigned strhash(const char *str) {
 	unsigned hash = 1;
 	for(size_t i = 0; str[i]; i++)
 		hash = 92821 * hash + str[i];
 	return hash;
 }
+
+/* 64-bit FNV-1a, pass the previous result as 'hash' to continue hashing */
+uint64_t memhash64(const void *data, size_t len, uint64_t hash) {
+	const unsigned char *p = data;
+	for(size_t i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+#define MEMHASH64_INIT 0xcbf29ce484222325ULL
@@ -6,12 +6,9 @@ void * __dso_handle __attribute((visibility("hidden"))) = &__dso_handle;
 
 #ifdef _POSIX_C_SOURCE
 #include <unistd.h>
+#include <sys/wait.h>
 #elif defined(_WIN32)
 #include <io.h>
-// Since Windows is a special snowflake,
-// here is a quick fix to get strtold to recognize hex numbers.
-// Keep in mind that <stdlib.h> has to be included before this line
-#define strtold(...) strtod(__VA_ARGS__)
 #define __USE_MINGW_ANSI_STDIO 1
 #include <stdio.h>
 #else
@@ -22,6 +19,7 @@ int fileno(FILE*);
 
 #include <assert.h>
 #include <errno.h>
+#include <getopt.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
@@ -32,6 +30,9 @@ int fileno(FILE*);
 #include "label.h"
 #include "debugger.h"
 #include "interpreter.h"
+#include "precompiled.h"
+#include "variants.h"
+#include "server.h"
 
 #ifndef HEXPROC_VERSION
 #define HEXPROC_VERSION "-"
@@ -59,6 +60,42 @@ static void print_usage(void) {
 "  -c          Output colored text\n"
 "  -C          Force output colored text (even when output is not a TTY)\n"
 "  -d          Enable debugger\n"
+"  -o FILE     Write the output to FILE\n"
+"  -D NAME=VALUE\n"
+"              Define a label, overriding its definition in the input\n"
+"  --variants FILE\n"
+"              Render once per line of FILE, which holds NAME=VALUE pairs\n"
+"              or CSV with a header of names, to the path given with -o.\n"
+"              \"{NAME}\" in the path is replaced by the value, \"{#}\" by\n"
+"              the line number\n"
+"  -j N        Render variants in N processes, or serve N requests at once\n"
+"  --serve SOCKET\n"
+"              Handle requests from '--connect' on a Unix domain socket\n"
+"  --connect SOCKET [OPTION...] [FILE]\n"
+"              Let the server on SOCKET process FILE, must come first\n"
+"  --compile   Write a precompiled template (.hxpc) instead of the output,\n"
+"              which can be given as FILE to skip parsing later\n"
+"  --object    Write an object (.hxo) of a single module instead of the output\n"
+"  --link OBJECT...\n"
+"              Lay out the objects in order and process them as one input\n"
+"  --out-bin FILE, --out-hex FILE, --out-map FILE\n"
+"              Also write binary data, hex or a map of offsets to FILE\n"
+"              (standard output is then only written with -o)\n"
+"  --srcmap FILE\n"
+"              Write an index from output offsets to source lines to FILE\n"
+"  --where OFFSET FILE\n"
+"              Print the source of the byte at OFFSET using the index FILE\n"
+"  --profile FILE\n"
+"              Write folded evaluation stacks to FILE and print the most\n"
+"              expensive source lines\n"
+"  --check FILE\n"
+"              Compare the output with FILE instead of writing it and\n"
+"              report the first difference\n"
+"  --diff FILE List the byte ranges in which the output differs from FILE\n"
+"  --pipeline  Read, parse and write in separate threads\n"
+"  --max-memory SIZE\n"
+"              Spill buffered output above SIZE bytes (suffixes K, M, G)\n"
+"              to a temporary file\n"
 "See the manual page hexproc(1) for more information\n"
 	);
 }
@@ -129,6 +166,171 @@ static void add_builtin_variables(void) {
 	set_constant_label(strdup("hexproc.patch"), patch);
 }
 
+/* Parses a byte count with an optional K, M or G suffix, returns 0 on failure */
+static size_t parse_size(const char *text) {
+	// strtoull also accepts a sign, and negative numbers wrap around
+	if(!CHAR_IS(text[0], CC_DIGIT))
+		return 0;
+	char *end;
+	errno = 0;
+	unsigned long long size = strtoull(text, &end, 0), factor = 1;
+	switch(end[0]) {
+		case 'G': case 'g': factor *= 1024; // fall through
+		case 'M': case 'm': factor *= 1024; // fall through
+		case 'K': case 'k': factor *= 1024; end++; // fall through
+		case '\0': break;
+		default: return 0;
+	}
+	if(end[0] || errno == ERANGE || size > SIZE_MAX / factor)
+		return 0;
+	return size * factor;
+}
+
+/* Additional outputs, rendered in the same pass as the standard output */
+static struct sink *output_sinks = NULL;
+
+static bool add_output_sink(const char *path, enum output_mode mode) {
+	FILE *file = fopen(path, "wb");
+	if(!file) {
+		fprintf(stderr, "Couldn't open file \"%s\" (error %d)\n", path, (int) errno);
+		return false;
+	}
+	struct sink *s = malloc(sizeof *s), **tail = &output_sinks;
+	init_sink(s, mode, file, NULL);
+	while(*tail)
+		tail = &(*tail)->next;
+	*tail = s;
+	return true;
+}
+
+/* Closes the additional outputs, returns false if any couldn't be written */
+static bool close_output_sinks(void) {
+	bool ok = true;
+	while(output_sinks) {
+		struct sink *next = output_sinks->next;
+		if(ferror(output_sinks->file) | fclose(output_sinks->file)) {
+			fprintf(stderr, "Couldn't write output (error %d)\n", (int) errno);
+			ok = false;
+		}
+		free(output_sinks);
+		output_sinks = next;
+	}
+	return ok;
+}
+
+enum {
+	OPT_MAX_MEMORY = 256, // first value which doesn't clash with short options
+	OPT_PROFILE,
+	OPT_CHECK,
+	OPT_DIFF,
+	OPT_PIPELINE,
+	OPT_COMPILE,
+	OPT_VARIANTS,
+	OPT_SERVE,
+	OPT_OBJECT,
+	OPT_LINK,
+	OPT_OUT_BIN,
+	OPT_OUT_HEX,
+	OPT_OUT_MAP,
+	OPT_SRCMAP,
+	OPT_WHERE
+};
+
+const struct option long_options[] = {
+	{"max-memory", required_argument, NULL, OPT_MAX_MEMORY},
+	{"profile", required_argument, NULL, OPT_PROFILE},
+	{"check", required_argument, NULL, OPT_CHECK},
+	{"diff", required_argument, NULL, OPT_DIFF},
+	{"pipeline", no_argument, NULL, OPT_PIPELINE},
+	{"compile", no_argument, NULL, OPT_COMPILE},
+	{"variants", required_argument, NULL, OPT_VARIANTS},
+	{"serve", required_argument, NULL, OPT_SERVE},
+	{"object", no_argument, NULL, OPT_OBJECT},
+	{"link", no_argument, NULL, OPT_LINK},
+	{"out-bin", required_argument, NULL, OPT_OUT_BIN},
+	{"out-hex", required_argument, NULL, OPT_OUT_HEX},
+	{"out-map", required_argument, NULL, OPT_OUT_MAP},
+	{"srcmap", required_argument, NULL, OPT_SRCMAP},
+	{"where", required_argument, NULL, OPT_WHERE},
+	{NULL, 0, NULL, 0}
+};
+
+/* Runs the second pass, reading literal bytes from the template if given */
+static void render(struct sink *sink, struct bytequeue *buffer, const struct precompiled *template) {
+	line_number = 1;
+	offset = 0;
+	formatqueue_pos = 0;
+	rewind_sourcemap();
+	incbins_pos = 0;
+
+	if(template) {
+		for(uint64_t i = 0; i < template->nbytes; i++)
+			output_byte(template->bytes[i], sink);
+	} else {
+		bytequeue_rewind(buffer);
+		for(int byte; (byte = bytequeue_get(buffer)) != EOF;)
+			output_byte(byte, sink);
+	}
+	finalize_output(sink);
+}
+
+/* Renders every variant to its own file, split between 'jobs' processes */
+static int render_variants(const char *path_template, unsigned jobs,
+		struct bytequeue *buffer, const struct precompiled *template) {
+	capture_variant_base();
+	plan_formatter_cache();
+	int status = 0;
+	unsigned worker = 0, forked = 1;
+#ifdef _POSIX_C_SOURCE
+	if(buffer->spill)
+		jobs = 1; // processes would share the position in the spill file
+	fflush(stdout);
+	fflush(stderr);
+	for(; forked < jobs; forked++) {
+		pid_t pid = fork();
+		if(pid == 0) {
+			worker = forked;
+			break;
+		}
+		if(pid < 0) {
+			fprintf(stderr, "Couldn't start process (error %d), continuing with %u\n", errno, forked);
+			break;
+		}
+	}
+#endif
+	for(size_t row = 0; row < variants.nrows; row++) {
+		// the first process also takes the share of processes which failed to start
+		unsigned owner = row % jobs;
+		if(owner != worker && (worker != 0 || owner < forked))
+			continue;
+		apply_variant(row);
+		char *path = expand_variant_path(path_template, row);
+		FILE *file = fopen(path, "wb");
+		if(!file) {
+			fprintf(stderr, "Couldn't open file \"%s\" (error %d)\n", path, (int) errno);
+			free(path);
+			status = 1;
+			continue;
+		}
+		static struct sink sink;
+		init_sink(&sink, output_mode, file, NULL);
+		render(&sink, buffer, template);
+		if(fclose(file) != 0) {
+			fprintf(stderr, "Couldn't write file \"%s\" (error %d)\n", path, (int) errno);
+			status = 1;
+		}
+		free(path);
+	}
+#ifdef _POSIX_C_SOURCE
+	if(worker != 0)
+		exit(status);
+	for(int child; wait(&child) > 0;)
+		if(!WIFEXITED(child) || WEXITSTATUS(child) != 0)
+			status = 1;
+#endif
+	return status;
+}
+
 void reset_terminal(void) {
 	if(isatty(fileno(stdout)))
 		fprintf(stdout, "\033[0m");
@@ -139,10 +341,32 @@ void reset_terminal(void) {
 int main(int argc, char **argv) {
 	bool force_binary = false;
 	bool force_color = false;
+	size_t max_memory = 0;
+	FILE *profile_output = NULL;
+	const char *check_file = NULL;
+	bool list_differences = false;
+	bool pipelined = false;
+	bool compile = false;
+	bool object = false;
+	bool link = false;
+	const char *output_file = NULL;
+	const char *variants_file = NULL;
+	const char *serve_socket = NULL;
+	const char *srcmap_file = NULL;
+	const char *where_offset = NULL;
+	unsigned jobs = 1;
+	bool jobs_given = false;
+	int noptions = 0;
+
+#ifdef HAVE_SERVER
+	if(argc >= 3 && !strcmp(argv[1], "--connect"))
+		return connect_server(argv[2], argc - 3, argv + 3);
+#endif
 
 	opterr = 0; // disable 'getopt' error message
 	int opt;
-	while((opt = getopt(argc, argv, "vVhbBdcC")) != -1) {
+	while((opt = getopt_long(argc, argv, "vVhbBdcCo:D:j:", long_options, NULL)) != -1) {
+		noptions++;
 		switch (opt) {
 			case 'h':
 				print_usage();
@@ -170,28 +394,160 @@ int main(int argc, char **argv) {
 			case 'c':
 				output_mode = OUTPUT_HEX_COLOR;
 				break;
+			case 'o':
+				output_file = optarg;
+				break;
+			case 'D':
+				add_definition(optarg);
+				break;
+			case 'j':
+				if((jobs = strtoul(optarg, NULL, 0)) < 1) {
+					fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+					return EINVAL;
+				}
+				jobs_given = true;
+				break;
+			case OPT_MAX_MEMORY:
+				if(!(max_memory = parse_size(optarg))) {
+					fprintf(stderr, "Invalid memory limit: %s\n", optarg);
+					return EINVAL;
+				}
+				break;
+			case OPT_PROFILE:
+				if(!(profile_output = fopen(optarg, "w"))) {
+					fprintf(stderr, "Couldn't open file \"%s\" (error %d)\n", optarg, (int) errno);
+					return errno;
+				}
+				start_profile();
+				break;
+			case OPT_CHECK:
+			case OPT_DIFF:
+				check_file = optarg;
+				list_differences = opt == OPT_DIFF;
+				break;
+			case OPT_PIPELINE:
+#ifdef HAVE_PIPELINE
+				pipelined = true;
+#else
+				fprintf(stderr, "Pipelined mode is not supported on this platform\n");
+#endif
+				break;
+			case OPT_COMPILE:
+				compile = true;
+				break;
+			case OPT_OBJECT:
+				compile = object = true;
+				break;
+			case OPT_LINK:
+				link = true;
+				break;
+			case OPT_VARIANTS:
+				variants_file = optarg;
+				break;
+			case OPT_SERVE:
+				serve_socket = optarg;
+				break;
+			case OPT_OUT_BIN:
+			case OPT_OUT_HEX:
+			case OPT_OUT_MAP:
+				if(!add_output_sink(optarg, opt == OPT_OUT_BIN ? OUTPUT_BINARY
+						: opt == OPT_OUT_HEX ? OUTPUT_HEX : OUTPUT_MAP))
+					return errno;
+				break;
+			case OPT_SRCMAP:
+				srcmap_file = optarg;
+				srcmap_mode = true;
+				break;
+			case OPT_WHERE:
+				where_offset = optarg;
+				break;
 			default:
-				fprintf(stderr, "Unknown option: %s\n", argv[optind]);
+				fprintf(stderr, "Unknown option: %s\n", argv[optind - 1]);
 				print_usage();
 				return EINVAL; // invalid argument
 		}
 	}
 
-	if(isatty(fileno(stdout)) && (output_mode == OUTPUT_BINARY) && !force_binary) {
+	if(where_offset) {
+		if(optind + 1 != argc) {
+			fprintf(stderr, "'--where' needs a single source map file\n");
+			return EINVAL;
+		}
+		return where_srcmap(argv[optind], where_offset);
+	}
+
+	if(serve_socket) {
+#ifdef HAVE_SERVER
+		if(optind < argc || noptions != 1 + jobs_given) {
+			fprintf(stderr, "'--serve' only accepts '-j', other options are given by clients\n");
+			return EINVAL;
+		}
+		if(!jobs_given)
+			jobs = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+		return serve(serve_socket, jobs, main);
+#else
+		fprintf(stderr, "Server mode is not supported on this platform\n");
+		return 1;
+#endif
+	}
+
+	if(variants_file && (!output_file || compile || check_file || pipelined)) {
+		fprintf(stderr, "'--variants' needs an output path template (-o) and can't be"
+			" combined with '--compile', '--check', '--diff' or '--pipeline'\n");
+		return EINVAL;
+	}
+	if(variants_file && !load_variants(variants_file))
+		return 1;
+	if(output_sinks && (variants_file || compile)) {
+		fprintf(stderr, "'--out-bin', '--out-hex' and '--out-map' can't be combined"
+			" with '--variants', '--compile' or '--object'\n");
+		return EINVAL;
+	}
+	// with additional outputs, the standard output is only written if asked for
+	bool to_stdout = !output_sinks || output_file || check_file;
+
+	if(output_file && !variants_file && !freopen(output_file, "wb", stdout)) {
+		fprintf(stderr, "Couldn't open file \"%s\" (error %d)\n", output_file, (int) errno);
+		return errno;
+	}
+	if(to_stdout && isatty(fileno(stdout)) && (output_mode == OUTPUT_BINARY || compile) && !force_binary && !check_file) {
 		fprintf(stderr, "Refusing to write binary data to console, use '-B' to override\n");
 		return 1;
 	}
-	if(!isatty(fileno(stdout)) && (output_mode == OUTPUT_HEX_COLOR) && !force_color) {
+	if(to_stdout && !isatty(fileno(stdout)) && (output_mode == OUTPUT_HEX_COLOR) && !force_color) {
 		fprintf(stderr, "Refusing to write colored output to a non-tty, use '-C' to override\n");
 		output_mode = OUTPUT_HEX;
 		// not a fatal error, no need to exit
 	}
 
+	if(pipelined && (debug_mode || check_file)) {
+		fprintf(stderr, "'--pipeline' can't be combined with '-d', '--check' or '--diff'\n");
+		return EINVAL;
+	}
+
 	if(debug_mode)
 		atexit(reset_terminal);
 
-	if(optind >= argc) {
-		// no file argument given
+	bool precompiled = !link && optind < argc && is_precompiled_name(argv[optind]);
+	if(precompiled && compile) {
+		fprintf(stderr, "\"%s\" is already precompiled\n", argv[optind]);
+		return EINVAL;
+	}
+	if(!link && optind < argc && is_object_name(argv[optind])) {
+		fprintf(stderr, "\"%s\" is an object, link it with '--link'\n", argv[optind]);
+		return EINVAL;
+	}
+	if(link && optind >= argc) {
+		fprintf(stderr, "'--link' needs at least one object\n");
+		return EINVAL;
+	}
+	if(srcmap_file && (precompiled || link)) {
+		fprintf(stderr, "'--srcmap' needs the source, not a precompiled template or objects\n");
+		return EINVAL;
+	}
+
+	if(optind >= argc || precompiled || link) {
+		// no file argument given, or the first pass is skipped
 		current_input = stdin;
 		current_file_name = "<stdin>";
 	} else {
@@ -206,18 +562,23 @@ int main(int argc, char **argv) {
 	char *line = malloc(default_linebuffer_size);
 	size_t len = default_linebuffer_size;
 	ssize_t nread;
-	/* buffers for input/output streams, allocated with a single malloc call */
-	char *shared_buffer = malloc(io_buffer_size * 2);
+	/* buffer for the input stream, output is buffered by the sink */
+	char *shared_buffer = malloc(io_buffer_size);
 
 
 	if(!debug_mode && !isatty(fileno(current_input)))
 		setvbuf(current_input, shared_buffer, _IOFBF, io_buffer_size);
 
-	FILE *output = stdout;
-	if(!debug_mode && !isatty(fileno(output)))
-		setvbuf(output, shared_buffer + io_buffer_size, _IOFBF, io_buffer_size);
+	struct checker checker;
+	if(check_file && !open_checker(&checker, check_file, list_differences))
+		return errno ? errno : 1;
+
+	static struct sink sink;
+	init_sink(&sink, output_mode, stdout, check_file ? &checker : NULL);
 
 	add_builtin_variables();
+	if(!apply_definitions())
+		return EINVAL;
 
 	if(debug_mode && isatty(fileno(stdin)))
 		if(signal(SIGINT, enter_debugger_async) == SIG_ERR)
@@ -227,37 +588,135 @@ int main(int argc, char **argv) {
 		enter_debugger();
 
 	struct bytequeue buffer = make_bytequeue();
+	if(max_memory)
+		bytequeue_limit_memory(&buffer, max_memory);
+
+	struct precompiled template = {0};
+	if(precompiled && !load_precompiled(&template, argv[optind], false))
+		return 1;
+	struct precompiled *objects = NULL;
+	if(link) {
+		objects = calloc(argc - optind, sizeof objects[0]);
+		if(!link_objects(objects, argv + optind, argc - optind, &buffer))
+			return 1;
+		current_file_name = "<linked>";
+	}
+
+	char *cache_file = NULL;
+#ifdef HAVE_SERVER
+	// in server workers, reuse the first pass of earlier requests
+	if(template_cache_dir && !precompiled && !link && !compile && !debug_mode && !srcmap_file && optind < argc)
+		cache_file = cached_template_path(argv[optind]);
+	if(cache_file && load_precompiled(&template, cache_file, true)) {
+		precompiled = true;
+		OPTIONAL_FREE(cache_file);
+		cache_file = NULL;
+	}
+	if(template_cache_dir && !link && optind < argc)
+		current_file_name = argv[optind];
+#endif
 
-	while((nread = getline(&line, &len, current_input)) != -1 || !feof(current_input)) {
+	int read_error = 0;
+#ifdef HAVE_PIPELINE
+	static struct pipeline_stage reader, writer;
+	if(pipelined && !precompiled && !link && !start_reader(&reader, current_input))
+		return 1;
+	if(pipelined && !precompiled && !link)
+		read_error = pipelined_process_input(&reader, &buffer);
+	else
+#endif
+	while(!precompiled && !link && ((nread = getline(&line, &len, current_input)) != -1 || !feof(current_input))) {
 		clearerr(current_input);
 		line_number++;
 		process_line(line, &buffer);
 	}
+	if(read_error) {
+		fprintf(stderr, "Couldn't read file \"%s\" (error %d)\n", current_file_name, read_error);
+		return read_error;
+	}
 
-	bytequeue_rewind(&buffer);
+	close_scope();
+	apply_definitions();
+	if(srcmap_file && !write_srcmap(srcmap_file, offset)) {
+		fprintf(stderr, "Couldn't write source map \"%s\" (error %d)\n", srcmap_file, (int) errno);
+		return errno ? errno : 1;
+	}
+#ifdef HAVE_SERVER
+	if(cache_file) {
+		store_cached_template(cache_file, &buffer, argv[optind]);
+		free(cache_file);
+	}
+#endif
 
-	line_number = 1;
-	offset = 0;
+	int status = 0;
+	if(compile) {
+		const char *source_name = optind < argc && !link ? argv[optind] : NULL;
+		if(!write_precompiled(stdout, &buffer, source_name, object)) {
+			fprintf(stderr, "Couldn't write precompiled template (error %d)\n", (int) errno);
+			status = 1;
+		}
+		goto finish;
+	}
+
+	if(variants_file && immediate_reads_variant) {
+		status = 1;
+		goto finish;
+	}
+	if(variants_file) {
+		status = render_variants(output_file, jobs, &buffer, precompiled ? &template : NULL);
+		goto finish;
+	}
 
-	for(int byte; (byte = bytequeue_get(&buffer)) != EOF;)
-		output_byte(byte, output);
+#ifdef HAVE_PIPELINE
+	if(pipelined && to_stdout) {
+		if(!start_writer(&writer, stdout))
+			return 1;
+		attach_writer(&sink, &writer);
+	}
+#endif
+
+	sink.next = output_sinks;
+	render(to_stdout ? &sink : output_sinks, &buffer, precompiled ? &template : NULL);
+#ifdef HAVE_PIPELINE
+	if(pipelined && to_stdout && !stop_writer(&writer, sink.buf))
+		status = 1;
+#endif
+	if(!close_output_sinks())
+		status = 1;
+
+	if(check_file && close_checker(&checker, sink.flushed))
+		status = 1;
 
-	finalize_output(output);
+	finish:
+	if(profile_output) {
+		write_profile(profile_output);
+		fclose(profile_output);
+		print_profile_summary(stderr, 10);
+	}
 
-	fflush(output);
-	if(output != stdout)
-		fclose(output);
+	fflush(stdout);
 	if(current_input != stdin)
 		fclose(current_input);
 
+	if(precompiled)
+		unload_precompiled(&template);
+	if(link)
+		unload_objects(objects, argc - optind);
 	cleanup_formatters();
 	cleanup_labels();
 	cleanup_breakpoints();
 	cleanup_sourcemap();
+	cleanup_incbins();
+	cleanup_imported_paths();
+	cleanup_locations();
+	cleanup_scope();
+	cleanup_marker_files();
+	cleanup_profile();
+	cleanup_variants();
 
 	free_bytequeue(buffer);
 
 	OPTIONAL_FREE(line);
 	OPTIONAL_FREE(shared_buffer);
-	return 0;
+	return status;
 }
@@ -0,0 +1,471 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+
+#include "diagnostic.h"
+#include "charclass.h"
+#include "text.h"
+#include "calc.h"
+#include "formatter.h"
+#include "bytequeue.h"
+
+/**
+ * This header implements 'import ihex "path" [base]' and 'import xxd ...',
+ * which decode Intel HEX records or an xxd dump in the first pass, so the
+ * bytes don't have to be converted to octets and parsed again. Records
+ * are placed at their addresses, counted from 'base' or from the lowest
+ * address in the file, and gaps are filled with IMPORT_FILL. The whole
+ * file is decoded before anything is written, so a bad record leaves no
+ * partial output. Runs of hex digits are decoded eight bytes at a time.
+ * Dumps from 'xxd -e' store each group little-endian; they are recognized
+ * by comparing the groups with the character column.
+ */
+
+#define IMPORT_FILL 0xff
+
+enum import_format {IMPORT_IHEX, IMPORT_XXD};
+
+struct import {
+	enum import_format format;
+	const char *path;
+	bool has_base;
+	uint64_t base;
+};
+
+/* Decoded bytes which are contiguous in the file's address space */
+struct import_run {
+	uint64_t address;
+	size_t start, len; // range in 'data'
+};
+
+/* Byte order of the groups of an xxd dump, known once a line's characters
+	only match one of them */
+enum xxd_order {XXD_ORDER_UNKNOWN, XXD_ORDER_NORMAL, XXD_ORDER_SWAPPED};
+
+struct import_data {
+	uint8_t *data;
+	size_t len, cap;
+	struct import_run *runs;
+	size_t nruns, runs_cap;
+	const char *path;
+	uint64_t line; // line in the dump, for diagnostics
+	// xxd only: range in 'data' of each group on the current line
+	struct import_group {
+		size_t start, len;
+	} *groups;
+	size_t ngroups, groups_cap;
+	enum xxd_order order;
+	bool ambiguous; // lines were decoded before the order was known
+	bool restart; // they were decoded in the wrong order
+};
+
+/* Parses the format, path and optional base address of an import directive */
+static size_t scan_import(const char *string, struct import *out) {
+	const char *start = string;
+	string += scan_whitespace(string);
+	if(!strncmp(string, "ihex", 4) && !CHAR_IS(string[4], CC_NAME)) {
+		out->format = IMPORT_IHEX;
+		string += 4;
+	} else if(!strncmp(string, "xxd", 3) && !CHAR_IS(string[3], CC_NAME)) {
+		out->format = IMPORT_XXD;
+		string += 3;
+	} else {
+		report_error("Unknown import format, expected \"ihex\" or \"xxd\"");
+		textfail = true;
+		return strlen(start);
+	}
+	string += scan_whitespace(string);
+	const char *path = string;
+	string += scan_quoted_string(string);
+	if(textfail || path[0] != '"') {
+		report_error("Expected a quoted path after the import format");
+		textfail = true;
+		return string - start;
+	}
+	out->path = strndup(path + 1, string - path - 2);
+	out->has_base = false;
+	string += scan_whitespace(string);
+	if(string[0] == '[') {
+		char *base;
+		string += scan_balanced(string, (const char**) &base, "[]");
+		calc_int_t value = to_integer(calc(base));
+		free(base);
+		if(value < 0) {
+			report_error("Base address of an import can't be negative");
+			value = 0;
+		}
+		out->has_base = true;
+		out->base = value;
+	}
+	return string - start;
+}
+
+static inline uint64_t load64_le(const char *p) {
+	uint64_t w;
+	memcpy(&w, p, 8);
+	return host_big_endian() ? bswap64(w) : w;
+}
+
+#define EACH_BYTE(x) (0x0101010101010101ull * (x))
+/* High bit of each byte between lo and hi, for bytes below 0x80 the sums can't carry */
+#define BYTES_IN_RANGE(w, lo, hi) \
+	(((w) + EACH_BYTE(0x80 - (lo))) & ~((w) + EACH_BYTE(0x7f - (hi))) & EACH_BYTE(0x80))
+
+/* Decodes 16 hex digits into 8 bytes, returns false if any isn't a hex digit */
+static bool decode_hex16(const char *text, uint8_t *out) {
+	for(int half = 0; half < 2; half++) {
+		uint64_t w = load64_le(text + 8 * half);
+		uint64_t digits = BYTES_IN_RANGE(w, '0', '9');
+		uint64_t letters = BYTES_IN_RANGE(w | EACH_BYTE(0x20), 'a', 'f');
+		if((w & EACH_BYTE(0x80)) || (digits | letters) != EACH_BYTE(0x80))
+			return false;
+		uint64_t v = (w & EACH_BYTE(0x0f)) + (letters >> 7) * 9;
+		// the two nibbles of each 16 bit lane form a byte, then the lanes are packed
+		v = ((v & 0x000f000f000f000full) << 4) | ((v >> 8) & 0x000f000f000f000full);
+		v = (v | v >> 8) & 0x0000ffff0000ffffull;
+		v = (v | v >> 16) & 0xffffffffull;
+		store32_le(out + 4 * half, v);
+	}
+	return true;
+}
+
+/* Decodes 'n' bytes from 2 * n hex digits, returns false on another character */
+static bool decode_hex(const char *text, size_t n, uint8_t *out) {
+	for(; n >= 8; n -= 8, text += 16, out += 8)
+		if(!decode_hex16(text, out))
+			return false;
+	for(; n; n--, text += 2) {
+		if(!CHAR_IS(text[0], CC_HEX) || !CHAR_IS(text[1], CC_HEX))
+			return false;
+		*out++ = HEX_VALUE(text[0]) << 4 | HEX_VALUE(text[1]);
+	}
+	return true;
+}
+
+/* Returns space for 'len' bytes at 'address', extending the last run if it ends there */
+static uint8_t *import_reserve(struct import_data *d, uint64_t address, size_t len) {
+	if(d->len + len > d->cap) {
+		d->cap = (d->cap == 0) ? 4096 : d->cap * 2;
+		if(d->cap < d->len + len)
+			d->cap = d->len + len;
+		d->data = realloc(d->data, d->cap);
+	}
+	struct import_run *last = d->nruns ? &d->runs[d->nruns - 1] : NULL;
+	if(last && last->address + last->len == address) {
+		last->len += len;
+	} else {
+		if(d->nruns >= d->runs_cap) {
+			d->runs_cap = (d->runs_cap == 0) ? 16 : d->runs_cap * 2;
+			d->runs = realloc(d->runs, d->runs_cap * sizeof(d->runs[0]));
+		}
+		struct import_run run = {.address = address, .start = d->len, .len = len};
+		d->runs[d->nruns++] = run;
+	}
+	uint8_t *out = d->data + d->len;
+	d->len += len;
+	return out;
+}
+
+/* Reports an error at the current line of the dump */
+#ifdef __GNUC__
+__attribute((format (printf, 2, 3)))
+#endif
+static void import_error(const struct import_data *d, const char *fmt, ...) {
+	va_list v;
+	va_start(v, fmt);
+	fprintf(stderr, "%s:%" PRIu64 "  \"%s\" line %" PRIu64 ": ",
+		current_file_name, line_number, d->path, d->line);
+	vfprintf(stderr, fmt, v);
+	fputc('\n', stderr);
+	va_end(v);
+}
+
+/* Decodes one Intel HEX record, 'extended' holds the address from type 2 and 4 records */
+static bool import_ihex_line(struct import_data *d, const char *line, size_t len,
+		uint64_t *extended, bool *done) {
+	if(!len)
+		return true;
+	if(line[0] != ':' || len < 11 || (len - 1) % 2) {
+		import_error(d, "Expected an Intel HEX record");
+		return false;
+	}
+	uint8_t header[4];
+	if(!decode_hex(line + 1, 4, header) || len != 11 + 2 * (size_t) header[0]) {
+		import_error(d, "Invalid Intel HEX record length");
+		return false;
+	}
+	unsigned count = header[0], type = header[3];
+	uint64_t address = *extended + ((unsigned) header[1] << 8 | header[2]);
+	uint8_t local[256];
+	uint8_t *data = type == 0 ? import_reserve(d, address, count) : local;
+	uint8_t checksum;
+	if(!decode_hex(line + 9, count, data) || !decode_hex(line + 9 + 2 * count, 1, &checksum)) {
+		import_error(d, "Invalid hex digit in Intel HEX record");
+		return false;
+	}
+	unsigned sum = header[0] + header[1] + header[2] + header[3] + checksum;
+	for(unsigned i = 0; i < count; i++)
+		sum += data[i];
+	if(sum & 0xff) {
+		import_error(d, "Checksum mismatch in Intel HEX record");
+		return false;
+	}
+	switch(type) {
+		case 0: // data
+		case 3: // start segment address
+		case 5: // start linear address
+			break;
+		case 1: // end of file
+			*done = true;
+			break;
+		case 2: // extended segment address
+		case 4: // extended linear address
+			if(count != 2) {
+				import_error(d, "Invalid Intel HEX address record");
+				return false;
+			}
+			*extended = (uint64_t)(data[0] << 8 | data[1]) << (type == 2 ? 4 : 16);
+			break;
+		default:
+			import_error(d, "Unknown Intel HEX record type %u", type);
+			return false;
+	}
+	return true;
+}
+
+/* Returns the end of the hex digits of an xxd line starting at 'pos'.
+	Two spaces come before the characters, which have one column per
+	byte; 'xxd -e' also puts spaces before a partial group, so the
+	characters are found by their length, or else after the first two
+	spaces when trailing spaces were removed */
+static size_t xxd_hex_end(const char *line, size_t pos, size_t len, const char **chars) {
+	size_t first_gap = len, bytes = 0;
+	*chars = NULL;
+	for(; pos < len; pos++) {
+		if(line[pos] == ' ' && pos + 1 < len && line[pos + 1] == ' ') {
+			if(len - (pos + 2) == bytes) {
+				*chars = line + pos + 2;
+				return pos;
+			}
+			if(first_gap == len)
+				first_gap = pos;
+		} else if(line[pos] != ' ') {
+			// a pair of digits for each byte
+			bytes++;
+			pos++;
+		}
+	}
+	return first_gap;
+}
+
+/* True if the characters of an xxd line show the decoded bytes, with or
+	without reversing each group */
+static bool xxd_chars_match(const struct import_data *d, const char *chars, bool swapped) {
+	for(size_t g = 0; g < d->ngroups; g++) {
+		const struct import_group *group = &d->groups[g];
+		for(size_t i = 0; i < group->len; i++) {
+			uint8_t byte = d->data[group->start + (swapped ? group->len - 1 - i : i)];
+			if(*chars++ != (byte >= 0x20 && byte < 0x7f ? (char) byte : '.'))
+				return false;
+		}
+	}
+	return true;
+}
+
+/* Settles the group order from the characters of the line and reverses
+	the groups of 'xxd -e'. Returns false if the order is inconsistent */
+static bool xxd_check_order(struct import_data *d, const char *chars) {
+	bool normal = chars && xxd_chars_match(d, chars, false);
+	bool swapped = chars && xxd_chars_match(d, chars, true);
+	if(normal != swapped) {
+		enum xxd_order order = normal ? XXD_ORDER_NORMAL : XXD_ORDER_SWAPPED;
+		if(d->order == XXD_ORDER_UNKNOWN) {
+			d->order = order;
+			d->restart = d->ambiguous && order == XXD_ORDER_SWAPPED;
+		} else if(d->order != order) {
+			import_error(d, "Groups change between big and little endian (xxd -e) in xxd dump");
+			return false;
+		}
+	} else if(d->order == XXD_ORDER_UNKNOWN) {
+		d->ambiguous = true;
+	}
+	if(d->order != XXD_ORDER_SWAPPED)
+		return true;
+	for(size_t g = 0; g < d->ngroups; g++) {
+		uint8_t *start = d->data + d->groups[g].start, *end = start + d->groups[g].len - 1;
+		for(; start < end; start++, end--) {
+			uint8_t byte = *start;
+			*start = *end;
+			*end = byte;
+		}
+	}
+	return true;
+}
+
+/* Decodes a line of 'xxd' output, or of 'xxd -p' which has no addresses */
+static bool import_xxd_line(struct import_data *d, const char *line, size_t len, uint64_t *next) {
+	size_t pos = 0;
+	while(pos < len && CHAR_IS(line[pos], CC_HEX))
+		pos++;
+	uint64_t address = *next;
+	bool plain = pos == len || line[pos] != ':';
+	const char *chars = NULL;
+	if(plain) {
+		pos = 0;
+	} else {
+		address = 0;
+		for(size_t i = 0; i < pos; i++)
+			address = address << 4 | HEX_VALUE(line[i]);
+		pos++;
+		len = xxd_hex_end(line, pos, len, &chars);
+	}
+	d->ngroups = 0;
+	while(pos < len) {
+		if(line[pos] == ' ') {
+			pos++;
+			continue;
+		}
+		size_t run = 0;
+		while(pos + run < len && CHAR_IS(line[pos + run], CC_HEX))
+			run++;
+		if(run == 0 || run % 2) {
+			import_error(d, "Expected pairs of hex digits in xxd dump");
+			return false;
+		}
+		if(d->ngroups >= d->groups_cap) {
+			d->groups_cap = (d->groups_cap == 0) ? 16 : d->groups_cap * 2;
+			d->groups = realloc(d->groups, d->groups_cap * sizeof(d->groups[0]));
+		}
+		uint8_t *out = import_reserve(d, address, run / 2);
+		struct import_group group = {.start = out - d->data, .len = run / 2};
+		d->groups[d->ngroups++] = group;
+		decode_hex(line + pos, run / 2, out);
+		address += run / 2;
+		pos += run;
+	}
+	*next = address;
+	return plain || xxd_check_order(d, chars);
+}
+
+static int compare_import_runs(const void *a, const void *b) {
+	const struct import_run *x = a, *y = b;
+	return (x->address > y->address) - (x->address < y->address);
+}
+
+/* Writes the runs in address order with filled gaps, returns the number of bytes */
+static uint64_t write_import(struct import_data *d, const struct import *imp, struct bytequeue *q) {
+	if(!d->nruns)
+		return 0;
+	bool sorted = true;
+	for(size_t i = 1; i < d->nruns && sorted; i++)
+		sorted = d->runs[i - 1].address <= d->runs[i].address;
+	if(!sorted)
+		qsort(d->runs, d->nruns, sizeof(d->runs[0]), compare_import_runs);
+	uint64_t base = imp->has_base ? imp->base : d->runs[0].address;
+	if(d->runs[0].address < base) {
+		report_error("\"%s\" has data at 0x%" PRIx64 ", below the base address 0x%" PRIx64,
+			imp->path, d->runs[0].address, base);
+		return 0;
+	}
+	for(size_t i = 1; i < d->nruns; i++) {
+		if(d->runs[i].address < d->runs[i - 1].address + d->runs[i - 1].len) {
+			report_error("\"%s\" has overlapping data at 0x%" PRIx64, imp->path, d->runs[i].address);
+			return 0;
+		}
+	}
+	static uint8_t fill[4096];
+	if(fill[0] != IMPORT_FILL)
+		memset(fill, IMPORT_FILL, sizeof fill);
+	uint64_t pos = base;
+	for(size_t i = 0; i < d->nruns; i++) {
+		for(uint64_t gap = d->runs[i].address - pos; gap;) {
+			size_t n = gap < sizeof fill ? gap : sizeof fill;
+			bytequeue_write(q, fill, n);
+			gap -= n;
+		}
+		bytequeue_write(q, d->data + d->runs[i].start, d->runs[i].len);
+		pos = d->runs[i].address + d->runs[i].len;
+	}
+	return pos - base;
+}
+
+/* Decodes the dump and appends its bytes, returns how many were written */
+uint64_t import_dump(const struct import *imp, struct bytequeue *q) {
+	FILE *file = fopen(imp->path, "r");
+	if(!file) {
+		report_error("Couldn't open file \"%s\" (error %d)", imp->path, (int) errno);
+		return 0;
+	}
+	struct import_data d = {.path = imp->path};
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t nread;
+	bool ok = true, done = false;
+	uint64_t address = 0;
+	while(ok && !done && (nread = getline(&line, &cap, file)) != -1) {
+		size_t len = nread;
+		if(imp->format == IMPORT_IHEX) {
+			trim_end(line, &len);
+		} else {
+			// the characters of an xxd dump may end with spaces
+			while(len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+				len--;
+		}
+		size_t skip = scan_whitespace(line);
+		d.line++;
+		ok = imp->format == IMPORT_IHEX
+			? import_ihex_line(&d, line + skip, len - skip, &address, &done)
+			: import_xxd_line(&d, line + skip, len - skip, &address);
+		if(ok && d.restart) {
+			// decode the earlier lines again, now that the order is known
+			rewind(file);
+			d.len = d.nruns = 0;
+			d.line = 0;
+			d.restart = false;
+			address = 0;
+		}
+	}
+	if(ok && ferror(file)) {
+		report_error("Couldn't read file \"%s\" (error %d)", imp->path, (int) errno);
+		ok = false;
+	}
+	fclose(file);
+	free(line);
+	uint64_t size = ok ? write_import(&d, imp, q) : 0;
+	free(d.data);
+	free(d.runs);
+	free(d.groups);
+	return size;
+}
+
+/* Dumps read by the first pass, precompiled templates are outdated
+	once one of them changes */
+const char **imported_paths;
+size_t imported_len, imported_cap;
+
+void add_imported_path(const char *path) {
+	if(imported_len >= imported_cap) {
+		imported_cap = (imported_cap == 0) ? 4 : imported_cap * 2;
+		imported_paths = realloc(imported_paths, imported_cap * sizeof(imported_paths[0]));
+	}
+	imported_paths[imported_len++] = path;
+}
+
+void reset_imported_paths(void) {
+	for(size_t i = 0; i < imported_len; i++)
+		free((char*) imported_paths[i]);
+	imported_len = 0;
+}
+
+void cleanup_imported_paths(void) {
+	for(size_t i = 0; i < imported_len; i++)
+		OPTIONAL_FREE(imported_paths[i]);
+	OPTIONAL_FREE(imported_paths);
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _POSIX_C_SOURCE
+#include <sys/stat.h>
+#endif
+
+#include "diagnostic.h"
+
+/**
+ * This header keeps the files spliced into the output by
+ * 'incbin "path" [offset, length]'. The first pass only records the
+ * range and counts its size, the data is read while writing the output,
+ * in the same order as the directives.
+ */
+
+struct incbin {
+	const char *path;
+	uint64_t start, length;
+} *incbins;
+
+size_t incbins_pos, incbins_len, incbins_cap;
+
+void add_incbin(struct incbin b) {
+	if(incbins_len >= incbins_cap) {
+		incbins_cap = (incbins_cap == 0) ? 4 : incbins_cap * 2;
+		incbins = realloc(incbins, incbins_cap * sizeof(incbins[0]));
+	}
+	incbins[incbins_len++] = b;
+}
+
+void take_next_incbin(struct incbin *out) {
+	if(incbins_pos >= incbins_len) {
+		report_error("Included file queue underflow");
+		out->path = NULL;
+		out->length = 0;
+		return;
+	}
+	*out = incbins[incbins_pos++];
+}
+
+/* Stores the size of the file, returns false if it can't be read */
+bool incbin_file_size(const char *path, uint64_t *size) {
+#ifdef _POSIX_C_SOURCE
+	struct stat st;
+	if(stat(path, &st) != 0)
+		return false;
+	*size = st.st_size;
+	return true;
+#else
+	FILE *file = fopen(path, "rb");
+	if(!file)
+		return false;
+	bool ok = fseek(file, 0, SEEK_END) == 0 && ftell(file) >= 0;
+	*size = ok ? (uint64_t)ftell(file) : 0;
+	fclose(file);
+	return ok;
+#endif
+}
+
+/* Opens the file positioned at the start of the range */
+FILE *open_incbin(const struct incbin *b) {
+	FILE *file = fopen(b->path, "rb");
+	if(!file) {
+		report_error("Couldn't open file \"%s\" (error %d)", b->path, (int) errno);
+		return NULL;
+	}
+#ifdef _POSIX_C_SOURCE
+	int error = fseeko(file, b->start, SEEK_SET);
+#else
+	int error = fseek(file, b->start, SEEK_SET);
+#endif
+	if(error) {
+		report_error("Couldn't seek in file \"%s\" (error %d)", b->path, (int) errno);
+		fclose(file);
+		return NULL;
+	}
+	return file;
+}
+
+void reset_incbins(void) {
+	for(size_t i = 0; i < incbins_len; i++)
+		free((char*) incbins[i].path);
+	incbins_len = incbins_pos = 0;
+}
+
+void cleanup_incbins(void) {
+	for(size_t i = 0; i < incbins_len; i++)
+		OPTIONAL_FREE(incbins[i].path);
+	OPTIONAL_FREE(incbins);
+}
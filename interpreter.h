@@ -11,131 +11,276 @@
 #include "calc.h"
 #include "sourcemap.h"
 #include "bytequeue.h"
+#include "profile.h"
+#include "lexer.h"
+#include "probes.h"
+#include "incbin.h"
+#include "locations.h"
+#include "scope.h"
+#include "import.h"
+#include "variants.h"
 
 struct bytequeue buffer;
 
 /* The current byte offset */
 uint64_t offset = 0;
 
-bool block_comment = false;
+/* File names from line markers; they are kept until the end because
+	diagnostics and source locations point to them */
+static const char **marker_files;
+static size_t marker_files_len, marker_files_cap;
+
+/* Returns the stored copy of 'name', which is freed if it is known */
+static const char *intern_marker_file(const char *name) {
+	for(size_t i = 0; i < marker_files_len; i++) {
+		if(!strcmp(marker_files[i], name)) {
+			free((char*) name);
+			return marker_files[i];
+		}
+	}
+	if(marker_files_len >= marker_files_cap) {
+		marker_files_cap = (marker_files_cap == 0) ? 8 : marker_files_cap * 2;
+		marker_files = realloc(marker_files, marker_files_cap * sizeof(marker_files[0]));
+	}
+	return marker_files[marker_files_len++] = name;
+}
+
+/* Scratch space for encoding string literals */
+static uint8_t *encoded;
+static size_t encoded_cap;
+
+/* Parses the path and optional [offset, length] range of an incbin
+	directive and checks them against the file */
+static size_t scan_incbin(const char *string, struct incbin *out) {
+	const char *start = string;
+	string += scan_quoted_string(string);
+	if(textfail)
+		return string - start;
+	const char *path = strndup(start + 1, string - start - 2);
+	string += scan_whitespace(string);
+	calc_int_t first = 0, length = 0;
+	bool has_length = false;
+	if(string[0] == '[') {
+		char *range;
+		string += scan_balanced(string, (const char**) &range, "[]");
+		// the length follows the first comma outside of parentheses
+		int depth = 0;
+		for(char *c = range; *c; c++) {
+			depth += (*c == '(') - (*c == ')');
+			if(*c == ',' && !depth) {
+				*c = '\0';
+				length = to_integer(calc(c + 1));
+				has_length = true;
+				break;
+			}
+		}
+		first = to_integer(calc(range));
+		free(range);
+	}
+	uint64_t size;
+	if(!incbin_file_size(path, &size)) {
+		report_error("Couldn't open file \"%s\" (error %d)", path, (int) errno);
+		textfail = true;
+	} else if(first < 0 || (uint64_t)first > size || length < 0 || (uint64_t)length > size - first) {
+		report_error("Range is outside of \"%s\" (%" PRIu64 " bytes)", path, size);
+		textfail = true;
+	}
+	if(textfail) {
+		free((char*) path);
+		return string - start;
+	}
+	out->path = path;
+	out->start = first;
+	out->length = has_length ? (uint64_t)length : size - first;
+	return string - start;
+}
 
 /* Runs first-pass processing on the given line and
 	writes intermediate results to the buffer file. */
 void process_line(const char *line, struct bytequeue *buffer) {
-	if(debug_mode && (exists_breakpoint(line_number) || break_on_next)) {
+	PROBE2(line_start, line_number, offset);
+	if(debug_mode && line_number >= next_breakpoint_line && breakpoint_hit(line_number))
+		break_on_next = true;
+	if(debug_mode && break_on_next) {
 		break_on_next = false;
 		enter_debugger();
 	}
-	start:
-	line += scan_whitespace(line);
-	while(line[0]) {
-		textfail = false;
-		if(block_comment)
-			while(line[1] && line[0] != '*')
-				line++;
-		switch(line[0]) {
-			case '/': {
-				++line;
-				if(line[0] == '/')
-					goto end_loop;
-				else if(line[0] == '*')
-					block_comment = true;
-				break;
-			}
-			case '#': {
+	struct lexer lexer;
+	struct token token;
+	init_lexer(&lexer, line);
+	while(next_token(&lexer, &token) != TOKEN_END) {
+		switch(token.kind) {
+			case TOKEN_LINE_MARKER: {
 				uint64_t linenum;
 				const char *filename;
-				if(scan_line_marker(line, &linenum, &filename)) {
-					// free(current_file_name);
+				if(scan_line_marker(token.text, &linenum, &filename)) {
+					filename = intern_marker_file(filename);
+					add_source_marker(filename, linenum - 1);
 					current_file_name = filename;
 					line_number = linenum - 1;
+					if(debug_mode)
+						seek_breakpoints(linenum);
 				}
 				goto end_loop;
 			}
-			case '*': {
-				++line;
-				if(line[0] == '/')
-					block_comment = false;
-				break;
-			}
-			case ';': {
-				line++;
-				goto start;
-			}
-			case '[': {
+			case TOKEN_FORMATTER: {
 				const char *fmt, *expr;
-				line += scan_formatter(line, &fmt, &expr);
+				textfail = false;
+				lexer.pos += scan_formatter(token.text, &fmt, &expr);
 				if(textfail)
 					goto end_loop;
 				struct formatter formatter;
-				if(!create_formatter(fmt, expr, &formatter))
+				if(profile_mode) {
+					profile_set_root(current_file_name, line_number);
+					profile_enter();
+				}
+				bool created = create_formatter(fmt, expr, &formatter);
+				if(profile_mode)
+					profile_leave(NULL, 0);
+				if(!created) {
+					free((char*)fmt);
+					free((char*)expr);
 					goto end_loop;
+				}
 				// don't need to free expr because it is kept in formatter
 				free((char*)fmt);
 				add_formatter(formatter);
+				if(srcmap_mode)
+					add_formatter_location(formatter, offset);
 				add_sourcemap_entry(offset, SOURCE_FORMATTER);
-				offset += formatter.nbytes;
+				offset += FORMATTER_SIZE(formatter);
 				add_sourcemap_entry(offset, SOURCE_END);
 				break;
 			}
-			case '"': {
-				// text doesn't include quotes
-				const char *literal = line + 1;
-				// size includes quotes
-				size_t literal_size = scan_quoted_string(line);
-				if(textfail)
-					goto end_loop;
-				size_t nbytes = literal_size - 2; // don't count the quotes
+			case TOKEN_STRING: {
+				if(srcmap_mode)
+					add_location(LOCATION_STRING, offset, NULL, 0);
 				add_sourcemap_entry(offset, SOURCE_STRING);
-				offset += nbytes;
+				offset += token.len;
 				add_sourcemap_entry(offset, SOURCE_END);
-				line += literal_size;
-				for(size_t i = 0; i < nbytes; i++)
-					bytequeue_put(buffer, literal[i]);
+				bytequeue_write(buffer, (const uint8_t*) token.text, token.len);
 				break;
 			}
-
-			case 'd': {
-				if(!memcmp(line, "debugger", strlen("debugger"))) {
-					line += strlen("debugger");
-					if(debug_mode)
-						enter_debugger();
+			case TOKEN_ENCODED_STRING: {
+				if(ENCODED_MAX_SIZE(token.len) > encoded_cap) {
+					encoded_cap = ENCODED_MAX_SIZE(token.len) * 2;
+					encoded = realloc(encoded, encoded_cap);
 				}
-				// if not matched, fall through
+				struct string_format format = token.format;
+				bool big = format.endian == ENDIAN_DEFAULT
+					? calc("hexproc.endian") != 0 : format.endian == ENDIAN_BIG;
+				size_t len = encode_string(token.text, token.len, format, big, encoded);
+				if(srcmap_mode)
+					add_location(LOCATION_STRING, offset, NULL, 0);
+				add_sourcemap_entry(offset, SOURCE_STRING);
+				offset += len;
+				add_sourcemap_entry(offset, SOURCE_END);
+				bytequeue_write(buffer, encoded, len);
+				break;
 			}
-			default: {
-				// first, try matching an assignment
-				const char *key, *value;
-				enum assign_mode mode;
-				size_t assignment_size = try_scan_assign(line, &key, &value, &mode);
-				if(assignment_size) {
-					switch(mode) {
-						case ASSIGN_LABEL:
-							set_constant_label(key, offset);
-							break;
-						case ASSIGN_LAZY:
-							set_expr_label(key, value);
-							break;
-						case ASSIGN_IMMEDIATE:
-							set_constant_label(key, calc(value));
-							break;
-					}
-					line += assignment_size;
-					break;
-				}
-				// then, fall back to matching hex values
-				int byte;
-				line += scan_octet(line, &byte);
+			case TOKEN_INCBIN: {
+				struct incbin b;
+				textfail = false;
+				lexer.pos += scan_incbin(token.text, &b);
 				if(textfail)
+					goto end_loop;
+				if(srcmap_mode)
+					add_location(LOCATION_INCBIN, offset, b.path, strlen(b.path));
+				add_sourcemap_entry(offset, SOURCE_INCBIN);
+				add_incbin(b);
+				offset += b.length;
+				break;
+			}
+			case TOKEN_IMPORT: {
+				struct import imp;
+				textfail = false;
+				lexer.pos += scan_import(token.text, &imp);
+				if(textfail)
+					goto end_loop;
+				if(srcmap_mode)
+					add_location(LOCATION_IMPORT, offset, imp.path, strlen(imp.path));
+				offset += import_dump(&imp, buffer);
+				add_imported_path(imp.path);
+				break;
+			}
+			case TOKEN_DEBUGGER: {
+				if(debug_mode)
+					enter_debugger();
+				break;
+			}
+			case TOKEN_ASSIGN: {
+				const char *key = strndup(token.text, token.len);
+				if(token.mode == ASSIGN_LABEL && !IS_LOCAL_NAME(key))
+					open_scope(key);
+				if(has_definition(key)) {
+					// '-D' takes precedence, also for immediate assignments which read it
+					free((char*)key);
 					break;
-				bytequeue_put(buffer, byte);
+				}
+				switch(token.mode) {
+					case ASSIGN_LABEL:
+						set_offset_label(key, offset);
+						scope_assigned(key, NULL);
+						break;
+					case ASSIGN_LAZY: {
+						const char *value = strndup(token.value, token.value_len);
+						set_expr_label(key, value);
+						scope_assigned(key, value);
+						break;
+					}
+					case ASSIGN_IMMEDIATE: {
+						const char *value = strndup(token.value, token.value_len);
+						if(profile_mode) {
+							profile_set_root(current_file_name, line_number);
+							profile_enter();
+						}
+						calc_float_t result = calc_immediate(key, value);
+						calc_int_t constant = 0;
+						if(fits_integer(result))
+							constant = (calc_int_t) result;
+						else if(!isfinite(result) && !mathfail)
+							report_error("Value of \"%s\" is not a finite number", key);
+						else if(!mathfail)
+							report_error("Value of \"%s\" doesn't fit in " CALC_INT_TYPENAME
+								", wider values need a lazy assignment", key);
+						// after an error the label is still defined, to avoid more errors
+						set_constant_label(key, constant);
+						scope_assigned(key, NULL);
+						if(profile_mode)
+							profile_leave(NULL, 0);
+						free((char*)value);
+						break;
+					}
+				}
+				break;
+			}
+			case TOKEN_OCTET: {
+				if(srcmap_mode)
+					add_location(LOCATION_OCTETS, offset, NULL, 0);
+				bytequeue_put(buffer, token.octet);
 				offset++;
 				break;
 			}
+			case TOKEN_SKIP:
+			case TOKEN_END:
+				break;
 		}
-		line += scan_whitespace(line);
 	}
 	end_loop:
 	textfail = false;
 	add_sourcemap_entry(offset, SOURCE_NEWLINE);
+	PROBE2(line_end, line_number, offset);
+}
+
+void reset_marker_files(void) {
+	for(size_t i = 0; i < marker_files_len; i++)
+		free((char*) marker_files[i]);
+	marker_files_len = 0;
+}
+
+void cleanup_marker_files(void) {
+	for(size_t i = 0; i < marker_files_len; i++)
+		OPTIONAL_FREE(marker_files[i]);
+	OPTIONAL_FREE(marker_files);
+	OPTIONAL_FREE(encoded);
 }
@@ -2,10 +2,12 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdbool.h>
 
 #include "diagnostic.h"
 #include "hash.h"
 #include "largenum.h"
+#include "probes.h"
 
 /**
  * This header implements a mapping from names to expressions
@@ -14,29 +16,48 @@
 struct label {
 	const char *name; // must not be null
 	const char *expr; // can be NULL
-	unsigned constant;
+	calc_int_t constant;
+	bool offset; // set by "name:", relocated when objects are linked
 	struct label *next; // chained hash table
 } labelmap[64] = {0};
 
-bool lookup_label(const char *name, struct label *result) {
+/* Called after any label is assigned, used for debugger watchpoints */
+void (*label_assign_hook)(const char *name) = NULL;
+
+/* Returns the stored label, or NULL if it isn't defined */
+struct label *label_node(const char *name) {
 	struct label *node = &labelmap[strhash(name) & 63];
 	while(node && node->name)
 		if(!strcmp(node->name, name))
-			return (*result = *node), true;
+			return node;
 		else
 			node = node->next;
+	return NULL;
+}
+
+bool lookup_label(const char *name, struct label *result) {
+	struct label *node = label_node(name);
+	if(node) {
+		PROBE1(label_hit, name);
+		return (*result = *node), true;
+	}
+	PROBE1(label_miss, name);
 	return false;
 }
 
-static void set_label(const char *name, long double constant, const char *expr) {
+static void set_label(const char *name, calc_int_t constant, const char *expr, bool offset) {
 	unsigned bucket = strhash(name) & 63;
-	struct label newlabel = {.name = name, .expr = expr, .constant = constant};
+	struct label newlabel = {.name = name, .expr = expr, .constant = constant, .offset = offset};
 	struct label *node = &labelmap[bucket];
 	// loop until (node is null) OR (found right key)
 	while(node && node->name && strcmp(node->name, name))
 		node = node->next;
 	if(node) {
 		// found right key
+		if(node->name) {
+			free((char*) node->name);
+			free((char*) node->expr);
+		}
 		newlabel.next = node->next;
 		*node = newlabel;
 	} else {
@@ -47,10 +68,58 @@ static void set_label(const char *name, long double constant, const char *expr)
 		newlabel.next = swap;
 		labelmap[bucket] = newlabel;
 	}
+	PROBE2(label_set, name, expr);
+	if(label_assign_hook)
+		label_assign_hook(name);
+}
+
+/* Removes a label, returns false if it isn't defined */
+static bool remove_label(const char *name) {
+	struct label *node = &labelmap[strhash(name) & 63], *prev = NULL;
+	while(node && node->name && strcmp(node->name, name)) {
+		prev = node;
+		node = node->next;
+	}
+	if(!node || !node->name)
+		return false;
+	free((char*) node->name);
+	free((char*) node->expr);
+	struct label *next = node->next;
+	if(prev) {
+		prev->next = next;
+		free(node);
+	} else if(next) {
+		// the first element of a bucket lives in 'labelmap'
+		*node = *next;
+		free(next);
+	} else {
+		*node = (struct label) {0};
+	}
+	return true;
 }
 
-#define set_expr_label(n, e) do { set_label(n, 0, e); } while(0)
-#define set_constant_label(n, c) do { set_label(n, c, NULL); } while(0)
+#define set_expr_label(n, e) do { set_label(n, 0, e, false); } while(0)
+#define set_constant_label(n, c) do { set_label(n, c, NULL, false); } while(0)
+#define set_offset_label(n, c) do { set_label(n, c, NULL, true); } while(0)
+
+#define FOR_EACH_LABEL(l) \
+	for(unsigned bucket_ = 0; bucket_ < 64; bucket_++) \
+		for(struct label *l = &labelmap[bucket_]; l && l->name; l = l->next)
+
+/* Removes all labels, so another input can be processed by the same process */
+void reset_labels(void) {
+	for(unsigned i = 0; i < 64; i++) {
+		free((char*) labelmap[i].name);
+		free((char*) labelmap[i].expr);
+		for(struct label *label = labelmap[i].next, *next; label; label = next) {
+			next = label->next;
+			free((char*) label->name);
+			free((char*) label->expr);
+			free(label);
+		}
+		labelmap[i] = (struct label) {0};
+	}
+}
 
 void cleanup_labels(void) {
 	for(unsigned i = 0; i < 64; i++) {
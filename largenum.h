@@ -47,14 +47,16 @@
 	typedef unsigned __int128 safe_uint128;
 #	pragma GCC diagnostic pop
 // if we have int128, we probably have int64_t in stdint.h
-#	define CALC_INT_MAX (( (safe_int128)INT64_MAX << 63) | UINT64_MAX)
-#	define CALC_INT_MIN (safe_int128)((safe_uint128)(-(safe_int128)INT64_MAX) << 63)
+#	define CALC_INT_MAX (safe_int128)(((safe_uint128)INT64_MAX << 64) | UINT64_MAX)
+#	define CALC_INT_MIN (-CALC_INT_MAX - 1)
 #	define CALC_INT_TYPENAME "__int128"
 	typedef safe_int128 hp_int128_t;
 	typedef safe_int128 calc_int_t;
+	typedef safe_uint128 calc_uint_t;
 #else
 #	define CALC_INT_MAX LLONG_MAX
 #	define CALC_INT_MIN LLONG_MIN
 #	define CALC_INT_TYPENAME "long long int"
 	typedef signed long long int calc_int_t;
+	typedef unsigned long long int calc_uint_t;
 #endif
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "charclass.h"
+#include "text.h"
+#include "encoding.h"
+
+/**
+ * Splits a line of the first pass into tokens. Every character is looked at
+ * once: comments and strings are skipped with strstr/strchr, and a name is
+ * scanned only once to decide whether it starts an assignment. If it doesn't,
+ * the name is remembered so its characters are lexed as plain octets.
+ */
+
+enum token_kind {
+	TOKEN_END, // end of line, or the rest of the line is a comment
+	TOKEN_OCTET,
+	TOKEN_STRING,
+	TOKEN_ENCODED_STRING, // text and len hold the escaped contents
+	TOKEN_FORMATTER,
+	TOKEN_ASSIGN,
+	TOKEN_LINE_MARKER,
+	TOKEN_DEBUGGER,
+	TOKEN_INCBIN, // text points to the quoted path
+	TOKEN_IMPORT, // text points after "import"
+	TOKEN_SKIP // a character without meaning, ignored like before
+};
+
+enum assign_mode {ASSIGN_LABEL, ASSIGN_LAZY, ASSIGN_IMMEDIATE};
+
+struct token {
+	enum token_kind kind;
+	const char *text; // name of an assignment, contents of a string, or start of the token
+	size_t len;
+	enum assign_mode mode;
+	const char *value; // assigned expression, not terminated
+	size_t value_len;
+	int octet;
+	struct string_format format; // TOKEN_ENCODED_STRING only
+};
+
+struct lexer {
+	const char *pos;
+	const char *octets_end; // end of a name which was found not to be assigned to
+};
+
+bool block_comment = false;
+
+void init_lexer(struct lexer *lx, const char *line) {
+	lx->pos = line;
+	lx->octets_end = line;
+}
+
+/* Scans the name and assignment operator at p.
+	Returns false if p doesn't start an assignment. */
+static bool lex_assign(struct lexer *lx, const char *p, struct token *t) {
+	size_t namelen = 0;
+	while(CHAR_IS(p[namelen], CC_NAME))
+		namelen++;
+	if(!namelen)
+		return false;
+	const char *op = p + namelen;
+	op += scan_whitespace(op);
+	if(op[0] != '=' && op[0] != ':') {
+		lx->octets_end = p + namelen;
+		return false;
+	}
+	t->kind = TOKEN_ASSIGN;
+	t->text = p;
+	t->len = namelen;
+	if(op[0] == ':' && op[1] != '=') {
+		t->mode = ASSIGN_LABEL;
+		t->value = NULL;
+		t->value_len = 0;
+		lx->pos = op + 1;
+		return true;
+	}
+	t->mode = op[0] == '=' ? ASSIGN_LAZY : ASSIGN_IMMEDIATE;
+	const char *value = op + (op[0] == '=' ? 1 : 2);
+	value += scan_whitespace(value);
+	// the value extends to the end of the statement
+	size_t len = strcspn(value, ";");
+	lx->pos = value + len;
+	trim_end(value, &len);
+	t->value = value;
+	t->value_len = len;
+	return true;
+}
+
+enum token_kind next_token(struct lexer *lx, struct token *t) {
+	const char *p = lx->pos;
+	while(1) {
+		if(block_comment) {
+			const char *end = strstr(p, "*/");
+			if(!end) {
+				lx->pos = p + strlen(p);
+				return t->kind = TOKEN_END;
+			}
+			block_comment = false;
+			p = end + 2;
+		}
+		p += scan_whitespace(p);
+		switch(p[0]) {
+			case '\0':
+				lx->pos = p;
+				return t->kind = TOKEN_END;
+			case '/':
+				if(p[1] == '/') {
+					lx->pos = p + strlen(p);
+					return t->kind = TOKEN_END;
+				}
+				if(p[1] == '*') {
+					block_comment = true;
+					p += 2;
+				} else {
+					p++;
+				}
+				continue;
+			case '*':
+				p += p[1] == '/' ? 2 : 1;
+				continue;
+			case ';':
+				p++;
+				continue;
+			case '#':
+				t->text = p;
+				lx->pos = p + strlen(p);
+				return t->kind = TOKEN_LINE_MARKER;
+			case '[':
+				// the formatter scans its own length
+				t->text = lx->pos = p;
+				return t->kind = TOKEN_FORMATTER;
+			case '"': {
+				const char *end = strchr(p + 1, '"');
+				if(!end) {
+					report_error("Unfinished quoted string");
+					lx->pos = p + strlen(p);
+					return t->kind = TOKEN_END;
+				}
+				t->text = p + 1;
+				t->len = end - p - 1;
+				lx->pos = end + 1;
+				return t->kind = TOKEN_STRING;
+			}
+			case 'u':
+			case 'm': {
+				size_t prefix = p >= lx->octets_end ? scan_string_prefix(p, &t->format) : 0;
+				if(!prefix)
+					break;
+				size_t len = scan_escaped_string(p + prefix);
+				if(!len) {
+					report_error("Unfinished quoted string");
+					lx->pos = p + strlen(p);
+					return t->kind = TOKEN_END;
+				}
+				t->text = p + prefix + 1;
+				t->len = len - 1;
+				lx->pos = p + prefix + len + 1;
+				return t->kind = TOKEN_ENCODED_STRING;
+			}
+			case 'd':
+				if(!strncmp(p, "debugger", strlen("debugger"))) {
+					lx->pos = p + strlen("debugger");
+					return t->kind = TOKEN_DEBUGGER;
+				}
+				break;
+			case 'i':
+				if(!strncmp(p, "incbin", strlen("incbin"))) {
+					const char *path = p + strlen("incbin");
+					path += scan_whitespace(path);
+					if(path[0] == '"') {
+						t->text = lx->pos = path;
+						return t->kind = TOKEN_INCBIN;
+					}
+				}
+				if(!strncmp(p, "import", strlen("import")) && CHAR_IS(p[strlen("import")], CC_SPACE)) {
+					const char *format = p + strlen("import");
+					if(CHAR_IS(format[scan_whitespace(format)], CC_ALPHA)) {
+						t->text = lx->pos = format;
+						return t->kind = TOKEN_IMPORT;
+					}
+				}
+				break;
+		}
+		break;
+	}
+	if(p >= lx->octets_end && lex_assign(lx, p, t))
+		return t->kind;
+	textfail = false;
+	lx->pos = p + scan_octet(p, &t->octet);
+	t->kind = textfail ? TOKEN_SKIP : TOKEN_OCTET;
+	textfail = false;
+	return t->kind;
+}
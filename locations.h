@@ -0,0 +1,221 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "diagnostic.h"
+#include "formatter.h"
+
+#ifndef _POSIX_C_SOURCE
+#define fseeko fseek
+#endif
+
+/**
+ * This header records where each range of output bytes comes from while
+ * the input is parsed, so it survives line markers, and writes it as an
+ * index (--srcmap). '--where' answers which token produced an offset with
+ * a binary search in the file, without processing the input again.
+ *
+ * Layout: header, entries sorted by offset, string pool. Each entry
+ * covers the bytes up to the next entry, the last one up to 'size'.
+ */
+
+#define SRCMAP_VERSION 1
+#define SRCMAP_BYTE_ORDER 0x01020304
+#define SRCMAP_NONE UINT64_MAX // offset of a missing string
+
+struct srcmap_header {
+	char magic[4];
+	uint32_t version, byte_order, reserved;
+	uint64_t nentries, strings_size;
+	uint64_t size; // number of output bytes
+};
+
+enum location_kind {
+	LOCATION_OCTETS, LOCATION_STRING, LOCATION_FORMATTER, LOCATION_INCBIN, LOCATION_IMPORT
+};
+
+const char *const location_kind_names[] = {"octets", "string", "formatter", "incbin", "import"};
+
+struct srcmap_entry {
+	uint64_t offset;
+	uint64_t file, detail; // offsets in the string pool, detail is the expression or path
+	uint32_t line, kind;
+};
+
+bool srcmap_mode = false;
+
+static struct srcmap_entry *locations;
+static size_t locations_len, locations_cap;
+static char *location_strings;
+static size_t location_strings_len, location_strings_cap;
+static const char *location_file_name; // file name of the last entry
+static uint64_t location_file;
+
+static uint64_t add_location_string(const char *s, size_t len) {
+	if(location_strings_len + len + 1 > location_strings_cap) {
+		location_strings_cap = (location_strings_cap + len + 1) * 2;
+		location_strings = realloc(location_strings, location_strings_cap);
+	}
+	uint64_t pos = location_strings_len;
+	memcpy(location_strings + pos, s, len);
+	location_strings[pos + len] = '\0';
+	location_strings_len += len + 1;
+	return pos;
+}
+
+/* Records that the output starting at 'start' comes from a token on
+	the current line; 'detail' may be NULL */
+void add_location(enum location_kind kind, uint64_t start, const char *detail, size_t detail_len) {
+	if(current_file_name != location_file_name
+			&& (!location_file_name || strcmp(current_file_name, location_file_name))) {
+		location_file = add_location_string(current_file_name, strlen(current_file_name));
+	}
+	location_file_name = current_file_name;
+	if(locations_len) {
+		struct srcmap_entry *last = &locations[locations_len - 1];
+		// octets on one line share an entry
+		if(kind == LOCATION_OCTETS && last->kind == LOCATION_OCTETS
+				&& last->line == line_number && last->file == location_file)
+			return;
+		// the previous token produced no bytes
+		if(last->offset == start)
+			locations_len--;
+	}
+	if(locations_len >= locations_cap) {
+		locations_cap = (locations_cap == 0) ? 64 : locations_cap * 2;
+		locations = realloc(locations, locations_cap * sizeof(locations[0]));
+	}
+	struct srcmap_entry e = {
+		.offset = start,
+		.file = location_file,
+		.detail = detail ? add_location_string(detail, detail_len) : SRCMAP_NONE,
+		.line = line_number,
+		.kind = kind,
+	};
+	locations[locations_len++] = e;
+}
+
+/* Records a formatter, with the field expressions of bit fields joined by commas */
+void add_formatter_location(struct formatter fmt, uint64_t start) {
+	size_t count = fmt.fields ? strlen((const char*) fmt.fields) : 1;
+	size_t len = 0;
+	for(size_t i = 0; i < count; i++)
+		len += strlen(fmt.expr + len) + 1;
+	char *expr = malloc(len);
+	memcpy(expr, fmt.expr, len);
+	for(size_t i = 0; i + 1 < len; i++)
+		if(!expr[i])
+			expr[i] = ',';
+	add_location(LOCATION_FORMATTER, start, expr, len - 1);
+	free(expr);
+}
+
+/* Writes the recorded locations for an output of 'size' bytes, returns false on failure */
+bool write_srcmap(const char *path, uint64_t size) {
+	FILE *file = fopen(path, "wb");
+	if(!file)
+		return false;
+	if(locations_len && locations[locations_len - 1].offset == size)
+		locations_len--; // trailing tokens without bytes
+	struct srcmap_header h = {
+		.magic = {'H', 'X', 'S', 'M'},
+		.version = SRCMAP_VERSION,
+		.byte_order = SRCMAP_BYTE_ORDER,
+		.nentries = locations_len,
+		.strings_size = location_strings_len,
+		.size = size,
+	};
+	bool ok = fwrite(&h, sizeof h, 1, file) == 1
+		&& fwrite(locations, sizeof(locations[0]), locations_len, file) == locations_len
+		&& fwrite(location_strings, 1, location_strings_len, file) == location_strings_len;
+	return (fclose(file) == 0) && ok;
+}
+
+static bool read_srcmap_entry(FILE *file, uint64_t i, struct srcmap_entry *out) {
+	return fseeko(file, sizeof(struct srcmap_header) + i * sizeof *out, SEEK_SET) == 0
+		&& fread(out, sizeof *out, 1, file) == 1;
+}
+
+static void print_srcmap_string(FILE *file, const struct srcmap_header *h, uint64_t pos) {
+	if(pos >= h->strings_size
+			|| fseeko(file, sizeof *h + h->nentries * sizeof(struct srcmap_entry) + pos, SEEK_SET))
+		return;
+	for(int c; (c = fgetc(file)) != EOF && c;)
+		putchar(c);
+}
+
+/* Prints the source location of the byte at 'offset_text' in an index
+	written with '--srcmap', returns the exit status */
+int where_srcmap(const char *path, const char *offset_text) {
+	char *end;
+	errno = 0;
+	uint64_t target = strtoull(offset_text, &end, 0);
+	if(errno || end == offset_text || end[0]) {
+		fprintf(stderr, "Invalid offset: %s\n", offset_text);
+		return EINVAL;
+	}
+	FILE *file = fopen(path, "rb");
+	if(!file) {
+		fprintf(stderr, "Couldn't open file \"%s\" (error %d)\n", path, (int) errno);
+		return errno;
+	}
+	struct srcmap_header h;
+	if(fread(&h, sizeof h, 1, file) != 1 || memcmp(h.magic, "HXSM", 4)
+			|| h.version != SRCMAP_VERSION || h.byte_order != SRCMAP_BYTE_ORDER) {
+		fprintf(stderr, "\"%s\" isn't a source map of this version of hexproc\n", path);
+		fclose(file);
+		return 1;
+	}
+	if(target >= h.size || !h.nentries) {
+		fprintf(stderr, "Offset 0x%" PRIx64 " is past the end of the output (0x%" PRIx64 " bytes)\n",
+			target, h.size);
+		fclose(file);
+		return 1;
+	}
+	// find the last entry which starts at or before the target
+	uint64_t low = 0, high = h.nentries;
+	struct srcmap_entry e;
+	while(high - low > 1) {
+		uint64_t mid = low + (high - low) / 2;
+		if(!read_srcmap_entry(file, mid, &e))
+			break;
+		if(e.offset <= target)
+			low = mid;
+		else
+			high = mid;
+	}
+	struct srcmap_entry next = {.offset = h.size};
+	if(!read_srcmap_entry(file, low, &e)
+			|| (low + 1 < h.nentries && !read_srcmap_entry(file, low + 1, &next))
+			|| e.kind > LOCATION_IMPORT) {
+		fprintf(stderr, "\"%s\" is corrupted\n", path);
+		fclose(file);
+		return 1;
+	}
+	print_srcmap_string(file, &h, e.file);
+	printf(":%" PRIu32 ": %s, bytes 0x%" PRIx64 " to 0x%" PRIx64,
+		e.line, location_kind_names[e.kind], e.offset, next.offset - 1);
+	if(e.detail != SRCMAP_NONE) {
+		printf(": ");
+		print_srcmap_string(file, &h, e.detail);
+	}
+	putchar('\n');
+	fclose(file);
+	return 0;
+}
+
+void reset_locations(void) {
+	locations_len = location_strings_len = 0;
+	location_file_name = NULL;
+}
+
+void cleanup_locations(void) {
+	OPTIONAL_FREE(locations);
+	OPTIONAL_FREE(location_strings);
+}
@@ -2,105 +2,366 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+
+#if defined(__linux__) && defined(_POSIX_C_SOURCE)
+#include <sys/sendfile.h>
+#define HAVE_SENDFILE
+#endif
 
 #include "formatter.h"
 #include "interpreter.h"
 #include "text.h"
 #include "calc.h"
 #include "sourcemap.h"
+#include "profile.h"
+#include "check.h"
+#include "pipeline.h"
+#include "variants.h"
+#include "probes.h"
+#include "incbin.h"
 
-enum {
-	OUTPUT_BINARY, OUTPUT_HEX, OUTPUT_HEX_COLOR
+enum output_mode {
+	OUTPUT_BINARY, OUTPUT_HEX, OUTPUT_HEX_COLOR,
+	OUTPUT_MAP // offset and size of each source line, then the offset labels
 } output_mode = OUTPUT_HEX;
 
+#define SINK_IS_HEX(s) ((s)->mode == OUTPUT_HEX || (s)->mode == OUTPUT_HEX_COLOR)
+
 const char HEX_DIGITS[] = "0123456789abcdef";
 
-static int color_index = 0;
-void begin_color(FILE *file) {
-	if(output_mode == OUTPUT_HEX_COLOR) {
-		const int colors[] = {46, 45, 42, 44, 41};
-		fprintf(file, "\033[%dm", colors[color_index++]);
+#define SINK_BUFFER_SIZE (8 * 1024)
+
+/* Destination of the encoded output: a file, a writer thread or a checker.
+	Sinks form a list which is fed from a single walk of the output */
+struct sink {
+	struct sink *next;
+	enum output_mode mode;
+	int color_index;
+	bool need_space;
+	uint64_t line_start; // OUTPUT_MAP only: offset at which the current line started
+	FILE *file;
+	struct checker *checker; // if set, output is compared instead of written
+#ifdef HAVE_PIPELINE
+	struct pipeline_stage *writer; // if set, output is written by another thread
+#endif
+	uint64_t flushed; // number of bytes already written or compared
+	size_t len, cap;
+	uint8_t *buf;
+	uint8_t storage[SINK_BUFFER_SIZE];
+};
+
+void init_sink(struct sink *s, enum output_mode mode, FILE *file, struct checker *checker) {
+	s->next = NULL;
+	s->mode = mode;
+	s->color_index = 0;
+	s->line_start = 0;
+	s->need_space = false;
+	s->file = file;
+	s->checker = checker;
+	s->flushed = 0;
+	s->len = 0;
+	s->buf = s->storage;
+	s->cap = SINK_BUFFER_SIZE;
+#ifdef HAVE_PIPELINE
+	s->writer = NULL;
+#endif
+}
+
+#ifdef HAVE_PIPELINE
+/* Lets a writer thread write the output of this sink */
+void attach_writer(struct sink *s, struct pipeline_stage *writer) {
+	s->writer = writer;
+	s->buf = writer_buffer(writer);
+	s->cap = PIPELINE_BLOCK_SIZE;
+}
+#endif
+
+void sink_flush(struct sink *s) {
+	PROBE2(flush, s->len, s->flushed);
+	if(s->checker)
+		checker_compare(s->checker, s->buf, s->len, s->flushed);
+#ifdef HAVE_PIPELINE
+	else if(s->writer)
+		s->buf = writer_submit(s->writer, s->buf, s->len);
+#endif
+	else
+		fwrite(s->buf, 1, s->len, s->file);
+	s->flushed += s->len;
+	s->len = 0;
+}
+
+static inline void sink_putc(struct sink *s, int c) {
+	if(s->len >= s->cap)
+		sink_flush(s);
+	s->buf[s->len++] = c;
+}
+
+static void sink_puts(struct sink *s, const char *str) {
+	while(str[0])
+		sink_putc(s, *str++);
+}
+
+static void sink_write(struct sink *s, const uint8_t *data, size_t len) {
+	while(len) {
+		if(s->len >= s->cap)
+			sink_flush(s);
+		size_t n = s->cap - s->len < len ? s->cap - s->len : len;
+		memcpy(s->buf + s->len, data, n);
+		s->len += n;
+		data += n;
+		len -= n;
+	}
+}
+
+/* Writes the bytes as hex digits separated by spaces */
+static void sink_write_hex(struct sink *s, const uint8_t *data, size_t len) {
+	for(size_t i = 0; i < len; i++) {
+		if(s->cap - s->len < 3)
+			sink_flush(s);
+		uint8_t *p = s->buf + s->len;
+		if(s->need_space)
+			*p++ = ' ';
+		*p++ = HEX_DIGITS[data[i] >> 4];
+		*p++ = HEX_DIGITS[data[i] & 0xF];
+		s->len = p - s->buf;
+		s->need_space = true;
+	}
+}
+
+void begin_color(struct sink *s) {
+	if(s->mode == OUTPUT_HEX_COLOR) {
+		const char *colors[] = {"46", "45", "42", "44", "41"};
+		sink_puts(s, "\033[");
+		sink_puts(s, colors[s->color_index++]);
+		sink_putc(s, 'm');
 // maybe use underline to denote tokens?
-//		fprintf(file, "\033[04m");
-		color_index %= (sizeof colors / sizeof colors[0]);
+//		sink_puts(s, "\033[04m");
+		s->color_index %= (sizeof colors / sizeof colors[0]);
+	}
+}
+
+void end_color(struct sink *s) {
+	if(s->mode == OUTPUT_HEX_COLOR) {
+		sink_puts(s, "\033[0m");
 	}
 }
 
-void end_color(FILE *file) {
-	if(output_mode == OUTPUT_HEX_COLOR) {
-		fprintf(file, "\033[0m");
+/* Encodes bytes in the format of the sink */
+static void sink_bytes(struct sink *s, const uint8_t *data, size_t len) {
+	if(s->mode == OUTPUT_BINARY)
+		sink_write(s, data, len);
+	else if(SINK_IS_HEX(s))
+		sink_write_hex(s, data, len);
+}
+
+/* Separates a token from the previous one and starts its color */
+static void begin_token(struct sink *s) {
+	for(; s; s = s->next) {
+		if(SINK_IS_HEX(s) && s->need_space)
+			sink_putc(s, ' ');
+		s->need_space = false;
+		begin_color(s);
 	}
 }
 
-bool need_space = false;
+static void emit_to_sinks(const uint8_t *bytes, uint64_t len, void *context) {
+	for(struct sink *s = context; s; s = s->next)
+		sink_bytes(s, bytes, len);
+}
 
-void insert_formatter_result(FILE *output) {
+void insert_formatter_result(struct sink *s) {
 	// take next delayed expression from queue
 	struct formatter formatter;
+	if(profile_mode) {
+		profile_set_formatter_root(formatqueue_pos);
+		profile_enter();
+	}
+	size_t index = formatqueue_pos;
 	take_next_formatter(&formatter);
-	calc_float_t result = calc(formatter.expr);
-	uint8_t buf[sizeof(calc_int_t)];
-	format_value(result, formatter, buf);
-	offset += formatter.nbytes;
-	// write each byte
-	if(output_mode >= OUTPUT_HEX && need_space)
-		fputc(' ', output);
-	begin_color(output);
-	for(size_t i = 0; i < formatter.nbytes; i++) {
-		// print the separator ' ' unless this byte is the first on line
-		if(output_mode >= OUTPUT_HEX)
-			fprintf(output, "%02x", (unsigned int) buf[i]);
-		else
-			fputc(buf[i], output);
-
-		if(output_mode >= OUTPUT_HEX && i != formatter.nbytes-1)
-			fputc(' ', output);
+	uint64_t size = FORMATTER_SIZE(formatter);
+	PROBE2(formatter, index, size);
+	// arrays are written block by block as they are encoded
+	begin_token(s);
+	evaluate_queued_formatter(index, formatter, emit_to_sinks, s);
+	if(profile_mode)
+		profile_leave(NULL, 0);
+	offset += size;
+	for(; s; s = s->next)
+		s->need_space = true;
+}
+
+/* Copies the start of the range straight from the file to the output
+	file in the kernel, returns the number of bytes copied */
+static uint64_t splice_incbin(struct sink *s, FILE *in, const struct incbin *b) {
+#ifdef HAVE_SENDFILE
+#ifdef HAVE_PIPELINE
+	if(s->writer)
+		return 0;
+#endif
+	if(s->mode != OUTPUT_BINARY || s->checker || s->next)
+		return 0;
+	sink_flush(s);
+	if(fflush(s->file) != 0)
+		return 0;
+	off_t pos = b->start;
+	uint64_t done = 0;
+	while(done < b->length) {
+		uint64_t remaining = b->length - done;
+		ssize_t n = sendfile(fileno(s->file), fileno(in), &pos, remaining < (1 << 30) ? remaining : (1 << 30));
+		if(n <= 0)
+			break; // not supported for this output, copy the rest
+		done += n;
+	}
+	s->flushed += done;
+	return done;
+#else
+	(void) s, (void) in, (void) b;
+	return 0;
+#endif
+}
+
+void insert_incbin(struct sink *s) {
+	struct incbin b;
+	take_next_incbin(&b);
+	offset += b.length;
+	FILE *in = b.length ? open_incbin(&b) : NULL;
+	if(!in)
+		return;
+	begin_token(s);
+	uint64_t done = splice_incbin(s, in, &b);
+	if(done && done < b.length) {
+		b.start += done;
+		fclose(in);
+		in = open_incbin(&b);
+	}
+	uint8_t chunk[16 * 1024];
+	while(in && done < b.length) {
+		uint64_t remaining = b.length - done;
+		size_t n = fread(chunk, 1, remaining < sizeof chunk ? remaining : sizeof chunk, in);
+		if(!n) {
+			report_error("File \"%s\" has become shorter than the included range", b.path);
+			break;
+		}
+		for(struct sink *t = s; t; t = t->next)
+			sink_bytes(t, chunk, n);
+		done += n;
+	}
+	for(; s; s = s->next) {
+		end_color(s);
+		s->need_space = true;
 	}
-	need_space = true;
+	if(in)
+		fclose(in);
 }
 
-void consume_sourcemap_actions(FILE *output) {
+/* Writes the range of output bytes produced by the line which just ended */
+static void map_line(struct sink *s) {
+	if(offset > s->line_start) {
+		char record[64];
+		snprintf(record, sizeof record, "%08"PRIx64" %"PRIu64" ",
+			s->line_start, offset - s->line_start);
+		sink_puts(s, record);
+		sink_puts(s, current_file_name);
+		snprintf(record, sizeof record, ":%"PRIu64"\n", line_number);
+		sink_puts(s, record);
+	}
+	s->line_start = offset;
+}
+
+static int compare_label_offsets(const void *a, const void *b) {
+	const struct label *x = *(const struct label *const*)a, *y = *(const struct label *const*)b;
+	return (x->constant > y->constant) - (x->constant < y->constant);
+}
+
+/* Lists the offset labels, sorted by offset */
+static void map_labels(struct sink *s) {
+	size_t count = 0;
+	FOR_EACH_LABEL(l)
+		count += l->offset;
+	const struct label **labels = malloc((count + 1) * sizeof(labels[0]));
+	if(!labels)
+		return;
+	count = 0;
+	FOR_EACH_LABEL(l)
+		if(l->offset)
+			labels[count++] = l;
+	qsort(labels, count, sizeof(labels[0]), compare_label_offsets);
+	for(size_t i = 0; i < count; i++) {
+		char record[32];
+		snprintf(record, sizeof record, "%08"PRIx64" ", (uint64_t) labels[i]->constant);
+		sink_puts(s, record);
+		sink_puts(s, labels[i]->name);
+		sink_puts(s, ":\n");
+	}
+	free(labels);
+}
+
+void consume_sourcemap_actions(struct sink *s) {
 	while(offset == next_sourcemap_index()) {
 		switch(take_next_sourcemap_action()) {
 			case SOURCE_FORMATTER:
-				insert_formatter_result(output);
+				insert_formatter_result(s);
 				break;
 			case SOURCE_STRING:
-				begin_color(output);
+				for(struct sink *t = s; t; t = t->next)
+					begin_color(t);
 				break;
 			case SOURCE_NEWLINE:
-				if(output_mode >= OUTPUT_HEX)
-					fputc('\n', output);
-				need_space = false;
-				if(output_mode == OUTPUT_HEX_COLOR)
-					color_index = 0;
+				for(struct sink *t = s; t; t = t->next) {
+					if(SINK_IS_HEX(t))
+						sink_putc(t, '\n');
+					else if(t->mode == OUTPUT_MAP)
+						map_line(t);
+					t->need_space = false;
+					if(t->mode == OUTPUT_HEX_COLOR)
+						t->color_index = 0;
+				}
+				line_number++;
+				for(struct sink *t = s; t; t = t->next)
+					if(t->checker)
+						checker_mark_line(t->checker, t->flushed + t->len, current_file_name, line_number);
 				break;
 			case SOURCE_END:
-				end_color(output);
+				for(struct sink *t = s; t; t = t->next)
+					end_color(t);
+				break;
+			case SOURCE_INCBIN:
+				insert_incbin(s);
 				break;
 		}
 	}
 }
 
-void output_byte(char byte, FILE *output) {
-	consume_sourcemap_actions(output);
+void output_byte(char byte, struct sink *s) {
+	consume_sourcemap_actions(s);
 
-	if(output_mode >= OUTPUT_HEX && need_space)
-		fputc(' ', output);
-	need_space = true;
-	if(output_mode >= OUTPUT_HEX) {
-		fputc(HEX_DIGITS[(byte >> 4) & 0xF], output);
-		fputc(HEX_DIGITS[byte & 0xF], output);
-	} else {
-		fputc(byte, output);
+	for(; s; s = s->next) {
+		if(s->mode == OUTPUT_BINARY) {
+			sink_putc(s, byte);
+		} else if(SINK_IS_HEX(s)) {
+			if(s->need_space)
+				sink_putc(s, ' ');
+			s->need_space = true;
+			sink_putc(s, HEX_DIGITS[(byte >> 4) & 0xF]);
+			sink_putc(s, HEX_DIGITS[byte & 0xF]);
+		}
 	}
 
 	offset++;
 }
 
-void finalize_output(FILE *output) {
-	consume_sourcemap_actions(output);
-	if(output_mode >= OUTPUT_HEX && need_space)
-		fputc('\n', output);
+void finalize_output(struct sink *s) {
+	consume_sourcemap_actions(s);
+	for(; s; s = s->next) {
+		if(SINK_IS_HEX(s) && s->need_space)
+			sink_putc(s, '\n');
+		if(s->mode == OUTPUT_MAP)
+			map_labels(s);
+		sink_flush(s);
+	}
 }
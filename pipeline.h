@@ -0,0 +1,309 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _POSIX_C_SOURCE
+#include <unistd.h>
+#endif
+
+/**
+ * This header implements '--pipeline', in which a reader thread fills
+ * input blocks while the main thread parses them, and a writer thread
+ * drains output blocks while the main thread keeps formatting.
+ * Threads exchange blocks through lock-free single-producer,
+ * single-consumer rings: one carries filled blocks downstream and
+ * another returns empty blocks upstream. A thread which finds its ring
+ * full or empty retries a few times, then sleeps until the other side
+ * has pushed or popped a block, so a slow reader or writer doesn't keep
+ * the waiting thread busy.
+ */
+
+#if defined(_POSIX_THREADS) && _POSIX_THREADS > 0 && !defined(__STDC_NO_ATOMICS__)
+#define HAVE_PIPELINE
+#endif
+
+#ifdef HAVE_PIPELINE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#include "diagnostic.h"
+#include "bytequeue.h"
+#include "interpreter.h"
+
+#define PIPELINE_BLOCK_SIZE (64 * 1024)
+#define PIPELINE_RING_SIZE 8 // must be a power of two
+#define PIPELINE_SPIN_LIMIT 100 // tries before a thread sleeps
+
+struct pipeline_block {
+	char data[PIPELINE_BLOCK_SIZE + 1]; // must be the first member, +1 for a terminator
+	size_t len; // 0 marks the end of the stream
+};
+
+struct spsc_ring {
+	_Atomic size_t head; // next slot to read, only written by the consumer
+	char padding[64]; // keep head and tail in separate cache lines
+	_Atomic size_t tail; // next slot to write, only written by the producer
+	struct pipeline_block *slots[PIPELINE_RING_SIZE];
+	// a full or empty ring only has a waiter on one side
+	atomic_bool waiting;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+};
+
+struct pipeline_stage {
+	struct spsc_ring full; // towards the consumer
+	struct spsc_ring empty; // back towards the producer
+	struct pipeline_block *blocks;
+	int fd;
+	int error; // of the first failed read or write, read after joining the thread
+	pthread_t thread;
+};
+
+static bool ring_push(struct spsc_ring *r, struct pipeline_block *b) {
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	if(tail - atomic_load_explicit(&r->head, memory_order_acquire) == PIPELINE_RING_SIZE)
+		return false;
+	r->slots[tail & (PIPELINE_RING_SIZE - 1)] = b;
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+static struct pipeline_block *ring_pop(struct spsc_ring *r) {
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	if(head == atomic_load_explicit(&r->tail, memory_order_acquire))
+		return NULL;
+	struct pipeline_block *b = r->slots[head & (PIPELINE_RING_SIZE - 1)];
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	return b;
+}
+
+/* Wakes the other side after a push or pop. The fence orders the update
+	of head or tail before reading 'waiting', like the one in 'ring_sleep_begin',
+	so either the waiter sees the update or this sees the waiter */
+static void ring_notify(struct spsc_ring *r) {
+	atomic_thread_fence(memory_order_seq_cst);
+	if(atomic_load_explicit(&r->waiting, memory_order_relaxed)) {
+		pthread_mutex_lock(&r->lock);
+		pthread_cond_signal(&r->changed);
+		pthread_mutex_unlock(&r->lock);
+	}
+}
+
+/* Announces a waiter, which 'ring_notify' wakes after the next push or pop */
+static void ring_sleep_begin(struct spsc_ring *r) {
+	pthread_mutex_lock(&r->lock);
+	atomic_store_explicit(&r->waiting, true, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void ring_sleep_end(struct spsc_ring *r) {
+	atomic_store_explicit(&r->waiting, false, memory_order_relaxed);
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void ring_push_wait(struct spsc_ring *r, struct pipeline_block *b) {
+	for(unsigned i = 0; i < PIPELINE_SPIN_LIMIT; i++) {
+		if(ring_push(r, b)) {
+			ring_notify(r);
+			return;
+		}
+		sched_yield();
+	}
+	ring_sleep_begin(r);
+	while(!ring_push(r, b))
+		pthread_cond_wait(&r->changed, &r->lock);
+	ring_sleep_end(r);
+	ring_notify(r);
+}
+
+static struct pipeline_block *ring_pop_wait(struct spsc_ring *r) {
+	struct pipeline_block *b;
+	for(unsigned i = 0; i < PIPELINE_SPIN_LIMIT; i++) {
+		if((b = ring_pop(r))) {
+			ring_notify(r);
+			return b;
+		}
+		sched_yield();
+	}
+	ring_sleep_begin(r);
+	while(!(b = ring_pop(r)))
+		pthread_cond_wait(&r->changed, &r->lock);
+	ring_sleep_end(r);
+	ring_notify(r);
+	return b;
+}
+
+static void init_ring(struct spsc_ring *r) {
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->waiting, false);
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->changed, NULL);
+}
+
+static void destroy_ring(struct spsc_ring *r) {
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->changed);
+}
+
+/* Waits for the thread of a stage and frees its blocks */
+static void join_stage(struct pipeline_stage *st) {
+	pthread_join(st->thread, NULL);
+	destroy_ring(&st->full);
+	destroy_ring(&st->empty);
+	free(st->blocks);
+}
+
+static bool start_stage(struct pipeline_stage *st, int fd, void *(*run)(void *)) {
+	init_ring(&st->full);
+	init_ring(&st->empty);
+	st->fd = fd;
+	st->error = 0;
+	st->blocks = malloc(PIPELINE_RING_SIZE * sizeof(st->blocks[0]));
+	if(!st->blocks) {
+		report_error("Out of memory - couldn't allocate pipeline buffers");
+		return false;
+	}
+	for(unsigned i = 0; i < PIPELINE_RING_SIZE; i++)
+		ring_push(&st->empty, &st->blocks[i]);
+	int err = pthread_create(&st->thread, NULL, run, st);
+	if(err) {
+		report_error("Couldn't start pipeline thread (error %d)", err);
+		destroy_ring(&st->full);
+		destroy_ring(&st->empty);
+		free(st->blocks);
+		return false;
+	}
+	return true;
+}
+
+static void *reader_main(void *arg) {
+	struct pipeline_stage *st = arg;
+	while(1) {
+		struct pipeline_block *b = ring_pop_wait(&st->empty);
+		ssize_t n;
+		do
+			n = read(st->fd, b->data, PIPELINE_BLOCK_SIZE);
+		while(n < 0 && errno == EINTR);
+		if(n < 0)
+			st->error = errno;
+		b->len = n > 0 ? n : 0;
+		ring_push_wait(&st->full, b);
+		if(!b->len)
+			return NULL;
+	}
+}
+
+static void *writer_main(void *arg) {
+	struct pipeline_stage *st = arg;
+	while(1) {
+		struct pipeline_block *b = ring_pop_wait(&st->full);
+		if(!b->len)
+			return NULL;
+		// after an error the rest is dropped, but blocks keep coming back
+		for(size_t done = 0; done < b->len && !st->error;) {
+			ssize_t n = write(st->fd, b->data + done, b->len - done);
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n <= 0) {
+				st->error = n < 0 ? errno : EIO;
+				fprintf(stderr, "Couldn't write output (error %d)\n", st->error);
+				break;
+			}
+			done += n;
+		}
+		ring_push_wait(&st->empty, b);
+	}
+}
+
+bool start_reader(struct pipeline_stage *st, FILE *input) {
+	return start_stage(st, fileno(input), reader_main);
+}
+
+bool start_writer(struct pipeline_stage *st, FILE *output) {
+	fflush(output);
+	return start_stage(st, fileno(output), writer_main);
+}
+
+/* Runs the first pass on lines supplied by the reader thread,
+	returns the error number if reading failed or 0 */
+int pipelined_process_input(struct pipeline_stage *st, struct bytequeue *buffer) {
+	// a line which continues in the next block
+	char *carry = NULL;
+	size_t carry_len = 0, carry_cap = 0;
+	while(1) {
+		struct pipeline_block *b = ring_pop_wait(&st->full);
+		if(!b->len) {
+			ring_push_wait(&st->empty, b);
+			break;
+		}
+		char *line = b->data, *end = b->data + b->len;
+		char *newline;
+		while((newline = memchr(line, '\n', end - line))) {
+			newline[0] = '\0';
+			line_number++;
+			if(carry_len) {
+				size_t n = newline - line + 1;
+				if(carry_len + n > carry_cap)
+					carry = realloc(carry, carry_cap = carry_len + n);
+				memcpy(carry + carry_len, line, n);
+				carry_len = 0;
+				process_line(carry, buffer);
+			} else {
+				process_line(line, buffer);
+			}
+			line = newline + 1;
+		}
+		if(line < end) {
+			size_t n = end - line;
+			if(carry_len + n + 1 > carry_cap)
+				carry = realloc(carry, carry_cap = 2 * (carry_len + n + 1));
+			memcpy(carry + carry_len, line, n);
+			carry_len += n;
+		}
+		ring_push_wait(&st->empty, b);
+	}
+	if(carry_len) {
+		carry[carry_len] = '\0';
+		line_number++;
+		process_line(carry, buffer);
+	}
+	free(carry);
+	join_stage(st);
+	return st->error;
+}
+
+/* Hands a filled output buffer to the writer thread and returns an empty one */
+uint8_t *writer_submit(struct pipeline_stage *st, uint8_t *data, size_t len) {
+	struct pipeline_block *b = (struct pipeline_block *) data;
+	if(!len)
+		return data;
+	b->len = len;
+	ring_push_wait(&st->full, b);
+	return (uint8_t *) ring_pop_wait(&st->empty)->data;
+}
+
+/* Returns the first empty output buffer */
+uint8_t *writer_buffer(struct pipeline_stage *st) {
+	return (uint8_t *) ring_pop_wait(&st->empty)->data;
+}
+
+/* Waits until the writer thread has written everything,
+	returns false if writing failed */
+bool stop_writer(struct pipeline_stage *st, uint8_t *data) {
+	struct pipeline_block *b = (struct pipeline_block *) data;
+	b->len = 0;
+	ring_push_wait(&st->full, b);
+	join_stage(st);
+	return !st->error;
+}
+
+#endif
@@ -0,0 +1,525 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _POSIX_C_SOURCE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "diagnostic.h"
+#include "hash.h"
+#include "bytequeue.h"
+#include "formatter.h"
+#include "label.h"
+#include "sourcemap.h"
+#include "incbin.h"
+#include "import.h"
+
+/**
+ * This header implements precompiled templates ('.hxpc' files). They hold
+ * everything the first pass produces: the literal byte stream, the source
+ * map, the formatter queue and the final label definitions, so loading
+ * one skips the first pass entirely. Files use native byte order and end
+ * with a hash of their contents. They also record a hash of the source
+ * file and of each imported dump, and the size of each included file,
+ * and are rejected if one of them has changed since.
+ *
+ * Objects ('.hxo' files) have the same layout. They are compiled from
+ * a single module with offsets starting at zero, and link_objects lays
+ * several of them out one after another, moving their offset labels.
+ *
+ * Layout: header, source map, formatters, labels, included files,
+ * imported dumps, string pool (padded to 8 bytes), literal bytes, content hash.
+ */
+
+#define HXPC_VERSION 7
+#define HXPC_BYTE_ORDER 0x01020304
+#define HXPC_NONE UINT64_MAX // offset of a missing string
+
+struct hxpc_header {
+	char magic[4];
+	uint32_t version, byte_order, flags;
+	uint64_t source_name; // HXPC_NONE if the input wasn't a file
+	uint64_t source_hash;
+	uint64_t nsourcemap, nformatters, nlabels, nincbins, nimports, strings_size, nbytes;
+};
+
+#define HXPC_OBJECT 1 // header flag
+
+struct hxpc_sourcemap {
+	uint64_t index, action;
+};
+
+struct hxpc_formatter {
+	uint8_t datatype, nbytes, endian, reserved;
+	uint32_t count;
+	uint64_t expr, fields; // offsets in the string pool
+};
+
+struct hxpc_label {
+	uint64_t name, expr;
+	uint64_t constant, constant_high; // two's complement, low half first
+	uint64_t offset; // nonzero for offset labels
+};
+
+// label values are stored as 128 bits regardless of calc_int_t
+#ifdef HAVE_HP_INT128
+#	define HXPC_HIGH_HALF(c) ((uint64_t)((calc_uint_t)(c) >> 64))
+#	define HXPC_JOIN_HALVES(low, high) ((calc_int_t)((calc_uint_t)(high) << 64 | (low)))
+#else
+#	define HXPC_HIGH_HALF(c) ((c) < 0 ? UINT64_MAX : 0)
+#	define HXPC_JOIN_HALVES(low, high) ((calc_int_t)(low))
+#endif
+
+struct hxpc_incbin {
+	uint64_t path, start, length;
+	uint64_t file_size; // offsets after the range depend on it
+};
+
+struct hxpc_import {
+	uint64_t path, hash;
+};
+
+/* A loaded precompiled template */
+struct precompiled {
+	const uint8_t *data;
+	uint64_t size;
+	bool mapped;
+	const uint8_t *bytes; // literal byte stream
+	uint64_t nbytes;
+	uint64_t length; // size of the output, including formatters
+};
+
+bool is_precompiled_name(const char *name) {
+	size_t len = strlen(name);
+	return len > 5 && !strcmp(name + len - 5, ".hxpc");
+}
+
+bool is_object_name(const char *name) {
+	size_t len = strlen(name);
+	return len > 4 && !strcmp(name + len - 4, ".hxo");
+}
+
+static bool hash_source_file(const char *name, uint64_t *hash) {
+	FILE *file = fopen(name, "rb");
+	if(!file)
+		return false;
+	unsigned char buf[16 * 1024];
+	*hash = MEMHASH64_INIT;
+	for(size_t n; (n = fread(buf, 1, sizeof buf, file)) > 0;)
+		*hash = memhash64(buf, n, *hash);
+	fclose(file);
+	return true;
+}
+
+/* Size of a formatter expression including terminators, bit field
+	formatters hold one expression per field. Returns SIZE_MAX if the
+	expressions don't fit into 'max' bytes */
+static size_t formatter_expr_size(const char *expr, const unsigned char *fields, size_t max) {
+	size_t count = fields ? strlen((const char*) fields) : 1;
+	size_t size = 0;
+	for(size_t i = 0; i < count; i++) {
+		const char *end;
+		if(max == SIZE_MAX)
+			end = expr + size + strlen(expr + size);
+		else if(size >= max || !(end = memchr(expr + size, '\0', max - size)))
+			return SIZE_MAX;
+		size = end - expr + 1;
+	}
+	return size;
+}
+
+struct hxpc_writer {
+	FILE *file;
+	uint64_t hash;
+	uint64_t strings; // size of the strings emitted so far
+	bool failed;
+};
+
+static void hxpc_emit(struct hxpc_writer *w, const void *data, size_t len) {
+	w->hash = memhash64(data, len, w->hash);
+	if(len && fwrite(data, 1, len, w->file) != len)
+		w->failed = true;
+}
+
+/* Returns the offset the string will have in the pool */
+static uint64_t hxpc_string_offset(struct hxpc_writer *w, const char *str, size_t size) {
+	if(!str)
+		return HXPC_NONE;
+	uint64_t pos = w->strings;
+	w->strings += size;
+	return pos;
+}
+
+/* Writes the state left by the first pass as a template or an object,
+	returns false on failure */
+bool write_precompiled(FILE *file, struct bytequeue *q, const char *source_name, bool object) {
+	struct hxpc_writer w = {.file = file, .hash = MEMHASH64_INIT};
+	struct hxpc_header h = {
+		.magic = "HXPC",
+		.version = HXPC_VERSION,
+		.byte_order = HXPC_BYTE_ORDER,
+		.flags = object ? HXPC_OBJECT : 0,
+		.nsourcemap = sourcemap_len,
+		.nformatters = formatqueue_len,
+		.nincbins = incbins_len,
+		.nimports = imported_len,
+		.nbytes = bytequeue_size(q),
+	};
+	if(!source_name || !hash_source_file(source_name, &h.source_hash))
+		source_name = NULL;
+
+	// records refer to strings by offset, so the pool is laid out first
+	for(size_t i = 0; i < formatqueue_len; i++) {
+		struct formatter f = formatqueue[i];
+		h.strings_size += formatter_expr_size(f.expr, f.fields, SIZE_MAX);
+		if(f.fields)
+			h.strings_size += strlen((const char*) f.fields) + 1;
+	}
+	FOR_EACH_LABEL(l) {
+		h.nlabels++;
+		h.strings_size += strlen(l->name) + 1;
+		if(l->expr)
+			h.strings_size += strlen(l->expr) + 1;
+	}
+	for(size_t i = 0; i < incbins_len; i++)
+		h.strings_size += strlen(incbins[i].path) + 1;
+	for(size_t i = 0; i < imported_len; i++)
+		h.strings_size += strlen(imported_paths[i]) + 1;
+	if(source_name)
+		h.strings_size += strlen(source_name) + 1;
+	h.source_name = source_name ? h.strings_size - strlen(source_name) - 1 : HXPC_NONE;
+	hxpc_emit(&w, &h, sizeof h);
+
+	for(size_t i = 0; i < sourcemap_len; i++) {
+		struct hxpc_sourcemap s = {.index = sourcemap[i].index, .action = sourcemap[i].action};
+		hxpc_emit(&w, &s, sizeof s);
+	}
+	for(size_t i = 0; i < formatqueue_len; i++) {
+		struct formatter f = formatqueue[i];
+		struct hxpc_formatter r = {
+			.datatype = f.datatype,
+			.nbytes = f.nbytes,
+			.endian = f.endian,
+			.count = f.count,
+		};
+		r.expr = hxpc_string_offset(&w, f.expr, formatter_expr_size(f.expr, f.fields, SIZE_MAX));
+		r.fields = hxpc_string_offset(&w, (const char*) f.fields,
+			f.fields ? strlen((const char*) f.fields) + 1 : 0);
+		hxpc_emit(&w, &r, sizeof r);
+	}
+	FOR_EACH_LABEL(l) {
+		struct hxpc_label r = {.constant = (uint64_t) l->constant,
+			.constant_high = HXPC_HIGH_HALF(l->constant), .offset = l->offset};
+		r.name = hxpc_string_offset(&w, l->name, strlen(l->name) + 1);
+		r.expr = hxpc_string_offset(&w, l->expr, l->expr ? strlen(l->expr) + 1 : 0);
+		hxpc_emit(&w, &r, sizeof r);
+	}
+	for(size_t i = 0; i < incbins_len; i++) {
+		struct hxpc_incbin r = {.start = incbins[i].start, .length = incbins[i].length,
+			.file_size = UINT64_MAX};
+		incbin_file_size(incbins[i].path, &r.file_size);
+		r.path = hxpc_string_offset(&w, incbins[i].path, strlen(incbins[i].path) + 1);
+		hxpc_emit(&w, &r, sizeof r);
+	}
+	for(size_t i = 0; i < imported_len; i++) {
+		// a dump which can't be read anymore makes the template outdated
+		struct hxpc_import r = {.hash = 0};
+		hash_source_file(imported_paths[i], &r.hash);
+		r.path = hxpc_string_offset(&w, imported_paths[i], strlen(imported_paths[i]) + 1);
+		hxpc_emit(&w, &r, sizeof r);
+	}
+
+	for(size_t i = 0; i < formatqueue_len; i++) {
+		struct formatter f = formatqueue[i];
+		hxpc_emit(&w, f.expr, formatter_expr_size(f.expr, f.fields, SIZE_MAX));
+		if(f.fields)
+			hxpc_emit(&w, f.fields, strlen((const char*) f.fields) + 1);
+	}
+	FOR_EACH_LABEL(l) {
+		hxpc_emit(&w, l->name, strlen(l->name) + 1);
+		if(l->expr)
+			hxpc_emit(&w, l->expr, strlen(l->expr) + 1);
+	}
+	for(size_t i = 0; i < incbins_len; i++)
+		hxpc_emit(&w, incbins[i].path, strlen(incbins[i].path) + 1);
+	for(size_t i = 0; i < imported_len; i++)
+		hxpc_emit(&w, imported_paths[i], strlen(imported_paths[i]) + 1);
+	if(source_name)
+		hxpc_emit(&w, source_name, strlen(source_name) + 1);
+	const char padding[8] = {0};
+	hxpc_emit(&w, padding, -h.strings_size & 7);
+
+	bytequeue_rewind(q);
+	while(bytequeue_next_segment(q))
+		hxpc_emit(&w, q->rptr, q->rend - q->rptr);
+
+	uint64_t hash = w.hash;
+	if(fwrite(&hash, sizeof hash, 1, file) != 1 || fflush(file) != 0)
+		w.failed = true;
+	return !w.failed;
+}
+
+static bool read_whole_file(struct precompiled *pc, const char *file_name) {
+#ifdef _POSIX_C_SOURCE
+	int fd = open(file_name, O_RDONLY);
+	struct stat st;
+	if(fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(map != MAP_FAILED) {
+			close(fd);
+			pc->data = map;
+			pc->size = st.st_size;
+			pc->mapped = true;
+			return true;
+		}
+	}
+	if(fd >= 0)
+		close(fd);
+#endif
+	// no mmap available, read the whole file instead
+	FILE *file = fopen(file_name, "rb");
+	if(!file)
+		return false;
+	size_t cap = 64 * 1024, len = 0;
+	uint8_t *data = malloc(cap);
+	for(size_t n; (n = fread(data + len, 1, cap - len, file)) > 0;) {
+		len += n;
+		if(len == cap)
+			data = realloc(data, cap *= 2);
+	}
+	fclose(file);
+	pc->data = data;
+	pc->size = len;
+	return true;
+}
+
+/* Checks the file structure, returns an error message or NULL */
+static const char *validate_precompiled(const struct precompiled *pc, struct hxpc_header *h) {
+	if(pc->size < sizeof *h + sizeof(uint64_t))
+		return "is too short";
+	memcpy(h, pc->data, sizeof *h);
+	if(memcmp(h->magic, "HXPC", 4))
+		return "is not a precompiled template";
+	if(h->version != HXPC_VERSION)
+		return "was compiled by an incompatible version of hexproc";
+	if(h->byte_order != HXPC_BYTE_ORDER)
+		return "was compiled on a machine with a different byte order";
+	uint64_t max = pc->size;
+	if(h->nsourcemap > max || h->nformatters > max || h->nlabels > max
+			|| h->nincbins > max || h->nimports > max || h->strings_size > max || h->nbytes > max)
+		return "is truncated";
+	uint64_t size = sizeof *h
+		+ h->nsourcemap * sizeof(struct hxpc_sourcemap)
+		+ h->nformatters * sizeof(struct hxpc_formatter)
+		+ h->nlabels * sizeof(struct hxpc_label)
+		+ h->nincbins * sizeof(struct hxpc_incbin)
+		+ h->nimports * sizeof(struct hxpc_import)
+		+ ((h->strings_size + 7) & ~(uint64_t)7)
+		+ h->nbytes + sizeof(uint64_t);
+	if(size != pc->size)
+		return "is truncated";
+	uint64_t hash;
+	memcpy(&hash, pc->data + size - sizeof hash, sizeof hash);
+	if(hash != memhash64(pc->data, size - sizeof hash, MEMHASH64_INIT))
+		return "is corrupted";
+	return NULL;
+}
+
+/* Releases the file, formatters which refer to it must not be used anymore */
+static void release_precompiled(struct precompiled *pc) {
+#ifdef _POSIX_C_SOURCE
+	if(pc->mapped)
+		munmap((void*) pc->data, pc->size);
+	else
+#endif
+	free((void*) pc->data);
+	pc->data = NULL;
+}
+
+/* Releases the file, must be called before cleanup_formatters */
+void unload_precompiled(struct precompiled *pc) {
+	free(formatqueue);
+	formatqueue = NULL;
+	formatqueue_len = formatqueue_cap = 0;
+	current_file_name = "<unknown>";
+	release_precompiled(pc);
+}
+
+/* Returns true if an object may not define the label differently */
+static bool label_conflicts(const char *name, calc_int_t constant, const char *expr) {
+	struct label l;
+	if(!strncmp(name, "hexproc.", strlen("hexproc.")) || !lookup_label(name, &l))
+		return false; // special variables only matter during the first pass
+	if(expr || l.expr)
+		return !expr || !l.expr || strcmp(expr, l.expr);
+	return l.constant != constant;
+}
+
+/* Appends a precompiled template or object to the state of the first pass,
+	moving its offsets by 'base'. 'quiet' suppresses the message if the file
+	is missing or outdated */
+static bool import_precompiled(struct precompiled *pc, const char *file_name,
+		bool quiet, bool object, uint64_t base) {
+	struct precompiled result = {0};
+	*pc = result;
+	if(!read_whole_file(pc, file_name)) {
+		if(!quiet)
+			fprintf(stderr, "Couldn't open file \"%s\" (error %d)\n", file_name, (int) errno);
+		return false;
+	}
+	struct hxpc_header h;
+	const char *error = validate_precompiled(pc, &h);
+	if(!error && object != !!(h.flags & HXPC_OBJECT))
+		error = object ? "is not an object, compile it with '--object'"
+			: "is an object, link it with '--link'";
+	if(error) {
+		if(!quiet)
+			fprintf(stderr, "\"%s\" %s\n", file_name, error);
+		release_precompiled(pc);
+		return false;
+	}
+	const uint8_t *p = pc->data + sizeof h;
+	const struct hxpc_sourcemap *map = (const void*) p;
+	p += h.nsourcemap * sizeof map[0];
+	const struct hxpc_formatter *formatters = (const void*) p;
+	p += h.nformatters * sizeof formatters[0];
+	const struct hxpc_label *labels = (const void*) p;
+	p += h.nlabels * sizeof labels[0];
+	const struct hxpc_incbin *included = (const void*) p;
+	p += h.nincbins * sizeof included[0];
+	const struct hxpc_import *imports = (const void*) p;
+	p += h.nimports * sizeof imports[0];
+	const char *strings = (const char*) p;
+	pc->bytes = p + ((h.strings_size + 7) & ~(uint64_t)7);
+	pc->nbytes = pc->length = h.nbytes;
+
+	#define STRING_OK(offset) ((offset) < h.strings_size \
+		&& memchr(strings + (offset), '\0', h.strings_size - (offset)))
+	if(h.source_name != HXPC_NONE) {
+		uint64_t source_hash;
+		if(!STRING_OK(h.source_name))
+			error = "is corrupted";
+		else if(hash_source_file(strings + h.source_name, &source_hash) && source_hash != h.source_hash)
+			error = "is older than its source, compile it again";
+	}
+	for(uint64_t i = 0; i < h.nimports && !error; i++) {
+		uint64_t hash;
+		if(!STRING_OK(imports[i].path))
+			error = "is corrupted";
+		else if(!hash_source_file(strings + imports[i].path, &hash) || hash != imports[i].hash)
+			error = "is older than a dump it imports, compile it again";
+	}
+	for(uint64_t i = 0; i < h.nincbins && !error; i++) {
+		uint64_t size;
+		if(!STRING_OK(included[i].path))
+			error = "is corrupted";
+		else if(!incbin_file_size(strings + included[i].path, &size) || size != included[i].file_size)
+			error = "is older than a file it includes, compile it again";
+	}
+	if(error) {
+		if(!quiet)
+			fprintf(stderr, "\"%s\" %s\n", file_name, error);
+		release_precompiled(pc);
+		return false;
+	}
+	if(h.source_name != HXPC_NONE && !object)
+		current_file_name = strings + h.source_name;
+
+	sourcemap = realloc(sourcemap, (sourcemap_len + h.nsourcemap) * sizeof(sourcemap[0]) + 1);
+	sourcemap_cap = sourcemap_len + h.nsourcemap;
+	for(uint64_t i = 0; i < h.nsourcemap; i++)
+		add_sourcemap_entry(base + map[i].index, map[i].action);
+
+	// expressions are used straight from the file, see unload_precompiled
+	formatqueue = realloc(formatqueue, (formatqueue_len + h.nformatters) * sizeof(formatqueue[0]) + 1);
+	formatqueue_cap = formatqueue_len + h.nformatters;
+	for(uint64_t i = 0; i < h.nformatters && !error; i++) {
+		struct hxpc_formatter r = formatters[i];
+		struct formatter f = {
+			.datatype = r.datatype,
+			.nbytes = r.nbytes,
+			.endian = r.endian,
+			.count = r.count,
+		};
+		if(r.fields != HXPC_NONE && STRING_OK(r.fields))
+			f.fields = (const unsigned char*) strings + r.fields;
+		f.encoder = select_encoder(f);
+		if(r.datatype > HP_FLOAT128 || r.nbytes > FORMATTER_MAX_BYTES || r.count > FORMATTER_MAX_COUNT
+				|| (r.datatype == HP_BITS) != (f.fields != NULL) || (r.count && f.fields) || r.expr >= h.strings_size
+				|| formatter_expr_size(strings + r.expr, f.fields, h.strings_size - r.expr) == SIZE_MAX)
+			error = "is corrupted";
+		f.expr = strings + r.expr;
+		add_formatter(f);
+		pc->length += FORMATTER_SIZE(f);
+	}
+	for(uint64_t i = 0; i < h.nlabels && !error; i++) {
+		struct hxpc_label r = labels[i];
+		const char *expr = r.expr != HXPC_NONE ? strings + r.expr : NULL;
+		calc_int_t constant = r.offset ? (calc_int_t)(base + r.constant)
+			: HXPC_JOIN_HALVES(r.constant, r.constant_high);
+		if(!STRING_OK(r.name) || (r.expr != HXPC_NONE && !STRING_OK(r.expr)))
+			error = "is corrupted";
+		else if(object && label_conflicts(strings + r.name, constant, expr))
+			fprintf(stderr, "\"%s\" defines \"%s\" differently than an earlier object\n",
+				file_name, strings + r.name), error = "can't be linked";
+		else
+			set_label(strdup(strings + r.name), constant, expr ? strdup(expr) : NULL, r.offset);
+	}
+	for(uint64_t i = 0; i < h.nincbins && !error; i++) {
+		struct hxpc_incbin r = included[i];
+		if(!STRING_OK(r.path))
+			error = "is corrupted";
+		else
+			add_incbin((struct incbin){strdup(strings + r.path), r.start, r.length});
+		pc->length += r.length;
+	}
+	for(uint64_t i = 0; i < h.nimports && !error; i++)
+		add_imported_path(strdup(strings + imports[i].path));
+	#undef STRING_OK
+	if(error) {
+		fprintf(stderr, "\"%s\" %s\n", file_name, error);
+		return false;
+	}
+	return true;
+}
+
+/* Loads a precompiled template in place of the first pass,
+	'quiet' suppresses the message if the file is missing or outdated */
+bool load_precompiled(struct precompiled *pc, const char *file_name, bool quiet) {
+	return import_precompiled(pc, file_name, quiet, false, 0);
+}
+
+/* Loads the objects in place of the first pass, as if their sources had
+	been concatenated. Their literal bytes are copied to the queue, so the
+	objects only need to stay loaded for their formatters */
+bool link_objects(struct precompiled *objects, char **names, int count, struct bytequeue *q) {
+	uint64_t base = 0;
+	for(int i = 0; i < count; i++) {
+		if(!import_precompiled(&objects[i], names[i], false, true, base))
+			return false;
+		for(uint64_t j = 0; j < objects[i].nbytes; j++)
+			bytequeue_put(q, objects[i].bytes[j]);
+		base += objects[i].length;
+	}
+	return true;
+}
+
+/* Releases the objects, must be called before cleanup_formatters */
+void unload_objects(struct precompiled *objects, int count) {
+	free(formatqueue);
+	formatqueue = NULL;
+	formatqueue_len = formatqueue_cap = 0;
+	for(int i = 0; i < count; i++)
+		if(objects[i].data)
+			release_precompiled(&objects[i]);
+	free(objects);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+/**
+ * Static tracepoints for bpftrace, perf and SystemTap, in the "hexproc"
+ * provider. They are compiled out when <sys/sdt.h> is missing or
+ * HEXPROC_NO_PROBES is defined; otherwise each one is a single NOP until
+ * a tracer attaches, e.g. bpftrace -e 'usdt:./hexproc:line_start { ... }'
+ *
+ *   line_start, line_end    (line number, offset)
+ *   calc_start              (expression)
+ *   calc_end                (expression, pointer to the calc_float_t result)
+ *   label_hit, label_miss   (name)
+ *   label_set               (name, expression or NULL)
+ *   formatter               (index in the formatter queue, number of bytes)
+ *   queue_grow              (number of segments, number of spilled segments)
+ *   flush                   (number of bytes, bytes flushed before)
+ */
+
+#if defined(__has_include) && !defined(HEXPROC_NO_PROBES)
+#	if __has_include(<sys/sdt.h>)
+#		include <sys/sdt.h>
+#		define HAVE_PROBES
+#	endif
+#endif
+
+#ifdef HAVE_PROBES
+#	define PROBE1(name, a) DTRACE_PROBE1(hexproc, name, a)
+#	define PROBE2(name, a, b) DTRACE_PROBE2(hexproc, name, a, b)
+#else
+#	define PROBE1(name, a) do { } while(0)
+#	define PROBE2(name, a, b) do { } while(0)
+#endif
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "diagnostic.h"
+#include "hash.h"
+
+/**
+ * This header implements the cost profile written by '--profile'.
+ * Evaluation time and calc() invocations are attributed to the source
+ * line which created the formatter or assignment (the "root"), followed
+ * by the chain of lazy labels which were evaluated on its behalf.
+ * Nothing here runs unless 'profile_mode' is set.
+ */
+
+#define PROFILE_BUCKETS 4096
+#define PROFILE_MAX_DEPTH 128
+
+/* True if profiling has been enabled */
+bool profile_mode = false;
+
+struct profile_entry {
+	char *key;
+	uint64_t calls, nanos;
+	struct profile_entry *next; // chained hash table
+};
+
+/* Self time per folded stack ("root;label;label") */
+struct profile_entry **profile_stacks = NULL;
+/* Inclusive time per root */
+struct profile_entry **profile_lines = NULL;
+
+struct profile_frame {
+	uint64_t start, children, calls;
+} profile_frames[PROFILE_MAX_DEPTH];
+unsigned profile_depth = 0;
+
+char profile_root[256];
+/* Buffer for building folded stack keys */
+char *profile_key = NULL;
+size_t profile_key_cap = 0;
+
+/* Source locations of queued formatters, indexed like the formatter queue */
+struct profile_origin {
+	const char *file;
+	uint64_t line;
+} *profile_origins = NULL;
+size_t profile_origins_len = 0, profile_origins_cap = 0;
+
+static uint64_t profile_clock(void) {
+#ifdef CLOCK_MONOTONIC
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+#else
+	return (uint64_t)clock() * (1000000000 / CLOCKS_PER_SEC);
+#endif
+}
+
+static struct profile_entry *profile_lookup(struct profile_entry **table, const char *key) {
+	unsigned bucket = strhash(key) & (PROFILE_BUCKETS - 1);
+	for(struct profile_entry *e = table[bucket]; e; e = e->next)
+		if(!strcmp(e->key, key))
+			return e;
+	struct profile_entry *e = calloc(1, sizeof(struct profile_entry));
+	e->key = strdup(key);
+	e->next = table[bucket];
+	table[bucket] = e;
+	return e;
+}
+
+void start_profile(void) {
+	profile_mode = true;
+	profile_stacks = calloc(PROFILE_BUCKETS, sizeof(profile_stacks[0]));
+	profile_lines = calloc(PROFILE_BUCKETS, sizeof(profile_lines[0]));
+}
+
+/* Remembers where the formatter with the next queue index was created */
+void profile_add_origin(const char *file, uint64_t line) {
+	if(profile_origins_len >= profile_origins_cap) {
+		profile_origins_cap = (profile_origins_cap == 0) ? 16 : profile_origins_cap * 3;
+		profile_origins = realloc(profile_origins, profile_origins_cap * sizeof(profile_origins[0]));
+	}
+	struct profile_origin o = {.file = file, .line = line};
+	profile_origins[profile_origins_len++] = o;
+}
+
+/* Sets the source line which following top-level evaluations are attributed to */
+void profile_set_root(const char *file, uint64_t line) {
+	snprintf(profile_root, sizeof profile_root, "%s:%"PRIu64, file, line);
+}
+
+void profile_set_formatter_root(size_t index) {
+	if(index < profile_origins_len)
+		profile_set_root(profile_origins[index].file, profile_origins[index].line);
+}
+
+void profile_enter(void) {
+	if(profile_depth >= PROFILE_MAX_DEPTH) {
+		profile_depth++; // deeper frames are merged into their parent
+		return;
+	}
+	struct profile_frame f = {.start = profile_clock()};
+	profile_frames[profile_depth++] = f;
+}
+
+void profile_count_call(void) {
+	if(profile_depth && profile_depth <= PROFILE_MAX_DEPTH)
+		profile_frames[profile_depth - 1].calls++;
+}
+
+/* Closes the innermost frame, 'names' is the current label chain */
+void profile_leave(const char *const *names, unsigned nnames) {
+	if(!profile_depth)
+		return;
+	if(--profile_depth >= PROFILE_MAX_DEPTH)
+		return;
+	struct profile_frame f = profile_frames[profile_depth];
+	uint64_t total = profile_clock() - f.start;
+
+	size_t len = strlen(profile_root);
+	for(unsigned i = 0; i < nnames; i++)
+		len += 1 + strlen(names[i]);
+	if(len + 1 > profile_key_cap) {
+		profile_key_cap = len + 64;
+		profile_key = realloc(profile_key, profile_key_cap);
+	}
+	strcpy(profile_key, profile_root);
+	for(unsigned i = 0; i < nnames; i++) {
+		strcat(profile_key, ";");
+		strcat(profile_key, names[i]);
+	}
+
+	struct profile_entry *e = profile_lookup(profile_stacks, profile_key);
+	e->calls += f.calls;
+	e->nanos += total - f.children;
+	struct profile_entry *line = profile_lookup(profile_lines, profile_root);
+	line->calls += f.calls;
+	if(profile_depth)
+		profile_frames[profile_depth - 1].children += total;
+	else
+		line->nanos += total; // nested frames are already included
+}
+
+static int compare_profile_entries(const void *a, const void *b) {
+	const struct profile_entry *x = *(struct profile_entry *const *)a;
+	const struct profile_entry *y = *(struct profile_entry *const *)b;
+	return (x->nanos < y->nanos) - (x->nanos > y->nanos);
+}
+
+/* Writes stacks in the folded format used by flame graph tools,
+	the value of each stack is its self time in nanoseconds */
+void write_profile(FILE *out) {
+	for(unsigned i = 0; i < PROFILE_BUCKETS; i++)
+		for(struct profile_entry *e = profile_stacks[i]; e; e = e->next)
+			fprintf(out, "%s %"PRIu64"\n", e->key, e->nanos);
+}
+
+/* Prints the most expensive source lines */
+void print_profile_summary(FILE *out, unsigned limit) {
+	size_t n = 0, cap = 64;
+	struct profile_entry **lines = malloc(cap * sizeof(lines[0]));
+	for(unsigned i = 0; i < PROFILE_BUCKETS; i++) {
+		for(struct profile_entry *e = profile_lines[i]; e; e = e->next) {
+			if(n >= cap)
+				lines = realloc(lines, (cap *= 2) * sizeof(lines[0]));
+			lines[n++] = e;
+		}
+	}
+	qsort(lines, n, sizeof(lines[0]), compare_profile_entries);
+	fprintf(out, "%12s %12s  %s\n", "time (us)", "calc() calls", "source line");
+	for(size_t i = 0; i < n && i < limit; i++)
+		fprintf(out, "%12"PRIu64" %12"PRIu64"  %s\n",
+			lines[i]->nanos / 1000, lines[i]->calls, lines[i]->key);
+	free(lines);
+}
+
+void cleanup_profile(void) {
+	struct profile_entry **tables[] = {profile_stacks, profile_lines};
+	for(unsigned t = 0; t < 2; t++) {
+		if(!tables[t])
+			continue;
+		for(unsigned i = 0; i < PROFILE_BUCKETS; i++) {
+			struct profile_entry *e = tables[t][i];
+			while(e) {
+				struct profile_entry *next = e->next;
+				free(e->key);
+				free(e);
+				e = next;
+			}
+		}
+		free(tables[t]);
+	}
+	free(profile_origins);
+	free(profile_key);
+}
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "charclass.h"
+#include "calc.h"
+#include "label.h"
+#include "formatter.h"
+
+/**
+ * Local labels start with '@' and belong to the scope opened by the last
+ * offset label ("name:") which isn't local. When the next one opens a new
+ * scope, references to the locals from the formatters and lazy labels of
+ * the scope are replaced by their values or expressions and the locals
+ * are removed, so the label map only holds the locals of one scope.
+ * Local offset labels become an offset from the scope label, so they are
+ * still moved when objects are linked. Locals before the first scope are
+ * ordinary labels.
+ */
+
+#define IS_LOCAL_NAME(name) ((name)[0] == '@')
+
+static const char *scope_label; // NULL before the first scope
+static size_t scope_first_formatter;
+
+struct name_list {
+	const char **names;
+	size_t len, cap;
+};
+
+static struct name_list scope_locals; // locals defined in the scope
+static struct name_list scope_lazy; // lazy labels of the scope which refer to locals
+
+static void name_list_add(struct name_list *list, const char *name) {
+	for(size_t i = 0; i < list->len; i++)
+		if(!strcmp(list->names[i], name))
+			return;
+	if(list->len >= list->cap) {
+		list->cap = (list->cap == 0) ? 16 : list->cap * 2;
+		list->names = realloc(list->names, list->cap * sizeof(list->names[0]));
+	}
+	list->names[list->len++] = strdup(name);
+}
+
+static void name_list_clear(struct name_list *list) {
+	for(size_t i = 0; i < list->len; i++)
+		free((char*) list->names[i]);
+	list->len = 0;
+}
+
+/* Returns the length of the number or name at 'text' */
+static size_t scope_token_len(const char *text) {
+	size_t len = 0;
+	if(CHAR_IS(text[0], CC_DIGIT))
+		while(CHAR_IS(text[len], CC_ALPHA | CC_DIGIT) || text[len] == '.')
+			len++;
+	else
+		while(CHAR_IS(text[len], CC_NAME))
+			len++;
+	return len;
+}
+
+static bool refers_to_local(const char *expr) {
+	while(expr[0]) {
+		if(CHAR_IS(expr[0], CC_NAME)) {
+			if(IS_LOCAL_NAME(expr))
+				return true;
+			expr += scope_token_len(expr);
+		} else {
+			expr++;
+		}
+	}
+	return false;
+}
+
+struct scope_text {
+	char *text;
+	size_t len, cap;
+};
+
+static void scope_append(struct scope_text *out, const char *text, size_t len) {
+	if(out->len + len + 1 > out->cap) {
+		out->cap = (out->len + len + 1) * 2;
+		out->text = realloc(out->text, out->cap);
+	}
+	memcpy(out->text + out->len, text, len);
+	out->len += len;
+	out->text[out->len] = '\0';
+}
+
+static void scope_append_constant(struct scope_text *out, calc_int_t value) {
+	char text[48];
+#ifdef HAVE_HP_INT128
+	if((long long) value != value) {
+		calc_uint_t magnitude = value < 0 ? -(calc_uint_t) value : (calc_uint_t) value;
+		snprintf(text, sizeof text, "(%s0x%016llx%016llx)", value < 0 ? "-" : "",
+			(unsigned long long)(magnitude >> 64), (unsigned long long) magnitude);
+		scope_append(out, text, strlen(text));
+		return;
+	}
+#endif
+	snprintf(text, sizeof text, "(%lld)", (long long) value);
+	scope_append(out, text, strlen(text));
+}
+
+/* Copies the expression with the locals of the scope replaced */
+static void expand_locals(const char *expr, unsigned depth, struct scope_text *out) {
+	while(expr[0]) {
+		if(!CHAR_IS(expr[0], CC_NAME)) {
+			scope_append(out, expr++, 1);
+			continue;
+		}
+		size_t len = scope_token_len(expr);
+		struct label *local = NULL;
+		if(IS_LOCAL_NAME(expr) && depth < NAME_STACK_SIZE) {
+			char *name = strndup(expr, len);
+			local = label_node(name);
+			free(name);
+		}
+		if(!local) {
+			scope_append(out, expr, len);
+		} else if(local->expr) {
+			scope_append(out, "(", 1);
+			expand_locals(local->expr, depth + 1, out);
+			scope_append(out, ")", 1);
+		} else if(local->offset) {
+			struct label *base = label_node(scope_label);
+			scope_append(out, "(", 1);
+			scope_append(out, scope_label, strlen(scope_label));
+			scope_append(out, " + ", 3);
+			scope_append_constant(out, local->constant - (base ? base->constant : 0));
+			scope_append(out, ")", 1);
+		} else {
+			scope_append_constant(out, local->constant);
+		}
+		expr += len;
+	}
+}
+
+/* Replaces the locals in a formatter, bit fields hold several expressions */
+static void expand_formatter_locals(struct formatter *fmt) {
+	size_t count = fmt->fields ? strlen((const char*) fmt->fields) : 1;
+	bool found = false;
+	const char *expr = fmt->expr;
+	for(size_t i = 0; i < count; i++, expr += strlen(expr) + 1)
+		found = found || refers_to_local(expr);
+	if(!found)
+		return;
+	struct scope_text out = {0};
+	expr = fmt->expr;
+	for(size_t i = 0; i < count; i++, expr += strlen(expr) + 1) {
+		expand_locals(expr, 0, &out);
+		scope_append(&out, "", 1); // keeps the separator
+	}
+	free((char*) fmt->expr);
+	fmt->expr = out.text;
+}
+
+/* Resolves the references to the locals of the current scope and removes them */
+void close_scope(void) {
+	if(!scope_label)
+		return;
+	for(size_t i = scope_first_formatter; i < formatqueue_len; i++)
+		expand_formatter_locals(&formatqueue[i]);
+	for(size_t i = 0; i < scope_lazy.len; i++) {
+		struct label *label = label_node(scope_lazy.names[i]);
+		if(!label || !label->expr)
+			continue;
+		struct scope_text out = {0};
+		expand_locals(label->expr, 0, &out);
+		free((char*) label->expr);
+		label->expr = out.text;
+	}
+	for(size_t i = 0; i < scope_locals.len; i++)
+		remove_label(scope_locals.names[i]);
+	name_list_clear(&scope_lazy);
+	name_list_clear(&scope_locals);
+	free((char*) scope_label);
+	scope_label = NULL;
+}
+
+/* Called before the offset label 'name' is defined */
+void open_scope(const char *name) {
+	close_scope();
+	scope_label = strdup(name);
+	scope_first_formatter = formatqueue_len;
+}
+
+/* Called after a label has been assigned, 'expr' is NULL unless it is lazy */
+void scope_assigned(const char *name, const char *expr) {
+	if(!scope_label)
+		return;
+	if(IS_LOCAL_NAME(name))
+		name_list_add(&scope_locals, name);
+	else if(expr && refers_to_local(expr))
+		name_list_add(&scope_lazy, name);
+}
+
+void reset_scope(void) {
+	name_list_clear(&scope_locals);
+	name_list_clear(&scope_lazy);
+	free((char*) scope_label);
+	scope_label = NULL;
+}
+
+void cleanup_scope(void) {
+	name_list_clear(&scope_locals);
+	name_list_clear(&scope_lazy);
+	OPTIONAL_FREE(scope_locals.names);
+	OPTIONAL_FREE(scope_lazy.names);
+	OPTIONAL_FREE(scope_label);
+}
@@ -0,0 +1,368 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "diagnostic.h"
+#include "hash.h"
+#include "variants.h"
+
+/**
+ * This header implements '--serve' and '--connect'. The server listens
+ * on a Unix domain socket; a client sends its arguments, working
+ * directory and standard streams (as file descriptors), and the server
+ * forks a worker which runs them like a normal invocation, writing
+ * straight to the client's streams. The exit status is sent back once
+ * the worker exits.
+ * Workers keep the first pass of each input file as a precompiled
+ * template in a private cache directory, so later requests for the
+ * same file skip parsing until its contents change.
+ */
+
+#if defined(_POSIX_C_SOURCE) && !defined(__TINYC__)
+#define HAVE_SERVER
+#endif
+
+/* Directory of cached templates, set in server workers */
+const char *template_cache_dir = NULL;
+
+#ifdef HAVE_SERVER
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SERVER_MAX_REQUEST (64 * 1024)
+
+struct worker {
+	pid_t pid;
+	int connection;
+};
+
+volatile sig_atomic_t server_stopping = 0;
+/* Written to by the SIGCHLD handler, wakes up the server loop */
+int child_exited[2] = {-1, -1};
+
+static void stop_server(int signal) {
+	(void) signal;
+	server_stopping = 1;
+}
+
+static void notify_child_exited(int signal) {
+	(void) signal;
+	int saved_errno = errno;
+	if(write(child_exited[1], "", 1) < 0) {
+		// the pipe is full, so the server will wake up anyway
+	}
+	errno = saved_errno;
+}
+
+static bool read_fully(int fd, void *data, size_t len) {
+	for(size_t done = 0; done < len;) {
+		ssize_t n = read(fd, (char*) data + done, len - done);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return false;
+		done += n;
+	}
+	return true;
+}
+
+static bool write_fully(int fd, const void *data, size_t len) {
+	for(size_t done = 0; done < len;) {
+		ssize_t n = write(fd, (const char*) data + done, len - done);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return false;
+		done += n;
+	}
+	return true;
+}
+
+static bool make_socket_address(const char *path, struct sockaddr_un *addr) {
+	memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof addr->sun_path) {
+		fprintf(stderr, "Socket path is too long: \"%s\"\n", path);
+		return false;
+	}
+	strcpy(addr->sun_path, path);
+	return true;
+}
+
+/* Returns the cache file for an input file and the current '-D' definitions */
+char *cached_template_path(const char *input) {
+	char resolved[PATH_MAX];
+	if(!template_cache_dir || !realpath(input, resolved))
+		return NULL;
+	uint64_t hash = memhash64(resolved, strlen(resolved) + 1, MEMHASH64_INIT);
+	for(size_t i = 0; i < ndefinitions; i++)
+		hash = memhash64(definitions[i], strlen(definitions[i]) + 1, hash);
+	size_t len = strlen(template_cache_dir) + 32;
+	char *path = malloc(len);
+	snprintf(path, len, "%s/%016"PRIx64".hxpc", template_cache_dir, hash);
+	return path;
+}
+
+/* Stores a template in the cache, replacing the old one atomically */
+void store_cached_template(const char *path, struct bytequeue *q, const char *source_name) {
+	char resolved[PATH_MAX];
+	if(!realpath(source_name, resolved))
+		return;
+	source_name = resolved; // clients may use relative paths from elsewhere
+	size_t len = strlen(path) + 32;
+	char *tmp = malloc(len);
+	snprintf(tmp, len, "%s.%ld", path, (long) getpid());
+	FILE *file = fopen(tmp, "wb");
+	bool ok = file && write_precompiled(file, q, source_name, false);
+	if(file && fclose(file) != 0)
+		ok = false;
+	if(!ok || rename(tmp, path) != 0)
+		unlink(tmp);
+	free(tmp);
+}
+
+/* Runs one request in a worker process and never returns */
+static void handle_request(int connection, int listener, int (*run)(int, char**)) {
+	close(listener);
+	uint32_t len;
+	int fds[3];
+	char control[CMSG_SPACE(sizeof fds)];
+	struct iovec iov = {.iov_base = &len, .iov_len = sizeof len};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof control,
+	};
+	ssize_t n;
+	do
+		n = recvmsg(connection, &msg, 0);
+	while(n < 0 && errno == EINTR);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if(n != sizeof len || !cmsg || cmsg->cmsg_type != SCM_RIGHTS
+			|| cmsg->cmsg_len != CMSG_LEN(sizeof fds) || len > SERVER_MAX_REQUEST)
+		_exit(EPROTO);
+	memcpy(fds, CMSG_DATA(cmsg), sizeof fds);
+
+	// the request holds the working directory followed by the arguments
+	char *request = malloc(len + 1);
+	if(!read_fully(connection, request, len))
+		_exit(EPROTO);
+	request[len] = '\0';
+	int argc = 0;
+	char **argv = malloc((len / 2 + 3) * sizeof(argv[0]));
+	static char program_name[] = "hexproc";
+	argv[argc++] = program_name;
+	for(char *arg = request + strlen(request) + 1; arg < request + len; arg += strlen(arg) + 1)
+		argv[argc++] = arg;
+	argv[argc] = NULL;
+
+	for(int i = 0; i < 3; i++) {
+		dup2(fds[i], i);
+		close(fds[i]);
+	}
+	close(connection);
+	if(chdir(request) != 0) {
+		fprintf(stderr, "Couldn't change to directory \"%s\" (error %d)\n", request, errno);
+		exit(errno);
+	}
+	optind = 0; // reinitializes getopt
+	exit(run(argc, argv));
+}
+
+static void remove_cache_dir(const char *dir) {
+	DIR *d = opendir(dir);
+	if(!d)
+		return;
+	size_t len = strlen(dir) + NAME_MAX + 2;
+	char *path = malloc(len);
+	for(struct dirent *e; (e = readdir(d));) {
+		if(e->d_name[0] == '.')
+			continue;
+		snprintf(path, len, "%s/%s", dir, e->d_name);
+		unlink(path);
+	}
+	free(path);
+	closedir(d);
+	rmdir(dir);
+}
+
+/* Reports the exit status of finished workers to their clients,
+	waits for one to finish if 'block' is set */
+static unsigned reap_workers(struct worker *workers, unsigned nworkers, bool block) {
+	while(nworkers) {
+		int status;
+		pid_t pid = waitpid(-1, &status, block ? 0 : WNOHANG);
+		if(pid < 0 && errno == EINTR && !server_stopping)
+			continue;
+		if(pid <= 0)
+			break;
+		for(unsigned i = 0; i < nworkers; i++) {
+			if(workers[i].pid != pid)
+				continue;
+			uint32_t code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+			write_fully(workers[i].connection, &code, sizeof code);
+			close(workers[i].connection);
+			workers[i] = workers[--nworkers];
+			break;
+		}
+		block = false;
+	}
+	return nworkers;
+}
+
+/* Serves requests until interrupted, with up to 'jobs' concurrent workers */
+int serve(const char *socket_path, unsigned jobs, int (*run)(int, char**)) {
+	struct sockaddr_un addr;
+	if(!make_socket_address(socket_path, &addr))
+		return EINVAL;
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listener < 0 || bind(listener, (struct sockaddr*) &addr, sizeof addr) != 0
+			|| listen(listener, 64) != 0) {
+		fprintf(stderr, "Couldn't listen on \"%s\" (error %d)\n", socket_path, errno);
+		return errno;
+	}
+	if(pipe(child_exited) != 0) {
+		fprintf(stderr, "Couldn't create pipe (error %d)\n", errno);
+		return errno;
+	}
+	fcntl(child_exited[0], F_SETFL, O_NONBLOCK);
+	fcntl(child_exited[1], F_SETFL, O_NONBLOCK);
+	char cache_dir[] = "/tmp/hexproc-cache-XXXXXX";
+	template_cache_dir = mkdtemp(cache_dir);
+	if(!template_cache_dir)
+		fprintf(stderr, "Couldn't create cache directory (error %d), templates won't be cached\n", errno);
+
+	struct sigaction action = {.sa_handler = stop_server};
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	action.sa_handler = notify_child_exited;
+	sigaction(SIGCHLD, &action, NULL);
+
+	struct worker *workers = malloc(jobs * sizeof(workers[0]));
+	unsigned nworkers = 0;
+	while(!server_stopping) {
+		// wait for a connection, or for a worker to finish
+		struct pollfd fds[2] = {
+			{.fd = listener, .events = nworkers < jobs ? POLLIN : 0},
+			{.fd = child_exited[0], .events = POLLIN},
+		};
+		if(poll(fds, 2, -1) < 0)
+			continue;
+		if(fds[1].revents) {
+			char drain[64];
+			while(read(child_exited[0], drain, sizeof drain) > 0);
+			nworkers = reap_workers(workers, nworkers, false);
+		}
+		if(!(fds[0].revents & POLLIN))
+			continue;
+		int connection = accept(listener, NULL, NULL);
+		if(connection < 0) {
+			if(errno != EINTR)
+				fprintf(stderr, "Couldn't accept connection (error %d)\n", errno);
+			continue;
+		}
+		fflush(stdout);
+		fflush(stderr);
+		pid_t pid = fork();
+		if(pid == 0) {
+			signal(SIGINT, SIG_DFL);
+			signal(SIGTERM, SIG_DFL);
+			signal(SIGCHLD, SIG_DFL);
+			close(child_exited[0]);
+			close(child_exited[1]);
+			handle_request(connection, listener, run);
+		}
+		if(pid < 0) {
+			fprintf(stderr, "Couldn't start worker (error %d)\n", errno);
+			close(connection);
+			continue;
+		}
+		struct worker w = {.pid = pid, .connection = connection};
+		workers[nworkers++] = w;
+	}
+	while(nworkers)
+		nworkers = reap_workers(workers, nworkers, true);
+	free(workers);
+	close(listener);
+	unlink(socket_path);
+	if(template_cache_dir)
+		remove_cache_dir(template_cache_dir);
+	return 0;
+}
+
+/* Sends the arguments to a server and returns the exit status of the request */
+int connect_server(const char *socket_path, int argc, char **argv) {
+	struct sockaddr_un addr;
+	if(!make_socket_address(socket_path, &addr))
+		return EINVAL;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof addr) != 0) {
+		fprintf(stderr, "Couldn't connect to \"%s\" (error %d)\n", socket_path, errno);
+		return errno;
+	}
+
+	char cwd[PATH_MAX];
+	if(!getcwd(cwd, sizeof cwd)) {
+		fprintf(stderr, "Couldn't get working directory (error %d)\n", errno);
+		return errno;
+	}
+	size_t len = strlen(cwd) + 1;
+	for(int i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	if(len > SERVER_MAX_REQUEST) {
+		fprintf(stderr, "Too many arguments\n");
+		return E2BIG;
+	}
+	char *request = malloc(len), *p = request;
+	p = stpcpy(p, cwd) + 1;
+	for(int i = 0; i < argc; i++)
+		p = stpcpy(p, argv[i]) + 1;
+
+	uint32_t len32 = len;
+	int fds[3] = {0, 1, 2};
+	char control[CMSG_SPACE(sizeof fds)];
+	memset(control, 0, sizeof control);
+	struct iovec iov = {.iov_base = &len32, .iov_len = sizeof len32};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof control,
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+
+	uint32_t status;
+	bool ok = sendmsg(fd, &msg, 0) == sizeof len32
+		&& write_fully(fd, request, len)
+		&& read_fully(fd, &status, sizeof status);
+	free(request);
+	close(fd);
+	if(!ok) {
+		fprintf(stderr, "Lost connection to \"%s\"\n", socket_path);
+		return 1;
+	}
+	return status;
+}
+
+#endif
@@ -2,22 +2,24 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "diagnostic.h"
 
 struct sourcemap_entry {
-	size_t index;
+	uint64_t index; // byte offset, may exceed 4 GiB on any platform
 	enum sourcemap_action {
 		SOURCE_STRING,
 		SOURCE_FORMATTER,
 		SOURCE_NEWLINE,
-		SOURCE_END /* marks the end of a token */
+		SOURCE_END, /* marks the end of a token */
+		SOURCE_INCBIN
 	} action : 4;
 } *sourcemap;
 
 size_t sourcemap_pos, sourcemap_len, sourcemap_cap;
 
-void add_sourcemap_entry(size_t index, int action) {
+void add_sourcemap_entry(uint64_t index, int action) {
 	if(sourcemap_len >= sourcemap_cap) {
 		sourcemap_cap = (sourcemap_cap == 0) ? 16 : sourcemap_cap * 3;
 		sourcemap = realloc(sourcemap, sourcemap_cap * sizeof(sourcemap[0]));
@@ -26,18 +28,58 @@ void add_sourcemap_entry(size_t index, int action) {
 	sourcemap[sourcemap_len++] = s;
 }
 
-size_t next_sourcemap_index(void) {
+uint64_t next_sourcemap_index(void) {
 	return sourcemap_pos < sourcemap_len
 		? sourcemap[sourcemap_pos].index
-		: (size_t)-1;
+		: UINT64_MAX;
+}
+
+/* Line markers from the first pass, which the second pass replays so its
+	diagnostics and source lines match. Each applies at the given entry */
+struct source_marker {
+	size_t entry;
+	const char *file_name;
+	uint64_t line_number;
+} *source_markers;
+
+size_t source_markers_pos, source_markers_len, source_markers_cap;
+static const char *source_first_file_name; // before the first marker
+
+/* Records the position of a line marker, before it changes the current file */
+void add_source_marker(const char *file_name, uint64_t line_number) {
+	if(!source_markers_len)
+		source_first_file_name = current_file_name;
+	if(source_markers_len >= source_markers_cap) {
+		source_markers_cap = (source_markers_cap == 0) ? 8 : source_markers_cap * 2;
+		source_markers = realloc(source_markers, source_markers_cap * sizeof(source_markers[0]));
+	}
+	struct source_marker m = {.entry = sourcemap_len, .file_name = file_name, .line_number = line_number};
+	source_markers[source_markers_len++] = m;
 }
 
 enum sourcemap_action take_next_sourcemap_action(void) {
-	return sourcemap_pos < sourcemap_len
-		? sourcemap[sourcemap_pos++].action
-		: (report_error("Source map underflow"), SOURCE_END);
+	if(sourcemap_pos >= sourcemap_len)
+		return (report_error("Source map underflow"), SOURCE_END);
+	if(source_markers_pos < source_markers_len && source_markers[source_markers_pos].entry == sourcemap_pos) {
+		current_file_name = source_markers[source_markers_pos].file_name;
+		line_number = source_markers[source_markers_pos++].line_number;
+	}
+	return sourcemap[sourcemap_pos++].action;
+}
+
+/* Starts the second pass at the first entry, in the file the first pass started in */
+void rewind_sourcemap(void) {
+	sourcemap_pos = source_markers_pos = 0;
+	if(source_markers_len)
+		current_file_name = source_first_file_name;
+}
+
+void reset_sourcemap(void) {
+	sourcemap_len = sourcemap_pos = 0;
+	source_markers_len = source_markers_pos = 0;
 }
 
 void cleanup_sourcemap(void) {
 	OPTIONAL_FREE(sourcemap);
+	OPTIONAL_FREE(source_markers);
 }
@@ -23,3 +23,30 @@ echo "Running $program with $nbytes octets of input $ntimes times"
 for i in `seq $ntimes`; do
 	time -p dd bs=1 count=$nbytes if=/dev/zero | xxd -p | "$program" > /dev/null
 done
+
+# labels and offsets past 4 GiB, the included file is sparse and streamed
+dir="$(mktemp -d)"
+trap 'rm -rf "$dir"' EXIT
+truncate -s 5G "$dir/big.bin"
+printf 'start: incbin "%s" end:\n[long](end - start) [long](end + 0x100000000)\n' "$dir/big.bin" > "$dir/big.hxp"
+echo "Running $program with a 5 GiB included file"
+result="$( (ulimit -v 262144; time -p "$program" -B "$dir/big.hxp") | tail -c 16 | xxd -p)"
+if [ "$result" != '00000001400000000000000240000000' ]; then
+	echo "Error: wrong labels past 4 GiB: $result"
+	exit 1
+fi
+
+# long encoded strings, converted without going through octets
+yes 'u16le/2"The quick brown fox jumps over the lazy dog, again and again"' | head -n 200000 > "$dir/strings.hxp"
+echo "Running $program with 200000 encoded string literals"
+time -p "$program" -B "$dir/strings.hxp" > /dev/null
+
+# a large xxd dump, decoded without going through octets
+head -c 20000000 /dev/urandom > "$dir/vendor.bin"
+xxd -p "$dir/vendor.bin" > "$dir/vendor.xxd"
+echo "import xxd \"$dir/vendor.xxd\"" > "$dir/vendor.hxp"
+echo "Running $program with a 20 MB xxd dump"
+if ! (time -p "$program" -B "$dir/vendor.hxp") | cmp -s - "$dir/vendor.bin"; then
+	echo "Error: imported dump differs from the original"
+	exit 1
+fi
@@ -0,0 +1,164 @@
+/**
+ * Fuzzing harness which processes in-memory inputs in a loop and resets
+ * the global state between them, instead of starting a process for each
+ * input. It is built as an AFL++ persistent mode program by afl-clang-fast
+ * ('make afl'), as a libFuzzer target with -DFUZZ_LIBFUZZER
+ * ('make libfuzzer'), or otherwise as a program which runs each file
+ * given as an argument once, to reproduce what the fuzzer found.
+ *
+ * Unless it is built for libFuzzer, which has its own -timeout, an input
+ * which runs for longer than FUZZ_TIME_LIMIT_MS aborts the process, so
+ * inputs with pathological performance are reported like crashes.
+ */
+
+#define main hexproc_main
+#include "../hexproc.c"
+#undef main
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#ifndef FUZZ_TIME_LIMIT_MS
+#define FUZZ_TIME_LIMIT_MS 1000
+#endif
+
+static FILE *fuzz_null;
+static struct bytequeue fuzz_buffer;
+static char *fuzz_line;
+static size_t fuzz_line_cap;
+
+#ifndef FUZZ_LIBFUZZER
+static void fuzz_timeout(int unused) {
+	static const char message[] = "Input exceeded the time limit\n";
+	if(write(STDERR_FILENO, message, sizeof message - 1) < 0)
+		_exit(1);
+	abort();
+}
+
+static void fuzz_set_timer(long ms) {
+	struct itimerval timer = {
+		.it_value = {.tv_sec = ms / 1000, .tv_usec = ms % 1000 * 1000},
+	};
+	setitimer(ITIMER_REAL, &timer, NULL);
+}
+#endif
+
+static void fuzz_init(void) {
+	if(!(fuzz_null = fopen("/dev/null", "wb"))) {
+		fprintf(stderr, "Couldn't open /dev/null (error %d)\n", (int) errno);
+		exit(1);
+	}
+	fuzz_buffer = make_bytequeue();
+#ifndef FUZZ_LIBFUZZER
+	signal(SIGALRM, fuzz_timeout);
+#endif
+}
+
+/* Restores the state of a process which hasn't processed any input */
+static void fuzz_reset(void) {
+	reset_labels();
+	reset_formatters();
+	reset_sourcemap();
+	reset_incbins();
+	reset_locations();
+	reset_scope();
+	reset_marker_files();
+	bytequeue_clear(&fuzz_buffer);
+	offset = 0;
+	line_number = 0;
+	block_comment = false;
+	textfail = false;
+	mathfail = false;
+	namestack_len = 0;
+}
+
+/* Runs both passes on one input, rendering every output mode */
+static void fuzz_one(const uint8_t *data, size_t size) {
+#ifndef FUZZ_LIBFUZZER
+	fuzz_set_timer(FUZZ_TIME_LIMIT_MS);
+#endif
+	current_file_name = "<fuzz>";
+	add_builtin_variables();
+	for(size_t pos = 0; pos < size;) {
+		const uint8_t *newline = memchr(data + pos, '\n', size - pos);
+		size_t len = newline ? (size_t)(newline - data) + 1 - pos : size - pos;
+		if(len + 1 > fuzz_line_cap) {
+			fuzz_line_cap = (len + 1) * 2;
+			fuzz_line = realloc(fuzz_line, fuzz_line_cap);
+		}
+		memcpy(fuzz_line, data + pos, len);
+		fuzz_line[len] = '\0';
+		pos += len;
+		line_number++;
+		process_line(fuzz_line, &fuzz_buffer);
+	}
+	close_scope();
+
+	static struct sink hex, binary, map;
+	init_sink(&hex, OUTPUT_HEX, fuzz_null, NULL);
+	init_sink(&binary, OUTPUT_BINARY, fuzz_null, NULL);
+	init_sink(&map, OUTPUT_MAP, fuzz_null, NULL);
+	hex.next = &binary;
+	binary.next = &map;
+	render(&hex, &fuzz_buffer, NULL);
+	fuzz_reset();
+#ifndef FUZZ_LIBFUZZER
+	fuzz_set_timer(0);
+#endif
+}
+
+#if defined(__AFL_FUZZ_TESTCASE_LEN)
+
+__AFL_FUZZ_INIT();
+
+int main(void) {
+	fuzz_init();
+#ifdef __AFL_HAVE_MANUAL_CONTROL
+	__AFL_INIT();
+#endif
+	const uint8_t *data = __AFL_FUZZ_TESTCASE_BUF;
+	while(__AFL_LOOP(100000))
+		fuzz_one(data, __AFL_FUZZ_TESTCASE_LEN);
+	return 0;
+}
+
+#elif defined(FUZZ_LIBFUZZER)
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	if(!fuzz_null)
+		fuzz_init();
+	fuzz_one(data, size);
+	return 0;
+}
+
+#else
+
+int main(int argc, char **argv) {
+	fuzz_init();
+	uint8_t *data = NULL;
+	size_t cap = 0;
+	for(int i = 1; i < argc; i++) {
+		FILE *file = fopen(argv[i], "rb");
+		if(!file) {
+			fprintf(stderr, "Couldn't open file \"%s\" (error %d)\n", argv[i], (int) errno);
+			return errno;
+		}
+		size_t size = 0;
+		for(size_t n = 1; n > 0; size += n) {
+			if(size == cap) {
+				cap = (cap == 0) ? 4096 : cap * 2;
+				data = realloc(data, cap);
+			}
+			n = fread(data + size, 1, cap - size, file);
+		}
+		fclose(file);
+		fuzz_one(data, size);
+	}
+	free(data);
+	free(fuzz_line);
+	free_bytequeue(fuzz_buffer);
+	fclose(fuzz_null);
+	return 0;
+}
+
+#endif
@@ -15,7 +15,7 @@ fi
 expect() {
 	#  $1 is input
 	#  $2 is expected output
-	output="$(echo "$1" | "$exe")"
+	output="$(printf '%s\n' "$1" | "$exe")"
 	if [ "$2" != "$output" ]; then
 		echo '============================'
 		echo "Assertion failed"
@@ -29,6 +29,19 @@ expect() {
 	fi
 }
 
+expect_error() {
+	#  like expect, but the input must also report an error
+	errors="$(printf '%s\n' "$1" | "$exe" 2>&1 > /dev/null)"
+	if [ -z "$errors" ]; then
+		echo '============================'
+		echo "No error was reported"
+		echo "Input:"
+		echo "\t$1"
+		exit 1
+	fi
+	expect "$1" "$2" 2> /dev/null
+}
+
 echo 'Testing simple octets'
 expect '11 22 33' '11 22 33'
 expect 'aa bb   cc' 'aa bb cc'
@@ -36,6 +49,17 @@ expect 'aa bb   cc' 'aa bb cc'
 echo 'Testing string literals'
 expect '"Hello"' '48 65 6c 6c 6f'
 expect '"Hel"   "lo"' '48 65 6c 6c 6f'
+expect 'u8"tab\there\x21\u00e9"' '74 61 62 09 68 65 72 65 21 c3 a9'
+expect 'u16le"Hi\U0001F600" u16be"\u00e9"' '48 00 69 00 3d d8 00 de 00 e9'
+expect 'u32"A" hexproc.endian = LE; u32"B"' '00 00 00 41 42 00 00 00'
+expect 'mutf8"a\0\U0001F600"' '61 c0 80 ed a0 bd ed b8 80'
+expect 'mutf8/2 "Code" u16le/4"\"Long enough for a word\""' '00 04 43 6f 64 65 18 00 00 00 22 00 4c 00 6f 00 6e 00 67 00 20 00 65 00 6e 00 6f 00 75 00 67 00 68 00 20 00 66 00 6f 00 72 00 20 00 61 00 20 00 77 00 6f 00 72 00 64 00 22 00'
+
+echo 'Testing comments'
+expect '11 /* 22 */ 33 // 44' '11 33'
+expect '11 /* 22
+33 */ 44' '11
+44'
 
 echo 'Testing formatters & expressions'
 expect '[int](1 + 2)' '00 00 00 03'
@@ -44,6 +68,50 @@ expect '[3,  int]3' '00 00 03'
 expect '[int](3 * (1 + 2))' '00 00 00 09'
 expect '[byte](2^3+1) [byte](0-2^4)' '09 f0'
 expect '[3](~0) [1](1~-1)' 'ff ff ff fe'
+expect '[byte]0x1f [byte]017 [byte]019 [byte]0b101 [short](010.5 * 2)' '1f 0f 13 05 00 15'
+expect '[8](0xfffffffffffffff1)' 'ff ff ff ff ff ff ff f1'
+expect_error '[8]0777777777777777777777777777777777777777777777777' '00 00 00 00 00 00 00 00'
+expect '[double]0x1ffffffffffffffffffffffffffffffff' '48 00 00 00 00 00 00 00'
+expect '[float]1.5 [double,LE](0-2) [short,LE]0x1234 [3,LE]0x123456' '3f c0 00 00 00 00 00 00 00 00 00 c0 34 12 56 34 12'
+
+echo 'Testing builtin functions'
+expect '[short]align(13, 8) [byte]min(3, 9) [byte]max(3, 9) [byte]log2(4096)' '00 10 03 09 0c'
+expect '[byte]clz(1) [byte]popcount(0xff00ff) [int]bswap32(0x12345678)' '3f 10 78 56 34 12'
+expect 'x = 5; [byte]select(x > 3, 10, 20) [byte](align(x, 4) * 2)' '0a 10'
+expect '[20]align((1 << 100) + 1, 1 << 64)' '00 00 00 00 00 00 00 10 00 00 00 01 00 00 00 00 00 00 00 00'
+if [ "$(echo '[byte]log2()' | "$exe" 2>&1 > /dev/null | grep -c 'takes 1 argument')" != 1 ]; then
+	echo "log2() wasn't reported as a call without arguments"
+	exit 1
+fi
+
+echo 'Testing wide formatters'
+expect '[int128](0-1)' 'ff ff ff ff ff ff ff ff ff ff ff ff ff ff ff ff'
+expect '[int128, LE](1 << 100)' '00 00 00 00 00 00 00 00 00 00 00 00 10 00 00 00'
+expect '[20](10 ^ 40 / 3)' '00 00 00 09 cb b8 a5 eb c9 8c 3f e3 e8 a7 20 55 55 55 55 55'
+expect 'k = 0x112233445566778899aabbccddeeff0011; [18](k + 1)' '00 11 22 33 44 55 66 77 88 99 aa bb cc dd ee ff 00 12'
+expect_error 'k := 0x112233445566778899aabbccddeeff0011; [18]k' '00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00'
+expect '[20](2 ^ 3)' '00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 08'
+expect '[float80](1.5)' '3f ff c0 00 00 00 00 00 00 00'
+expect '[float128, LE](0 - 2)' '00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 c0'
+expect '[float128](0.1) [float128](1e-4950)' '3f fb 99 99 99 99 99 99 99 99 99 99 99 99 99 9a 00 00 00 00 00 00 00 00 00 05 7c 96 47 e1 a0 18'
+
+echo 'Testing bit field formatters'
+expect '[bits 4 4](1, 2)' '21'
+expect '[bits 6 8 9 9, LE](1, 2, 3, 4)' '81 c0 00 02'
+expect '[bits 6 8 9 9, BE](1, 2, -1, 4)' '02 7f c0 81'
+expect '[bits 3 5]((1 + 1), 3)' '1a'
+expect '[bits 60 68, LE](1, 2)' '01 00 00 00 00 00 00 20 00 00 00 00 00 00 00 00'
+expect_error '[bits 0](1)' ''
+
+echo 'Testing array formatters'
+expect '[byte x 6](i * 3)' '00 03 06 09 0c 0f'
+expect '[short x2, LE](i + 0x100) [byte x3]1' '00 01 01 01 01 01 01'
+expect 's = 2; g = i * s; i := 9; [byte x4](g + 1) [byte]i' '01 03 05 07 09'
+expect '[int128 x2](i - 1) [float x2](i + 0.5)' 'ff ff ff ff ff ff ff ff ff ff ff ff ff ff ff ff 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 3f 00 00 00 3f c0 00 00'
+if [ "$(echo '[byte x 300](i)' | "$exe" -b | od -An -tu1 -v | awk '{for(f=1;f<=NF;f++){n++;s+=$f}} END {print n, s}')" != '300 33586' ]; then
+	echo "Array spanning several blocks was written incorrectly"
+	exit 1
+fi
 
 echo 'Testing variables'
 expect 'cc cc cc a: [byte]a' 'cc cc cc 03'
@@ -51,10 +119,288 @@ expect 'cc cc a: cc a: [byte]a' 'cc cc cc 03'
 expect 'a := 1; b = a; a := 2; [byte]b' '02'
 expect 'a := 1; b := a; a := 2; [byte]b' '01'
 expect 'a = 1; a := a + 1; [byte]a' '02'
+expect 'a := 0x123456789; [long]a' '00 00 00 01 23 45 67 89'
+expect 'a := -2; [short]a' 'ff fe'
+expect_error 'a := 1e300; [8]a' '00 00 00 00 00 00 00 00'
+expect_error 'a := 0/0; [byte]a' '00'
+
+echo 'Testing local labels'
+expect 'f1: [byte](@e - @s) @s: 11 22 @e: f2: [byte](@e - @s) @s: 33 @e:' '02 11 22 01 33'
+expect 'f1: @n := 5; n = @n + 1; f2: @n := 9; [byte]n [byte]@n' '06 09'
+expect 'f1: [short](@e - f1) 00 @e: f2: [byte]f2' '00 03 00 03'
+expect '@a := 7; f1: [byte]@a' '07'
+expect '.s: 11 f1: 22 f2: [byte].s' '11 22 00'
+
+echo 'Testing included files'
+blob="$(mktemp)"
+printf 'ABCDEFGH' > "$blob"
+expect "11 incbin \"$blob\" [2, 3] here: [byte]here incbin \"$blob\" [6]" '11 43 44 45 04 47 48'
+expect_error "incbin \"$blob\" [2, -5]" ''
+binary="$(echo "incbin \"$blob\" 0a" | "$exe" -b | od -An -c | tr -d ' ')"
+rm -f "$blob"
+if [ "$binary" != 'ABCDEFGH\n' ]; then
+	echo "Binary output of an included file differs: $binary"
+	exit 1
+fi
+
+echo 'Testing imported dumps'
+dump="$(mktemp)"
+printf ':020000040001F9\r\n:0400100001020304E2\r\n:02001600AABB83\r\n:00000001FF\r\n' > "$dump"
+expect "11 import ihex \"$dump\" end: [int]end" '11 01 02 03 04 ff ff aa bb 00 00 00 09'
+expect "import ihex \"$dump\" [0x1000c]" 'ff ff ff ff 01 02 03 04 ff ff aa bb'
+printf ':0400100001020304E3\n' > "$dump"
+expect "11 import ihex \"$dump\" 22" '11 22'
+printf '00000010: 4865 6c6c 6f2c 2077 6f72 6c64 2120 2020  Hello, world!   \n00000020: 0a                                       .\n' > "$dump"
+expect "import xxd \"$dump\" [0x0e]" 'ff ff 48 65 6c 6c 6f 2c 20 77 6f 72 6c 64 21 20 20 20 0a'
+printf '00000000: 03020100 07060504  ........\n00000008: 6c6c6548     216f  Hello!\n' > "$dump"
+expect "import xxd \"$dump\"" '00 01 02 03 04 05 06 07 48 65 6c 6c 6f 21'
+printf '00000000: 6c6c6548  lleH\n00000004: 6c6c6548  Hell\n' > "$dump"
+expect_error "import xxd \"$dump\"" ''
+printf '48656c6c6f2c20776f726c6421\n0A\n' > "$dump"
+expect "import xxd \"$dump\"" '48 65 6c 6c 6f 2c 20 77 6f 72 6c 64 21 0a'
+rm -f "$dump"
 
 echo 'Testing endian configuration'
 expect '[short]1 hexproc.endian := LE; [short]1' '00 01 01 00'
 expect '[short]1 hexproc.endian := LE; [short]1  hexproc.endian := BE; [short]1' '00 01 01 00 00 01'
 
+echo 'Testing memory limit'
+expected="$(seq 1 300000 | xxd -p | "$exe" | cksum)"
+actual="$(seq 1 300000 | xxd -p | "$exe" --max-memory 1M | cksum)"
+if [ "$expected" != "$actual" ]; then
+	echo "Output with --max-memory differs from unlimited output"
+	exit 1
+fi
+for size in -1 20000000000G; do
+	if echo '00' | "$exe" --max-memory $size > /dev/null 2>&1; then
+		echo "--max-memory accepted $size"
+		exit 1
+	fi
+done
+
+echo 'Testing pipelined mode'
+expected="$(seq 1 300000 | xxd -p | "$exe" | cksum)"
+actual="$(seq 1 300000 | xxd -p | "$exe" --pipeline | cksum)"
+if [ "$expected" != "$actual" ]; then
+	echo "Output with --pipeline differs from normal output"
+	exit 1
+fi
+expected="$(seq 1 3000 | sed 's/.*/[int](&*&)/' | "$exe" -b | cksum)"
+actual="$(seq 1 3000 | sed 's/.*/[int](&*&)/' | "$exe" -b --pipeline | cksum)"
+if [ "$expected" != "$actual" ]; then
+	echo "Binary output with --pipeline differs from normal output"
+	exit 1
+fi
+dir="$(mktemp -d)"
+if "$exe" --pipeline "$dir" > /dev/null 2>&1; then
+	echo "Read error with --pipeline wasn't reported in the exit status"
+	rm -rf "$dir"
+	exit 1
+fi
+rm -rf "$dir"
+if [ -w /dev/full ] && seq 1 300000 | xxd -p | "$exe" --pipeline > /dev/full 2> /dev/null; then
+	echo "Write error with --pipeline wasn't reported in the exit status"
+	exit 1
+fi
+
+echo 'Testing precompiled templates'
+dir="$(mktemp -d)"
+source="$dir/a.hxp"
+template="$dir/a.hxpc"
+printf 'x := 5\n"hi" [int](x * 2) [bits 4 4](1, 2)\nhere: [short]here y = 7\n[byte]y\n' > "$source"
+"$exe" --compile -o "$template" "$source"
+if [ "$("$exe" "$source")" != "$("$exe" "$template")" ]; then
+	echo "Output of precompiled template differs from its source"
+	rm -rf "$dir"
+	exit 1
+fi
+echo '[byte]1' >> "$source"
+if "$exe" "$template" > /dev/null 2>&1; then
+	echo "Precompiled template wasn't rejected after its source changed"
+	rm -rf "$dir"
+	exit 1
+fi
+printf '41 42\n' > "$dir/dump.txt"
+printf 'import xxd "%s"\n' "$dir/dump.txt" > "$source"
+"$exe" --compile -o "$template" "$source"
+printf '43 44\n' > "$dir/dump.txt"
+if "$exe" "$template" > /dev/null 2>&1; then
+	echo "Precompiled template wasn't rejected after an imported dump changed"
+	rm -rf "$dir"
+	exit 1
+fi
+printf 'blob' > "$dir/blob"
+printf 'incbin "%s" end: [byte]end\n' "$dir/blob" > "$source"
+"$exe" --compile -o "$template" "$source"
+printf 'longer blob' > "$dir/blob"
+if "$exe" "$template" > /dev/null 2>&1; then
+	echo "Precompiled template wasn't rejected after an included file changed its size"
+	rm -rf "$dir"
+	exit 1
+fi
+rm -rf "$dir"
+
+echo 'Testing objects'
+dir="$(mktemp -d)"
+printf 'start: "AB" [short]end\n' > "$dir/a.hxp"
+printf '[byte]start 11 end:\n' > "$dir/b.hxp"
+"$exe" --object -o "$dir/a.hxo" "$dir/a.hxp"
+"$exe" --object -o "$dir/b.hxo" "$dir/b.hxp"
+if [ "$("$exe" --link "$dir/a.hxo" "$dir/b.hxo")" != "$(cat "$dir/a.hxp" "$dir/b.hxp" | "$exe")" ]; then
+	echo "Output of linked objects differs from their concatenated sources"
+	rm -rf "$dir"
+	exit 1
+fi
+rm -rf "$dir"
+
+echo 'Testing definitions and variants'
+if [ "$(echo 'x = 1
+[byte]x' | "$exe" -D x=2+3)" != "$(printf '\n05')" ]; then
+	echo "-D didn't override the definition in the input"
+	exit 1
+fi
+if [ "$(printf 'x = 1\ny := x * 2\n[byte]x [byte]y\n' | "$exe" -D x=3)" != "$(printf '\n\n03 06')" ]; then
+	echo "-D didn't override the definition in immediate assignments"
+	exit 1
+fi
+dir="$(mktemp -d)"
+printf 'serial = 1\nkey = 0\n[byte]serial [byte](key + 1) [byte]7\n' > "$dir/in.hxp"
+printf 'serial, key\n2, 3\n4, 5\n' > "$dir/variants.csv"
+printf 'serial=6\nkey=7\n' > "$dir/variants.txt"
+"$exe" --variants "$dir/variants.csv" -j 2 -o "$dir/csv_{serial}" "$dir/in.hxp"
+"$exe" --variants "$dir/variants.txt" -o "$dir/pairs_{#}" "$dir/in.hxp"
+if [ "$(cat "$dir/csv_2" "$dir/csv_4" "$dir/pairs_1" "$dir/pairs_2")" != "$(printf '\n\n02 04 07\n\n\n04 06 07\n\n\n06 01 07\n\n\n01 08 07')" ]; then
+	echo "Variant outputs differ from the expected ones"
+	rm -rf "$dir"
+	exit 1
+fi
+printf 'serial = 1\ncheck := serial ^ 0x5a\n[byte]check\n' > "$dir/in.hxp"
+if "$exe" --variants "$dir/variants.csv" -o "$dir/check_{#}" "$dir/in.hxp" 2> /dev/null || [ -e "$dir/check_1" ]; then
+	echo "Immediate assignments could read variant labels"
+	rm -rf "$dir"
+	exit 1
+fi
+rm -rf "$dir"
+
+echo 'Testing server mode'
+dir="$(mktemp -d)"
+printf 'x = 3\n"ab" [short]x\n' > "$dir/in.hxp"
+"$exe" --serve "$dir/socket" -j 2 &
+server=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	[ -S "$dir/socket" ] && break
+	sleep 0.1
+done
+for i in 1 2; do
+	# the second request is served from the template cache
+	if [ "$("$exe" --connect "$dir/socket" "$dir/in.hxp")" != "$("$exe" "$dir/in.hxp")" ]; then
+		echo "Output from the server differs from normal output"
+		kill $server
+		rm -rf "$dir"
+		exit 1
+	fi
+done
+if [ "$(echo '[byte]x' | "$exe" --connect "$dir/socket" -D x=7)" != '07' ]; then
+	echo "Server didn't process inline input with definitions"
+	kill $server
+	rm -rf "$dir"
+	exit 1
+fi
+kill $server
+wait $server
+rm -rf "$dir"
+
+echo 'Testing multiple outputs'
+dir="$(mktemp -d)"
+printf 'start: "hi" [short]end\nend:\n' > "$dir/a.hxp"
+"$exe" --out-bin "$dir/a.bin" --out-hex "$dir/a.hex" --out-map "$dir/a.map" "$dir/a.hxp"
+if [ "$(cat "$dir/a.hex")" != "$("$exe" "$dir/a.hxp")" ] \
+		|| [ "$(od -An -tx1 "$dir/a.bin" | tr -s ' ' | sed 's/^ //')" != '68 69 00 04' ] \
+		|| [ "$(cat "$dir/a.map")" != "$(printf '00000000 4 %s:1\n00000000 start:\n00000004 end:' "$dir/a.hxp")" ]; then
+	echo "Outputs of a single run differ from separate runs"
+	rm -rf "$dir"
+	exit 1
+fi
+printf 'aa bb\nstart: [short]end\n# 10 "other.hxp"\ncc end:\ndd\n' > "$dir/a.hxp"
+"$exe" --out-map "$dir/a.map" "$dir/a.hxp" > /dev/null
+if [ "$(head -n 4 "$dir/a.map")" != "$(printf '00000000 2 %s:1\n00000002 2 %s:2\n00000004 1 other.hxp:10\n00000005 1 other.hxp:11' "$dir/a.hxp" "$dir/a.hxp")" ]; then
+	echo "Map doesn't follow line markers"
+	rm -rf "$dir"
+	exit 1
+fi
+rm -rf "$dir"
+
+echo 'Testing source maps'
+dir="$(mktemp -d)"
+printf '# 7 "top.hxp"\n"hi" [short]end\n00 01\nend:\n' | "$exe" --srcmap "$dir/a.srcmap" > /dev/null
+if [ "$("$exe" --where 3 "$dir/a.srcmap")" != 'top.hxp:7: formatter, bytes 0x2 to 0x3: end' ] \
+		|| [ "$("$exe" --where 0x5 "$dir/a.srcmap")" != 'top.hxp:8: octets, bytes 0x4 to 0x5' ] \
+		|| "$exe" --where 6 "$dir/a.srcmap" 2> /dev/null; then
+	echo "Source map doesn't lead back to the source lines"
+	rm -rf "$dir"
+	exit 1
+fi
+rm -rf "$dir"
+
+echo 'Testing check and diff'
+reference="$(mktemp)"
+printf '11 22\n33 05\n' > "$reference"
+if ! echo '11 22
+33 [byte]5' | "$exe" --check "$reference"; then
+	echo "--check reported a difference for identical output"
+	rm -f "$reference"
+	exit 1
+fi
+expect_diff="$(echo '11 22
+33 [byte]6' | "$exe" --diff "$reference")"
+printf '\021\042\063\005' > "$reference"
+mismatch="$(printf '11 22\n# 40 "inc.hxp"\n33\n06\n' | "$exe" -b --check "$reference" 2>&1)"
+rm -f "$reference"
+if [ "$mismatch" != "Output differs from \"$reference\" at offset 3 (0x3), input inc.hxp:41" ]; then
+	echo "Unexpected --check output: $mismatch"
+	exit 1
+fi
+if [ "$expect_diff" != '0x0000000a 0x00000001' ]; then
+	echo "Unexpected --diff output: $expect_diff"
+	exit 1
+fi
+if echo '11' | "$exe" --check /dev/null 2> /dev/null; then
+	echo "--check didn't report output beyond an empty reference"
+	exit 1
+fi
+reference="$(mktemp)"
+echo '11' > "$reference"
+if [ -w /dev/full ] && echo '11' | "$exe" --out-bin /dev/full --check "$reference" 2> /dev/null; then
+	echo "Write error with --check wasn't reported in the exit status"
+	rm -f "$reference"
+	exit 1
+fi
+rm -f "$reference"
+
+echo 'Testing profile'
+profile="$(mktemp)"
+echo 'a = 1 + 2; [byte]a' | "$exe" --profile "$profile" > /dev/null 2>&1
+if ! grep -q '^<stdin>:1;a [0-9]*$' "$profile"; then
+	echo "Profile doesn't contain the label chain of <stdin>:1"
+	rm -f "$profile"
+	exit 1
+fi
+rm -f "$profile"
+
+echo 'Testing debugger'
+source="$(mktemp)"
+printf 'debugger 11 22\n33\n44 55 66\n77\n' > "$source"
+session="$(printf 'b 3 if offset > 5\nb 4 if offset > 5\nr\n= offset\nv\nr\n' | "$exe" -d "$source" 2>&1 > /dev/null)"
+rm -f "$source"
+case "$session" in
+	*":3>"* | *"hexproc.offset"*)
+		echo "Conditional breakpoint used the wrong offset: $session"
+		exit 1;;
+	*":4>"*"= 6"*) ;;
+	*)
+		echo "Conditional breakpoint wasn't hit: $session"
+		exit 1;;
+esac
+
 echo '===================='
 echo 'All tests succeeded!'
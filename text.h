@@ -1,11 +1,11 @@
 #pragma once
 
-#include <ctype.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "charclass.h"
 #include "diagnostic.h"
 #include "formatter.h"
 
@@ -16,13 +16,10 @@ bool scan_char(const char *string, char expected) {
 }
 
 static int hex2int(char c) {
-	if('0' <= c && c <= '9')
-		return c - '0';
-	if('A' <= c && c <= 'F')
-		return c - 'A' + 10;
-	if('a' <= c && c <= 'f')
-		return c - 'a' + 10;
-	return -1;
+	// '0'-'9' are 0x3X and letters are 0x4X or 0x6X, so bit 6 tells them apart
+	if(!CHAR_IS(c, CC_HEX))
+		return -1;
+	return (c & 0xF) + (c >> 6) * 9;
 }
 
 size_t scan_octet(const char *string, int *out) {
@@ -42,7 +39,7 @@ size_t scan_octet(const char *string, int *out) {
 
 size_t scan_whitespace(const char *string) {
 	size_t i = 0;
-	while(isspace(string[i]))
+	while(CHAR_IS(string[i], CC_SPACE))
 		i++;
 	return i;
 }
@@ -79,25 +76,19 @@ size_t scan_quoted_string(const char *string) {
 		textfail = true;
 		return 0;
 	}
-	unsigned i = 1;
-	while(1) {
-		char c = string[i++];
-		if(c == '\0') {
-			report_error("Unfinished quoted string");
-			textfail = true;
-			i--;
-			break;
-		} else if(c == '"') {
-			break;
-		}
+	const char *end = strchr(string + 1, '"');
+	if(!end) {
+		report_error("Unfinished quoted string");
+		textfail = true;
+		return strlen(string);
 	}
-	return i;
+	return end - string + 1;
 }
 
 size_t scan_name(const char *string, const char **out) {
 	for(size_t i = 0; ; i++) {
 		char c = string[i];
-		bool namechar = c == '.' || c == '_' || isalnum(c);
+		bool namechar = CHAR_IS(c, CC_NAME);
 		if(!namechar) {
 			if(i > 0)
 				*out = strndup(string, i);
@@ -131,64 +122,13 @@ bool scan_line_marker(const char *line, uint64_t *linenum, const char **filename
 	return true;
 }
 
-static inline size_t line_len(const char *line) {
-	for(size_t i = 0; ; i++)
-		if(line[i] == '\0' || line[i] == ';')
-			return i;
-}
-
 void trim_end(const char *line, size_t *length) {
 	size_t remaining = *length;
-	while(remaining && isspace(line[remaining - 1]))
+	while(remaining && CHAR_IS(line[remaining - 1], CC_SPACE))
 		remaining--;
 	*length = remaining;
 }
 
-enum assign_mode {ASSIGN_LABEL, ASSIGN_LAZY, ASSIGN_IMMEDIATE};
-
-size_t try_scan_assign(const char *line, const char **key, const char **value, enum assign_mode *mode) {
-	size_t total_length = line_len(line);
-	const char *line_start = line;
-	line += scan_whitespace(line);
-
-	const char *k;
-	size_t key_length = scan_name(line, &k);
-	if(!key_length) {
-		return 0;
-	}
-	line += key_length;
-
-	line += scan_whitespace(line);
-	if(line[0] == '=') {
-		line++;
-		line += scan_whitespace(line);
-		size_t remaining = line_len(line);
-		trim_end(line, &remaining);
-		*key = k;
-		*value = strndup(line, remaining);
-		*mode = ASSIGN_LAZY;
-		return total_length;
-	} else if(line[0] == ':' && line[1] == '=') {
-		line += 2;
-		line += scan_whitespace(line);
-		size_t remaining = line_len(line);
-		trim_end(line, &remaining);
-		*key = k;
-		*value = strndup(line, remaining);
-		*mode = ASSIGN_IMMEDIATE;
-		return total_length;
-	} else if(line[0] == ':') {
-		line++;
-		*key = k;
-		*value = NULL;
-		*mode = ASSIGN_LABEL;
-		return line - line_start;;
-	} else {
-		free((char*) k);
-		return false;
-	}
-}
-
 size_t scan_formatter(const char *string, /* output: */ const char **out_fmt, const char **out_expr) {
 	const char *initial_string = string;
 
@@ -201,10 +141,20 @@ size_t scan_formatter(const char *string, /* output: */ const char **out_fmt, co
 
 	string += scan_whitespace(string);
 
-	if(string[0] == '(')
+	if(string[0] == '(') {
 		string += scan_balanced(string, &expr, "()");
-	else
+	} else {
+		const char *name = string;
 		string += scan_name(string, &expr);
+		if(!textfail && string[0] == '(') {
+			// a function call like [int]align(x, 4)
+			const char *args;
+			string += scan_balanced(string, &args, "()");
+			free((char*) expr);
+			free((char*) args);
+			expr = strndup(name, string - name);
+		}
+	}
 
 	if(!textfail) {
 		*out_fmt = fmt;
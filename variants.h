@@ -0,0 +1,429 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "charclass.h"
+#include "diagnostic.h"
+#include "hash.h"
+#include "label.h"
+#include "text.h"
+#include "formatter.h"
+#include "calc.h"
+
+/**
+ * This header implements '-D' and '--variants'. A variants file holds one
+ * set of label assignments per line, either as 'name=value' pairs or as
+ * CSV below a header line of names. The first pass runs once, then each
+ * variant rebinds its labels and the second pass is repeated. Results of
+ * formatters which can't depend on a variant label are kept from the
+ * first render instead of being evaluated again.
+ */
+
+#define DEPENDENCY_BUCKETS 256
+
+/* Definitions given with '-D', applied before and after the first pass */
+const char **definitions = NULL;
+size_t ndefinitions = 0;
+
+struct variant_table {
+	char **names;
+	size_t nnames;
+	char **values; // nrows * nnames entries, NULL if a row doesn't set the name
+	size_t nrows, values_cap;
+	// definitions from the template, restored if a row doesn't set the name
+	struct label *base;
+} variants = {0};
+
+/* Whether each label depends on a variant label */
+struct dependency {
+	char *name;
+	bool varies;
+	struct dependency *next;
+} **dependencies = NULL;
+
+/* Cached results of queued formatters */
+enum {CACHE_VARIES, CACHE_EMPTY, CACHE_FILLED} *formatter_cache_state = NULL;
+uint64_t *formatter_cache_pos = NULL;
+uint8_t *formatter_cache = NULL;
+
+/* Sets a lazy label from a "name=value" string, returns false if malformed */
+bool define_label(const char *definition) {
+	const char *name = NULL;
+	size_t len = scan_name(definition, &name);
+	if(!len || definition[len] != '=') {
+		OPTIONAL_FREE(name);
+		return false;
+	}
+	set_expr_label(name, strdup(definition + len + 1));
+	return true;
+}
+
+void add_definition(const char *definition) {
+	definitions = realloc(definitions, (ndefinitions + 1) * sizeof(definitions[0]));
+	definitions[ndefinitions++] = definition;
+}
+
+/* True if 'name' is defined with '-D', so the input can't assign it */
+bool has_definition(const char *name) {
+	size_t len = strlen(name);
+	for(size_t i = 0; i < ndefinitions; i++)
+		if(!strncmp(definitions[i], name, len) && definitions[i][len] == '=')
+			return true;
+	return false;
+}
+
+/* Applies the '-D' definitions, they take precedence over the template */
+bool apply_definitions(void) {
+	for(size_t i = 0; i < ndefinitions; i++) {
+		if(!define_label(definitions[i])) {
+			fprintf(stderr, "Invalid definition \"%s\", expected NAME=VALUE\n", definitions[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
+static size_t variant_name_index(const char *name) {
+	for(size_t i = 0; i < variants.nnames; i++)
+		if(!strcmp(variants.names[i], name))
+			return i;
+	return SIZE_MAX;
+}
+
+static size_t add_variant_name(const char *name, size_t len) {
+	char *copy = strndup(name, len);
+	size_t index = variant_name_index(copy);
+	if(index != SIZE_MAX) {
+		free(copy);
+		return index;
+	}
+	// widen the rows which have been read so far
+	size_t n = variants.nnames + 1;
+	char **values = calloc(variants.nrows * n + n, sizeof(values[0]));
+	for(size_t row = 0; row < variants.nrows && n > 1; row++)
+		memcpy(values + row * n, variants.values + row * (n - 1), (n - 1) * sizeof(values[0]));
+	free(variants.values);
+	variants.values = values;
+	variants.values_cap = variants.nrows * n + n;
+	variants.names = realloc(variants.names, n * sizeof(variants.names[0]));
+	variants.names[variants.nnames] = copy;
+	variants.nnames = n;
+	return n - 1;
+}
+
+static char **add_variant_row(void) {
+	size_t n = variants.nnames;
+	if((variants.nrows + 1) * n > variants.values_cap) {
+		variants.values_cap = 2 * (variants.nrows + 1) * n;
+		variants.values = realloc(variants.values, variants.values_cap * sizeof(variants.values[0]));
+	}
+	char **row = variants.values + variants.nrows++ * n;
+	if(n)
+		memset(row, 0, n * sizeof(row[0]));
+	return row;
+}
+
+static char *trimmed_copy(const char *text, size_t len) {
+	size_t skip = scan_whitespace(text);
+	skip = skip < len ? skip : len;
+	text += skip;
+	len -= skip;
+	trim_end(text, &len);
+	return strndup(text, len);
+}
+
+/* Reads one "name=value name=value" line */
+static bool parse_variant_pairs(char *line) {
+	char **row = add_variant_row();
+	for(char *token = strtok(line, " \t\r\n"); token; token = strtok(NULL, " \t\r\n")) {
+		const char *name = NULL;
+		size_t len = scan_name(token, &name);
+		OPTIONAL_FREE(name);
+		if(!len || token[len] != '=') {
+			report_error("Expected NAME=VALUE, got \"%s\"", token);
+			return false;
+		}
+		size_t index = add_variant_name(token, len);
+		row = variants.values + (variants.nrows - 1) * variants.nnames;
+		free(row[index]);
+		row[index] = strdup(token + len + 1);
+	}
+	return true;
+}
+
+/* Reads one line of comma separated values */
+static bool parse_variant_csv(const char *line, bool header) {
+	char **row = header ? NULL : add_variant_row();
+	size_t column = 0;
+	for(const char *field = line;; column++) {
+		size_t len = strcspn(field, ",");
+		if(header) {
+			const char *name = NULL;
+			size_t namelen = scan_name(field + scan_whitespace(field), &name);
+			OPTIONAL_FREE(name);
+			if(!namelen) {
+				report_error("Expected a label name in column %zu", column + 1);
+				return false;
+			}
+			add_variant_name(field + scan_whitespace(field), namelen);
+		} else if(column < variants.nnames) {
+			row[column] = trimmed_copy(field, len);
+		}
+		if(!field[len])
+			break;
+		field += len + 1;
+	}
+	if(!header && column + 1 != variants.nnames) {
+		report_error("Expected %zu values, got %zu", variants.nnames, column + 1);
+		return false;
+	}
+	return true;
+}
+
+/* Reads a variants file, returns false on failure */
+bool load_variants(const char *file_name) {
+	FILE *file = fopen(file_name, "r");
+	if(!file) {
+		fprintf(stderr, "Couldn't open file \"%s\" (error %d)\n", file_name, (int) errno);
+		return false;
+	}
+	const char *saved_file_name = current_file_name;
+	uint64_t saved_line_number = line_number;
+	current_file_name = file_name;
+	line_number = 0;
+
+	char *line = NULL;
+	size_t cap = 0;
+	bool ok = true, first = true, csv = false;
+	while(ok && getline(&line, &cap, file) != -1) {
+		line_number++;
+		const char *text = line + scan_whitespace(line);
+		if(!text[0] || text[0] == '#')
+			continue;
+		if(first)
+			csv = !strchr(text, '=');
+		ok = csv ? parse_variant_csv(text, first) : parse_variant_pairs(line);
+		first = false;
+	}
+	free(line);
+	fclose(file);
+	current_file_name = saved_file_name;
+	line_number = saved_line_number;
+	return ok;
+}
+
+/* First variant label read by 'calc_immediate', and whether any was */
+static const char *variant_label_read;
+bool immediate_reads_variant = false;
+
+static bool note_variant_label(const char *name, calc_float_t *out) {
+	(void) out;
+	size_t index = variant_name_index(name);
+	if(index != SIZE_MAX && !variant_label_read)
+		variant_label_read = variants.names[index];
+	return false;
+}
+
+/* Evaluates the value of the immediate assignment to 'name'. The first
+	pass only runs once, so reading a variant label is an error */
+calc_float_t calc_immediate(const char *name, const char *expr) {
+	if(!variants.nnames)
+		return calc(expr);
+	bool (*saved_hook)(const char*, calc_float_t*) = resolve_name_hook;
+	resolve_name_hook = note_variant_label;
+	variant_label_read = NULL;
+	calc_float_t result = calc(expr);
+	resolve_name_hook = saved_hook;
+	if(variant_label_read && !mathfail) {
+		report_error("Immediate assignment of \"%s\" can't read the variant label \"%s\"",
+			name, variant_label_read);
+		mathfail = true;
+		immediate_reads_variant = true;
+	}
+	return result;
+}
+
+/* Remembers the template's definitions of the variant labels */
+void capture_variant_base(void) {
+	variants.base = calloc(variants.nnames + 1, sizeof(variants.base[0]));
+	for(size_t i = 0; i < variants.nnames; i++) {
+		struct label l;
+		if(lookup_label(variants.names[i], &l)) {
+			variants.base[i] = l;
+			variants.base[i].name = variants.names[i];
+			variants.base[i].expr = l.expr ? strdup(l.expr) : NULL;
+		}
+	}
+}
+
+void apply_variant(size_t row) {
+	char **values = variants.values + row * variants.nnames;
+	for(size_t i = 0; i < variants.nnames; i++) {
+		struct label base = variants.base[i];
+		if(values[i])
+			set_expr_label(strdup(variants.names[i]), strdup(values[i]));
+		else if(base.name)
+			set_label(strdup(base.name), base.constant, base.expr ? strdup(base.expr) : NULL, base.offset);
+	}
+}
+
+/* Expands "{name}" to the variant's value and "{#}" to its number */
+char *expand_variant_path(const char *template, size_t row) {
+	size_t len = 0, cap = strlen(template) + 64;
+	char *path = malloc(cap);
+	char number[24];
+	while(template[0]) {
+		const char *piece = template;
+		size_t piecelen = 1;
+		const char *close = template[0] == '{' ? strchr(template, '}') : NULL;
+		if(close) {
+			size_t namelen = close - template - 1;
+			size_t index = SIZE_MAX;
+			for(size_t i = 0; i < variants.nnames; i++)
+				if(strlen(variants.names[i]) == namelen && !memcmp(variants.names[i], template + 1, namelen))
+					index = i;
+			if(namelen == 1 && template[1] == '#') {
+				snprintf(number, sizeof number, "%zu", row + 1);
+				piece = number;
+			} else if(index != SIZE_MAX) {
+				piece = variants.values[row * variants.nnames + index];
+				piece = piece ? piece : "";
+			} else {
+				close = NULL;
+			}
+		}
+		if(close) {
+			piecelen = strlen(piece);
+			template = close + 1;
+		} else {
+			template++;
+		}
+		if(len + piecelen + 1 > cap)
+			path = realloc(path, cap = 2 * (len + piecelen + 1));
+		memcpy(path + len, piece, piecelen);
+		len += piecelen;
+	}
+	path[len] = '\0';
+	return path;
+}
+
+static bool expr_varies(const char *expr);
+
+static bool label_varies(const char *name) {
+	if(variant_name_index(name) != SIZE_MAX)
+		return true;
+	unsigned bucket = strhash(name) & (DEPENDENCY_BUCKETS - 1);
+	for(struct dependency *d = dependencies[bucket]; d; d = d->next)
+		if(!strcmp(d->name, name))
+			return d->varies;
+	struct dependency *d = calloc(1, sizeof(struct dependency));
+	d->name = strdup(name);
+	d->next = dependencies[bucket];
+	dependencies[bucket] = d; // added before recursing, so cycles end here
+	struct label l;
+	if(lookup_label(name, &l) && l.expr)
+		d->varies = expr_varies(l.expr);
+	return d->varies;
+}
+
+static bool expr_varies(const char *expr) {
+	while(expr[0]) {
+		if(CHAR_IS(expr[0], CC_DIGIT)) {
+			while(CHAR_IS(expr[0], CC_ALPHA | CC_DIGIT) || expr[0] == '.')
+				expr++;
+		} else if(CHAR_IS(expr[0], CC_NAME)) {
+			const char *name = NULL;
+			expr += scan_name(expr, &name);
+			bool varies = label_varies(name);
+			free((char*) name);
+			if(varies)
+				return true;
+		} else {
+			expr++;
+		}
+	}
+	return false;
+}
+
+static bool formatter_varies(struct formatter fmt) {
+	size_t count = fmt.fields ? strlen((const char*) fmt.fields) : 1;
+	const char *expr = fmt.expr;
+	for(size_t i = 0; i < count; i++, expr += strlen(expr) + 1)
+		if(expr_varies(expr))
+			return true;
+	return false;
+}
+
+/* Finds the queued formatters whose results are the same for all variants */
+void plan_formatter_cache(void) {
+	dependencies = calloc(DEPENDENCY_BUCKETS, sizeof(dependencies[0]));
+	formatter_cache_state = malloc(formatqueue_len * sizeof(formatter_cache_state[0]) + 1);
+	formatter_cache_pos = malloc(formatqueue_len * sizeof(formatter_cache_pos[0]) + 1);
+	uint64_t size = 0;
+	for(size_t i = 0; i < formatqueue_len; i++) {
+		bool varies = formatter_varies(formatqueue[i]);
+		formatter_cache_state[i] = varies ? CACHE_VARIES : CACHE_EMPTY;
+		formatter_cache_pos[i] = size;
+		if(!varies)
+			size += FORMATTER_SIZE(formatqueue[i]);
+	}
+	formatter_cache = malloc(size + 1);
+}
+
+/* Copies the bytes of a formatter into the cache while passing them on */
+struct cache_fill {
+	uint8_t *pos;
+	emit_fn emit;
+	void *context;
+};
+
+static void emit_and_cache(const uint8_t *bytes, uint64_t len, void *context) {
+	struct cache_fill *fill = context;
+	memcpy(fill->pos, bytes, len);
+	fill->pos += len;
+	fill->emit(bytes, len, fill->context);
+}
+
+/* Evaluates the formatter with the given queue index, using cached results if possible */
+void evaluate_queued_formatter(size_t index, struct formatter fmt, emit_fn emit, void *context) {
+	if(!formatter_cache_state || index >= formatqueue_len
+			|| formatter_cache_state[index] == CACHE_VARIES) {
+		evaluate_formatter(fmt, emit, context);
+	} else if(formatter_cache_state[index] == CACHE_FILLED) {
+		emit(formatter_cache + formatter_cache_pos[index], FORMATTER_SIZE(fmt), context);
+	} else {
+		struct cache_fill fill = {formatter_cache + formatter_cache_pos[index], emit, context};
+		evaluate_formatter(fmt, emit_and_cache, &fill);
+		formatter_cache_state[index] = CACHE_FILLED;
+	}
+}
+
+void cleanup_variants(void) {
+	for(size_t i = 0; i < variants.nrows * variants.nnames; i++)
+		OPTIONAL_FREE(variants.values[i]);
+	for(size_t i = 0; variants.base && i < variants.nnames; i++)
+		OPTIONAL_FREE(variants.base[i].expr);
+	for(size_t i = 0; i < variants.nnames; i++)
+		OPTIONAL_FREE(variants.names[i]);
+	OPTIONAL_FREE(variants.values);
+	OPTIONAL_FREE(variants.names);
+	OPTIONAL_FREE(variants.base);
+	for(unsigned i = 0; dependencies && i < DEPENDENCY_BUCKETS; i++) {
+		struct dependency *d = dependencies[i];
+		while(d) {
+			struct dependency *next = d->next;
+			OPTIONAL_FREE(d->name);
+			OPTIONAL_FREE(d);
+			d = next;
+		}
+	}
+	OPTIONAL_FREE(dependencies);
+	OPTIONAL_FREE(formatter_cache_state);
+	OPTIONAL_FREE(formatter_cache_pos);
+	OPTIONAL_FREE(formatter_cache);
+	OPTIONAL_FREE(definitions);
+}
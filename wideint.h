@@ -0,0 +1,425 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "charclass.h"
+#include "diagnostic.h"
+#include "largenum.h"
+#include "label.h"
+#include "calc.h"
+
+/**
+ * This header implements fixed-width integers made of 64-bit limbs
+ * and an evaluator for expressions which are too wide for calc_int_t.
+ * Values use two's complement and wrap around on overflow.
+ */
+
+#define WIDE_LIMBS 16
+#define WIDE_BYTES (WIDE_LIMBS * 8)
+
+struct wideint {
+	uint64_t limb[WIDE_LIMBS]; // least significant first
+};
+
+struct wideint wide_from_int(calc_int_t x) {
+	struct wideint w;
+	uint64_t fill = x < 0 ? UINT64_MAX : 0;
+	for(unsigned i = 0; i < WIDE_LIMBS; i++) {
+		w.limb[i] = i * 64 < 8 * sizeof(calc_int_t) ? (uint64_t)(x >> (i * 64)) : fill;
+	}
+	return w;
+}
+
+bool wide_is_negative(struct wideint a) {
+	return a.limb[WIDE_LIMBS - 1] >> 63;
+}
+
+bool wide_is_zero(struct wideint a) {
+	for(unsigned i = 0; i < WIDE_LIMBS; i++)
+		if(a.limb[i])
+			return false;
+	return true;
+}
+
+struct wideint wide_add(struct wideint a, struct wideint b) {
+	uint64_t carry = 0;
+	for(unsigned i = 0; i < WIDE_LIMBS; i++) {
+		uint64_t sum = a.limb[i] + carry;
+		carry = sum < carry;
+		a.limb[i] = sum + b.limb[i];
+		carry += a.limb[i] < sum;
+	}
+	return a;
+}
+
+struct wideint wide_not(struct wideint a) {
+	for(unsigned i = 0; i < WIDE_LIMBS; i++)
+		a.limb[i] = ~a.limb[i];
+	return a;
+}
+
+struct wideint wide_neg(struct wideint a) {
+	return wide_add(wide_not(a), wide_from_int(1));
+}
+
+struct wideint wide_sub(struct wideint a, struct wideint b) {
+	return wide_add(a, wide_neg(b));
+}
+
+struct wideint wide_mul(struct wideint a, struct wideint b) {
+	struct wideint r = {{0}};
+	for(unsigned i = 0; i < WIDE_LIMBS; i++) {
+		if(!a.limb[i])
+			continue;
+		uint64_t carry = 0;
+		for(unsigned j = 0; i + j < WIDE_LIMBS; j++) {
+			// split into 32-bit halves to avoid depending on a 128-bit type
+			uint64_t x = a.limb[i], y = b.limb[j];
+			uint64_t lo = (x & 0xFFFFFFFF) * (y & 0xFFFFFFFF);
+			uint64_t mid1 = (x >> 32) * (y & 0xFFFFFFFF);
+			uint64_t mid2 = (x & 0xFFFFFFFF) * (y >> 32);
+			uint64_t hi = (x >> 32) * (y >> 32);
+			uint64_t mid = (lo >> 32) + (mid1 & 0xFFFFFFFF) + (mid2 & 0xFFFFFFFF);
+			uint64_t low = (lo & 0xFFFFFFFF) | (mid << 32);
+			hi += (mid1 >> 32) + (mid2 >> 32) + (mid >> 32);
+
+			uint64_t sum = r.limb[i + j] + low;
+			hi += sum < low;
+			sum += carry;
+			hi += sum < carry;
+			r.limb[i + j] = sum;
+			carry = hi;
+		}
+	}
+	return r;
+}
+
+struct wideint wide_shl(struct wideint a, unsigned n) {
+	struct wideint r = {{0}};
+	unsigned limbs = n / 64, bits = n % 64;
+	for(unsigned i = WIDE_LIMBS; i-- > limbs;) {
+		r.limb[i] = a.limb[i - limbs] << bits;
+		if(bits && i - limbs > 0)
+			r.limb[i] |= a.limb[i - limbs - 1] >> (64 - bits);
+	}
+	return r;
+}
+
+/* Arithmetic (sign-extending) shift right */
+struct wideint wide_shr(struct wideint a, unsigned n) {
+	uint64_t fill = wide_is_negative(a) ? UINT64_MAX : 0;
+	struct wideint r;
+	unsigned limbs = n / 64, bits = n % 64;
+	for(unsigned i = 0; i < WIDE_LIMBS; i++) {
+		uint64_t cur = i + limbs < WIDE_LIMBS ? a.limb[i + limbs] : fill;
+		uint64_t next = i + limbs + 1 < WIDE_LIMBS ? a.limb[i + limbs + 1] : fill;
+		r.limb[i] = bits ? (cur >> bits) | (next << (64 - bits)) : cur;
+	}
+	return r;
+}
+
+/* Number of bits up to the highest set bit, 0 for zero */
+unsigned wide_bit_length(struct wideint a) {
+	for(unsigned i = WIDE_LIMBS; i-- > 0;)
+		if(a.limb[i])
+			return i * 64 + 64 - clz64(a.limb[i]);
+	return 0;
+}
+
+/* Signed comparison, returns -1, 0 or 1 */
+int wide_cmp(struct wideint a, struct wideint b) {
+	bool na = wide_is_negative(a), nb = wide_is_negative(b);
+	if(na != nb)
+		return na ? -1 : 1;
+	for(unsigned i = WIDE_LIMBS; i-- > 0;)
+		if(a.limb[i] != b.limb[i])
+			return a.limb[i] < b.limb[i] ? -1 : 1;
+	return 0;
+}
+
+/* Truncating signed division, like in C */
+void wide_divmod(struct wideint a, struct wideint b, struct wideint *quot, struct wideint *rem) {
+	bool na = wide_is_negative(a), nb = wide_is_negative(b);
+	if(na)
+		a = wide_neg(a);
+	if(nb)
+		b = wide_neg(b);
+	struct wideint q = {{0}}, r = {{0}};
+	for(unsigned i = WIDE_LIMBS * 64; i-- > 0;) {
+		r = wide_shl(r, 1);
+		r.limb[0] |= (a.limb[i / 64] >> (i % 64)) & 1;
+		// unsigned comparison, both values are non-negative or wrapped
+		bool ge = true;
+		for(unsigned j = WIDE_LIMBS; j-- > 0;) {
+			if(r.limb[j] != b.limb[j]) {
+				ge = r.limb[j] > b.limb[j];
+				break;
+			}
+		}
+		if(ge) {
+			r = wide_sub(r, b);
+			q.limb[i / 64] |= (uint64_t)1 << (i % 64);
+		}
+	}
+	*quot = na != nb ? wide_neg(q) : q;
+	*rem = na ? wide_neg(r) : r;
+}
+
+/* Converts a float to the nearest wide integer towards zero */
+struct wideint wide_from_float(calc_float_t x) {
+	if(!isfinite(x)) {
+		report_error("%Lf cannot be converted to an integer", (long double)x);
+		return wide_from_int(0);
+	}
+	if(fits_integer(x))
+		return wide_from_int((calc_int_t)x);
+	// too large for calc_int_t, take it apart 32 bits at a time
+	bool negative = x < 0;
+	if(negative)
+		x = -x;
+	unsigned exponent = 0;
+	while(x >= 4294967296.0) {
+		x /= 4294967296.0;
+		exponent += 32;
+	}
+	struct wideint r = {{0}};
+	while(1) {
+		uint64_t digit = (uint64_t)x;
+		r = wide_add(r, wide_shl(wide_from_int(digit), exponent));
+		x = (x - digit) * 4294967296.0;
+		if(exponent < 32 || x == 0)
+			break;
+		exponent -= 32;
+	}
+	return negative ? wide_neg(r) : r;
+}
+
+static int wide_digit(char c) {
+	if('0' <= c && c <= '9')
+		return c - '0';
+	if('a' <= c && c <= 'z')
+		return c - 'a' + 10;
+	if('A' <= c && c <= 'Z')
+		return c - 'A' + 10;
+	return 99;
+}
+
+/* Parses an integer literal exactly, returns the number of characters
+	consumed or 0 if the literal is not an integer */
+size_t wide_parse(const char *text, struct wideint *out) {
+	size_t i;
+	unsigned base = literal_base(text, &i);
+	struct wideint r = {{0}}, b = wide_from_int(base);
+	bool overflow = false;
+	for(; wide_digit(text[i]) < base; i++) {
+		if(r.limb[WIDE_LIMBS - 1] >> 60)
+			overflow = true;
+		r = wide_add(wide_mul(r, b), wide_from_int(wide_digit(text[i])));
+	}
+	if(text[i] == '.' || CHAR_IS(text[i], CC_ALPHA | CC_DIGIT))
+		return 0; // fraction, exponent or suffix
+	if(overflow)
+		report_error("Integer literal is wider than %d bytes", WIDE_BYTES);
+	*out = r;
+	return i;
+}
+
+bool wide_calc(const char *expr, struct wideint *out);
+
+/* Resolves a name like 'resolve_name', but evaluates lazy labels exactly */
+bool wide_resolve_name(const char *name, struct wideint *out) {
+	struct label label;
+	if(!lookup_label(name, &label)) {
+		report_error("Unknown identifier: \"%s\"", name);
+		return false;
+	}
+	if(!label.expr) {
+		*out = wide_from_int(label.constant);
+		return true;
+	}
+	if(namestack_contains(name)) {
+		report_error("Recursive label: \"%s\"", name);
+		return false;
+	}
+	namestack_push(name);
+	if(profile_mode)
+		profile_enter();
+	bool ok = wide_calc(label.expr, out);
+	if(profile_mode)
+		profile_leave(namestack, namestack_len);
+	namestack_pop();
+	return ok;
+}
+
+struct wideint wide_op_eval(int op, struct wideint a, struct wideint b) {
+	struct wideint q, r;
+	switch(op) {
+		case '+': return wide_add(a, b);
+		case '-': return wide_sub(a, b);
+		case '*': return wide_mul(a, b);
+		case '/':
+		case '%': {
+			if(wide_is_zero(b)) {
+				report_error("Division by zero");
+				return wide_from_int(0);
+			}
+			wide_divmod(a, b, &q, &r);
+			return op == '/' ? q : r;
+		}
+		case '^': {
+			r = wide_from_int(1);
+			if(wide_is_negative(b))
+				return wide_from_int(0);
+			// the squares above the highest bit of the exponent aren't needed
+			unsigned bits = wide_bit_length(b);
+			for(unsigned i = 0; i < bits; i++) {
+				if((b.limb[i / 64] >> (i % 64)) & 1)
+					r = wide_mul(r, a);
+				if(i + 1 < bits)
+					a = wide_mul(a, a);
+			}
+			return r;
+		}
+		case '&':
+		case '|':
+		case '~': {
+			for(unsigned i = 0; i < WIDE_LIMBS; i++)
+				a.limb[i] = op == '&' ? a.limb[i] & b.limb[i]
+					: op == '|' ? a.limb[i] | b.limb[i]
+					: a.limb[i] ^ b.limb[i];
+			return a;
+		}
+		case OP_CODE('>', '>'):
+		case OP_CODE('<', '<'): {
+			unsigned n = wide_is_negative(b) ? 0
+				: wide_cmp(b, wide_from_int(WIDE_LIMBS * 64)) >= 0 ? WIDE_LIMBS * 64
+				: (unsigned)b.limb[0];
+			if(n >= WIDE_LIMBS * 64)
+				return op == OP_CODE('<', '<') || !wide_is_negative(a)
+					? wide_from_int(0) : wide_from_int(-1);
+			return op == OP_CODE('<', '<') ? wide_shl(a, n) : wide_shr(a, n);
+		}
+		case OP_CODE('!', '='): return wide_from_int(wide_cmp(a, b) != 0);
+		case OP_CODE('=', '='): return wide_from_int(wide_cmp(a, b) == 0);
+		case OP_CODE('>', '='): return wide_from_int(wide_cmp(a, b) >= 0);
+		case OP_CODE('<', '='): return wide_from_int(wide_cmp(a, b) <= 0);
+		case '<': return wide_from_int(wide_cmp(a, b) < 0);
+		case '>': return wide_from_int(wide_cmp(a, b) > 0);
+		default: {
+			mathfail = true;
+			report_error("Bad operator ((char)%d = '%c')",
+				(int)op, (char)op);
+			return wide_from_int(0);
+		};
+	}
+}
+
+/* Applies the builtin function exactly, the bit operations
+	look at the low 64 bits like in 'builtin_eval' */
+struct wideint wide_builtin_eval(int fn, const struct wideint *args) {
+	uint64_t word = args[0].limb[0];
+	struct wideint q, r;
+	switch(fn) {
+		case FN_ALIGN:
+			if(wide_is_negative(args[1]) || wide_is_zero(args[1])) {
+				report_error("Alignment must be positive");
+				break;
+			}
+			wide_divmod(args[0], args[1], &q, &r);
+			r = wide_sub(args[0], r);
+			return wide_is_negative(args[0]) || wide_is_zero(wide_sub(args[0], r)) ? r
+				: wide_add(r, args[1]);
+		case FN_MIN: return wide_cmp(args[0], args[1]) < 0 ? args[0] : args[1];
+		case FN_MAX: return wide_cmp(args[0], args[1]) > 0 ? args[0] : args[1];
+		case FN_LOG2:
+			if(wide_is_negative(args[0]) || wide_is_zero(args[0])) {
+				report_error("log2 of a number which isn't positive");
+				break;
+			}
+			return wide_from_int(wide_bit_length(args[0]) - 1);
+		case FN_CLZ: return wide_from_int(word ? clz64(word) : 64);
+		case FN_POPCOUNT: return wide_from_int(popcount64(word));
+		case FN_BSWAP16: return wide_from_int(bswap64(word) >> 48);
+		case FN_BSWAP32: return wide_from_int(bswap64(word) >> 32);
+		case FN_BSWAP64:
+			r = wide_from_int(0);
+			r.limb[0] = bswap64(word);
+			return r;
+		case FN_SELECT: return wide_is_zero(args[0]) ? args[2] : args[1];
+	}
+	mathfail = true;
+	return wide_from_int(0);
+}
+
+/* Evaluates an expression with integer arithmetic only,
+	returns false on failure */
+bool wide_calc(const char *expr, struct wideint *out) {
+	if(profile_mode)
+		profile_count_call();
+	struct yard yard = {0};
+	if(!yard_parse(&yard, expr)) {
+		yard_free_names(yard.queue, yard.qlen);
+		return false;
+	}
+	struct wideint stack[OPERAND_STACK_SIZE];
+	unsigned len = 0;
+	bool ok = true;
+	for(unsigned i = 0; i < yard.qlen; i++) {
+		struct yard_value v = yard.queue[i];
+		if(v.kind == YARD_NUM && v.text && !wide_parse(v.text, &stack[0])) {
+			// literals with a fraction or exponent need float arithmetic
+			yard_free_names(yard.queue, yard.qlen);
+			allow_wide_literals = true;
+			calc_float_t result = calc(expr);
+			allow_wide_literals = false;
+			*out = wide_from_float(result);
+			return !mathfail;
+		}
+	}
+	for(unsigned i = 0; ok && i < yard.qlen; i++) {
+		struct yard_value v = yard.queue[i];
+		struct wideint x;
+		if(v.kind == YARD_NUM) {
+			if(!v.text || !wide_parse(v.text, &x))
+				x = wide_from_float(v.content.num);
+		} else if(v.kind == YARD_NAME) {
+			ok = wide_resolve_name(v.content.name, &x);
+		} else if(IS_BUILTIN(v.content.op)) {
+			unsigned n = builtins[v.content.op].arity;
+			if(len < n) {
+				report_error("Operand stack underflow");
+				ok = false;
+				break;
+			}
+			len -= n;
+			x = wide_builtin_eval(v.content.op, stack + len);
+			ok = !mathfail;
+		} else {
+			if(len < 2) {
+				report_error("Operand stack underflow");
+				ok = false;
+				break;
+			}
+			len -= 2;
+			x = wide_op_eval(v.content.op, stack[len], stack[len + 1]);
+			ok = !mathfail;
+		}
+		if(len >= OPERAND_STACK_SIZE) {
+			report_error("Operand stack overflow");
+			ok = false;
+			break;
+		}
+		stack[len++] = x;
+	}
+	if(ok && len != 1) {
+		report_error("Operand stack underflow");
+		ok = false;
+	}
+	yard_free_names(yard.queue, yard.qlen);
+	if(ok)
+		*out = stack[0];
+	return ok;
+}